@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+
+# Generate precompressed .gz, .br and .zst sidecars for the text assets under public/
+# so serve_file() can hand them out without compressing on the fly.
+# Only sidecars that are missing or older than their source are rebuilt.
+
+# Exit the script if any command fails
+set -e
+
+public_dir="public"
+
+# Function to display script usage
+usage()
+{
+    echo "Usage: $0 [-d <public directory>]"
+    echo "  -d public directory   Directory to scan (default: public)"
+    exit 1
+}
+
+while getopts ":d:" opt; do
+  case $opt in
+    d)
+      public_dir="$OPTARG"
+      ;;
+    \?)
+      echo "Invalid option: -$OPTARG" >&2
+      usage
+      ;;
+    :)
+      echo "Option -$OPTARG requires an argument." >&2
+      usage
+      ;;
+  esac
+done
+
+if [ ! -d "$public_dir" ]; then
+  echo "Error: $public_dir does not exist."
+  exit 1
+fi
+
+# compress <source> <sidecar> <command...>
+compress()
+{
+    local source="$1"
+    local sidecar="$2"
+    shift 2
+
+    if [ -f "$sidecar" ] && [ ! "$source" -nt "$sidecar" ]; then
+        return
+    fi
+
+    "$@" < "$source" > "$sidecar.tmp"
+    # keep the source mtime so the server never sees the sidecar as stale
+    touch -r "$source" "$sidecar.tmp"
+    mv "$sidecar.tmp" "$sidecar"
+    echo "Compressed $sidecar"
+}
+
+have_brotli=false
+have_zstd=false
+
+if command -v brotli > /dev/null 2>&1; then
+  have_brotli=true
+else
+  echo "brotli not found, skipping .br sidecars"
+fi
+
+if command -v zstd > /dev/null 2>&1; then
+  have_zstd=true
+else
+  echo "zstd not found, skipping .zst sidecars"
+fi
+
+# extensions must match the compressible types in get_content_type()
+find "$public_dir" -type f \( -name "*.html" -o -name "*.css" -o -name "*.js" \) -print0 |
+while IFS= read -r -d '' file; do
+    compress "$file" "$file.gz" gzip -9 -n -c
+
+    if [ "$have_brotli" = true ]; then
+        compress "$file" "$file.br" brotli -q 11 -c
+    fi
+
+    if [ "$have_zstd" = true ]; then
+        compress "$file" "$file.zst" zstd -19 -q -c
+    fi
+done
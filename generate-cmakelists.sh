@@ -45,8 +45,13 @@ generate_cmake_content() {
         fi
     done
 
-    # Add executable
-    echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+    # Add executable, or a shared library next to the sources for lib* entities
+    if [[ $entity == lib* ]]; then
+        echo "add_library($entity SHARED \${${entity}_SOURCES})" >> "$output_file"
+        echo "set_target_properties($entity PROPERTIES PREFIX \"\" SUFFIX \".so\" LIBRARY_OUTPUT_DIRECTORY \${CMAKE_SOURCE_DIR}/src)" >> "$output_file"
+    else
+        echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+    fi
     echo "target_include_directories($entity PRIVATE /usr/local/include) " >> "$output_file"
     echo "target_include_directories($entity PUBLIC \${CMAKE_SOURCE_DIR}/include)" >> "$output_file"
 
@@ -0,0 +1,17 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_MAX_CPUS 1024
+
+// one cpu per physical core, ordered by NUMA node so consecutive workers stay on the same socket
+struct cpu_topology
+{
+    int count;
+    int cpus[AFFINITY_MAX_CPUS];
+    int nodes[AFFINITY_MAX_CPUS];
+};
+
+int affinity_detect(struct cpu_topology *topology);
+int affinity_place(const struct cpu_topology *topology, int slot_index);
+
+#endif
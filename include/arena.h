@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16
+
+// an allocation too large for what was left of the block, taken from malloc and freed on the next reset.
+// the header keeps what follows it aligned like the block
+struct arena_spill
+{
+    struct arena_spill *next;
+    size_t              size;
+};
+
+// bump allocator for everything a request needs beyond the fixed buffers of handler_ctx. one per worker
+// thread, the block is allocated once and reset after every request, so nothing is freed one by one and
+// an early return cannot leak. the counters are only kept up to date in builds without NDEBUG, they are
+// always there so a debug library can be loaded into a release worker and the other way round
+struct arena
+{
+    char               *base;
+    size_t              size;
+    size_t              used;
+    struct arena_spill *spills;
+    size_t              high_water;    // most of the block a single request used
+    uint64_t            requests;      // resets since the arena was created
+    uint64_t            spilled;       // allocations that did not fit and went to malloc
+};
+
+int   arena_init(struct arena *arena, size_t size);
+void  arena_destroy(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+void  arena_reset(struct arena *arena);
+
+#endif
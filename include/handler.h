@@ -0,0 +1,41 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include "timer.h"
+#include <semaphore.h>
+#include <stdint.h>
+
+#define HANDLER_BUFFER_SIZE 4096
+#define HANDLER_TOKEN_SIZE 16
+#define HANDLER_ARENA_SIZE 131072    // fits a /metrics page, larger requests spill to malloc
+
+struct arena;
+struct pool_shared;
+struct scoreboard_thread;
+struct uring;
+struct worker_metrics;
+
+// everything a call to worker_handle_so works in. every worker thread owns one, so the library
+// keeps no state of its own between calls and several threads can run it at once
+struct handler_ctx
+{
+    sem_t                    *sem;                             // guards the database across processes and threads
+    struct uring             *uring;                           // this thread's io_uring, NULL when the kernel has none
+    struct pool_shared       *pool;                            // counters shown on /metrics, NULL outside a worker
+    struct worker_metrics    *metrics;                         // stage histograms of this worker's slot, NULL to not record
+    struct scoreboard_thread *scoreboard;                      // this thread's row on /server-status, NULL to not report
+    struct arena             *arena;                           // scratch memory for one request, reset when the call returns
+    uint64_t                  parsed_ns;                       // when the request was parsed, 0 if it never was
+    uint64_t                  locked_ns;                       // when the database semaphore was last taken
+    uint64_t                  database_ns;                     // time waiting for and holding the database in this call
+    int                       header_timeout_ms;               // how long the request headers may take to arrive
+    int                       timeout;                         // TIMEOUT_ kind that ended the last call, TIMEOUT_NONE if none did
+    int                       peer_sock;                       // the client's own socket, not the relay under TLS. -1 outside a worker
+    char                      padding[4];
+    char                      request[HANDLER_BUFFER_SIZE];    // raw request as read from the socket
+    char                      uri[HANDLER_BUFFER_SIZE];
+    char                      method[HANDLER_TOKEN_SIZE];
+    char                      version[HANDLER_TOKEN_SIZE];
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// log-linear buckets in the HdrHistogram layout. values below HISTOGRAM_SUB_COUNT get a bucket each,
+// every power of two above that is split into HISTOGRAM_SUB_COUNT buckets, so any recorded value is
+// off by less than 1 / HISTOGRAM_SUB_COUNT of itself. values past 2^HISTOGRAM_MAX_BITS land in the last bucket
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+void     histogram_init(struct histogram *histogram);
+void     histogram_record(struct histogram *histogram, uint64_t value);
+void     histogram_merge(struct histogram *into, const struct histogram *from);
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+double   histogram_mean(const struct histogram *histogram);
+void     histogram_print(const struct histogram *histogram, FILE *out, double unit);
+int      histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_highest(int index);
+
+#endif
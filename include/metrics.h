@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "histogram.h"
+#include "pool.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// where a request spends its time, in order. the first two are measured with the timestamps the dispatcher
+// sends along with the fd, the rest inside the worker
+#define STAGE_QUEUE 0        // accepted until handed to a worker, mostly waiting for the request to arrive
+#define STAGE_HANDOFF 1      // handed over until a worker thread starts on it
+#define STAGE_PARSE 2        // reading and parsing the request
+#define STAGE_LOCK_WAIT 3    // waiting for the database semaphore
+#define STAGE_DATABASE 4     // dbm calls, with the semaphore held
+#define STAGE_WRITE 5        // the rest of the handler, mostly writing the response
+#define STAGE_TOTAL 6        // accepted until the worker was done with it
+#define STAGE_COUNT 7
+
+// the two sides of a canary rollout, told apart by the library generation the worker runs
+#define VERSION_BASELINE 0
+#define VERSION_CANARY 1
+#define VERSION_COUNT 2
+
+// the same buckets as struct histogram, updated with relaxed atomic adds so the threads of a worker can share one
+// and the /metrics request can read all of them while they are written. recording costs two uncontended adds
+struct stage_histogram
+{
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t counts[HISTOGRAM_BUCKETS];
+};
+
+struct worker_metrics
+{
+    struct stage_histogram stages[STAGE_COUNT];
+};
+
+// handler latency and failures over all workers running one side, only kept while a canary runs
+struct version_stats
+{
+    atomic_uint_least64_t errors;
+    atomic_uint_least64_t counts[HISTOGRAM_BUCKETS];
+};
+
+// a mapping of its own next to pool_shared, indexed by worker slot. it is large but only the
+// buckets that are ever hit get touched, so it costs little resident memory
+struct metrics_shared
+{
+    struct worker_metrics workers[POOL_MAX_WORKERS];
+    struct version_stats  versions[VERSION_COUNT];
+};
+
+struct metrics_shared *metrics_create(void);
+void                   metrics_destroy(struct metrics_shared *metrics);
+uint64_t               metrics_now(void);
+void                   metrics_record(struct worker_metrics *metrics, int stage, uint64_t elapsed_ns);
+uint64_t               metrics_lap(struct worker_metrics *metrics, int stage, uint64_t since);
+void                   metrics_record_version(struct pool_shared *pool, const struct worker_slot *slot, uint64_t elapsed_ns, int failed);
+void                   metrics_reset_versions(struct metrics_shared *metrics);
+uint64_t               metrics_read_version(const struct metrics_shared *metrics, int version, struct histogram *histogram);
+size_t                 metrics_render(const struct pool_shared *pool, char *out, size_t max_len);
+
+#endif
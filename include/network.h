@@ -1,17 +1,54 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include "ring.h"
+#include "timer.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <stdint.h>
+
+#define MAX_LISTENERS 4    // -l given more than once
+
+// fds[0] to fds[MAX_LISTENERS - 1] are the listening sockets, -1 where unused, then the completion
+// wakeup. the clients follow
+#define POLL_WAKE MAX_LISTENERS
+#define POLL_CLIENT_BASE (MAX_LISTENERS + 1)
+
+struct trace_shared;
 
-int            initialize_socket(void);
+// sent along with every fd, the worker times the stages before it from these
+struct handoff
+{
+    uint64_t accepted_ns;    // when the dispatcher accepted the connection
+    uint64_t sent_ns;        // when the dispatcher passed it on
+    uint64_t request_id;     // ties the spans of the dispatcher and the worker together
+    int      original_fd;    // the number the dispatcher knows the fd by
+    int      traced;         // sampled for the trace buffer
+};
+
+// what the dispatcher keeps per client, both arrays indexed by fd and grown together
+struct client_index
+{
+    uint64_t *accepted_at;    // accept time, sent along to the worker
+    nfds_t   *slot;           // position in client_sockets, so a client is found without a scan
+    int       capacity;
+    char      padding[4];
+};
+
+int            initialize_socket(const char *address);
+int            socket_family(int sockfd);
 int            accept_clients(int domain_sock, int server_sock, struct sockaddr_in client_addr, socklen_t client_addrlen);
-void           send_fd(int domain_socket, int fd);
-int            recv_fd(int socket, int *og_fd);
-struct pollfd *initialize_pollfds(int sockfd, int **client_sockets);
-void           handle_new_connection(int sockfd, int **client_sockets, nfds_t *max_clients, struct pollfd **fds);
+void           send_fd(int domain_socket, int fd, struct handoff *handoff);
+int            recv_fd(int socket, struct handoff *handoff);
+struct pollfd *initialize_pollfds(const int *listeners, int listener_count, int wake_fd, int **client_sockets);
+int            handle_new_connection(nfds_t listener, int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t max_connections);
 void           socket_close(int sockfd);
 void           set_socket_nonblock(int sockfd);
 void           handle_new_socket(void);
-void           handle_client_data(struct pollfd *fds, const int *client_sockets, const nfds_t *max_clients, int domain_sock);
-void           handle_client_disconnection(int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index);
+int            handle_client_data(struct pollfd *fds, const int *client_sockets, const nfds_t *max_clients, int domain_sock, struct timer_wheel *timers, const uint64_t *accepted_at, struct trace_shared *trace);
+void           handle_client_disconnection(int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index, nfds_t *slot);
 void           set_fd_blocking(int fd);
-void           read_original_fd(int domain_socket, int **client_sockets, struct pollfd **fds, nfds_t *max_clients);
+int            collect_completions(struct msg_ring *rings, int ring_count, int **client_sockets, struct pollfd **fds, nfds_t *max_clients, nfds_t *slot);
+
+#endif
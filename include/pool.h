@@ -0,0 +1,59 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "ring.h"
+#include "timer.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define POOL_MAX_WORKERS 64
+#define POOL_CACHE_LINE 64
+
+struct metrics_shared;
+struct scoreboard;
+struct trace_shared;
+
+// per worker state shared between the monitor, the dispatcher and the worker itself.
+// each slot fills a cache line of its own so workers on different cores never write to the same line
+struct worker_slot
+{
+    pid_t                 pid;                  // 0 when the slot is free
+    atomic_int            retiring;             // set by the monitor, the worker exits once it is idle
+    atomic_int            reload;               // set by the monitor, the worker reloads the handler once it is idle
+    atomic_uint           loaded_generation;    // handler library generation the worker is running
+    atomic_uint_least64_t busy_ns;              // total time spent handling connections
+    atomic_uint_least64_t served;               // connections handled
+    atomic_uint           target_generation;    // set by the monitor, the generation the worker should be running
+    char                  padding[POOL_CACHE_LINE - 5 * sizeof(int) - 2 * sizeof(uint64_t)];
+};
+
+// lives in an anonymous shared mapping created before the first fork
+struct pool_shared
+{
+    atomic_uint_least64_t  dispatched;                       // fds sent to the workers by the dispatcher
+    atomic_uint_least64_t  picked_up;                        // fds received by a worker
+    atomic_uint_least64_t  shed;                             // connections turned away with 503 by admission control
+    atomic_uint_least64_t  timeouts[TIMEOUT_KINDS];          // connections closed for missing a deadline, by TIMEOUT_ kind
+    struct metrics_shared *metrics;                          // per worker stage histograms, set up with the pool
+    struct trace_shared   *trace;                            // sampled request spans, set up with the pool
+    struct scoreboard     *scoreboard;                       // what every worker thread is doing, for /server-status
+    atomic_uint            generation;                       // bumped by the monitor for every validated handler library
+    atomic_uint            canary_generation;                // generation on trial in some of the workers, 0 when none is
+    pid_t                  library_owner;                    // monitor pid, part of the names of its library copies
+    char                   padding[2 * POOL_CACHE_LINE - (3 + TIMEOUT_KINDS) * sizeof(uint64_t) - 3 * sizeof(int) - 3 * sizeof(void *)];
+    atomic_int             wake_armed;                       // set by the dispatcher before it sleeps, the first completion after it writes wake_fd
+    int                    wake_fd[2];                       // read and write end, the same eventfd twice where there is one
+    char                   wake_padding[POOL_CACHE_LINE - 3 * sizeof(int)];
+    struct worker_slot     slots[POOL_MAX_WORKERS];
+    struct msg_ring        completions[POOL_MAX_WORKERS];    // original fds of finished connections, one ring per slot
+};
+
+struct pool_shared *pool_create(void);
+void                pool_destroy(struct pool_shared *pool);
+uint64_t            monotonic_ns(void);
+void                pool_complete(struct pool_shared *pool, int slot_index, int original_fd);
+void                pool_arm_wakeup(struct pool_shared *pool);
+void                pool_clear_wakeup(const struct pool_shared *pool);
+
+#endif
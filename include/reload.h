@@ -0,0 +1,22 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <sys/stat.h>
+
+// identity of the library file last accepted by the monitor
+struct lib_version
+{
+    dev_t  dev;
+    ino_t  ino;
+    time_t mtime;
+    off_t  size;
+};
+
+int reload_watch_open(const char *lib_path);
+int reload_watch_drain(int watch_fd, const char *lib_path);
+int lib_version_read(const char *lib_path, struct lib_version *version);
+int lib_version_equal(const struct lib_version *a, const struct lib_version *b);
+int reload_validate(const char *lib_path);
+int reload_copy(const char *lib_path, const char *copy_path);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+
+#define RING_CAPACITY 1024    // power of two
+#define RING_CACHE_LINE 64
+
+// a cell is free for the producer claiming position pos while its sequence equals pos,
+// and holds a value for the consumer once the sequence is pos + 1
+struct ring_cell
+{
+    atomic_uint sequence;
+    int         value;
+};
+
+// bounded lock-free ring in shared memory, any number of producers and a single consumer.
+// head and tail sit on cache lines of their own so the two sides never write to the same one
+struct msg_ring
+{
+    atomic_uint      head;    // next position the consumer reads
+    char             head_padding[RING_CACHE_LINE - sizeof(int)];
+    atomic_uint      tail;    // next position a producer claims
+    char             tail_padding[RING_CACHE_LINE - sizeof(int)];
+    struct ring_cell cells[RING_CAPACITY];
+};
+
+void ring_init(struct msg_ring *ring);
+int  ring_push(struct msg_ring *ring, int value);
+int  ring_pop(struct msg_ring *ring, int *value);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SCOREBOARD_H
+#define SCOREBOARD_H
+
+#include "pool.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCOREBOARD_THREADS 64    // the most threads a worker runs with -t
+#define SCOREBOARD_URI_LEN 192
+
+// what a worker thread is doing, as shown on /server-status
+#define WORKER_IDLE 0        // waiting for a connection
+#define WORKER_READING 1     // reading the request
+#define WORKER_HANDLING 2    // parsed, working out the response
+#define WORKER_WRITING 3     // sending the response
+#define WORKER_STATES 4
+
+// one thread of a worker, a single threaded worker only uses the first. the uri is copied under a
+// sequence count that is odd while it is written, so it can be read from another process without a lock
+struct scoreboard_thread
+{
+    atomic_uint_least64_t since_ns;      // when the current state was entered
+    atomic_uint_least64_t requests;      // connections handled by this thread
+    atomic_uint_least64_t bytes_sent;    // response bytes handed to the kernel, where it reports them
+    atomic_uint           sequence;
+    atomic_int            state;
+    char                  uri[SCOREBOARD_URI_LEN];
+    char                  padding[32];
+};
+
+// written by the worker in the slot whenever it loads the handler library
+struct scoreboard_worker
+{
+    atomic_uint_least64_t    loaded_at;        // wall clock seconds of the last library load
+    atomic_int_least64_t     library_mtime;    // modification time and size of the file that was loaded
+    atomic_int_least64_t     library_size;
+    atomic_int               threads;          // entries in use below
+    char                     padding[4];
+    struct scoreboard_thread thread[SCOREBOARD_THREADS];
+};
+
+// a mapping of its own next to pool_shared, indexed by worker slot like the metrics
+struct scoreboard
+{
+    struct scoreboard_worker workers[POOL_MAX_WORKERS];
+};
+
+struct scoreboard *scoreboard_create(void);
+void               scoreboard_destroy(struct scoreboard *scoreboard);
+void               scoreboard_loaded(struct scoreboard_worker *worker, const char *lib_path, int threads);
+void               scoreboard_reset(struct scoreboard_worker *worker);
+void               scoreboard_set_state(struct scoreboard_thread *thread, int state);
+void               scoreboard_set_uri(struct scoreboard_thread *thread, const char *uri);
+void               scoreboard_done(struct scoreboard_thread *thread, int client_fd);
+void               scoreboard_read_uri(const struct scoreboard_thread *thread, char *uri, size_t max_len);
+const char        *scoreboard_state_name(int state);
+
+#endif
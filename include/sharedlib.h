@@ -1,33 +1,126 @@
 
+#include "handler.h"
+#include "metrics.h"
+#include "uring.h"
 #include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <time.h>
 
+struct arena;
+struct trace_shared;
+
 #ifndef MYLIB_H
     #define MYLIB_H
 void my_function(void);
 #endif
 
-int         worker_handle_so(int client_sock, sem_t *sem);
+#define CHUNK_BUFFER_SIZE 8192
+#define CHUNK_HIGH_WATERMARK 6144
+#define CHUNK_HEADER_SIZE 512
+#define CHUNK_TERMINATOR_LEN 5
+
+
+// streams a response with Transfer-Encoding: chunked in bounded memory
+struct chunk_writer
+{
+    int    client_sock;
+    int    error;
+    size_t header_len;
+    size_t len;
+    char   header[CHUNK_HEADER_SIZE];
+    char   buffer[CHUNK_BUFFER_SIZE];
+};
+
+// errors whose responses are rendered once when the library loads
+enum error_response
+{
+    ERROR_BAD_REQUEST,
+    ERROR_FORBIDDEN,
+    ERROR_NOT_FOUND,
+    ERROR_METHOD_NOT_ALLOWED,
+    ERROR_BAD_REQUEST_PLAIN,
+    ERROR_NOT_FOUND_PLAIN,
+    ERROR_INTERNAL_PLAIN,
+    ERROR_LENGTH_REQUIRED,
+    ERROR_PAYLOAD_TOO_LARGE,
+    ERROR_RESPONSE_COUNT
+};
+
+// one name=value pair of a query string, decoded in place and NUL terminated
+struct query_param
+{
+    char  *name;
+    char  *value;
+    size_t name_len;
+    size_t value_len;
+};
+
+// inclusive byte range taken from a Range header
+struct byte_range
+{
+    off_t start;
+    off_t end;
+};
+
+int         worker_handle_so(int client_sock, struct handler_ctx *ctx);
+ssize_t     read_request(int client_sock, struct handler_ctx *ctx);
 void        get_http_date(struct tm *result);
 int         check_http_format(const char *version, const char *uri);
-int         serve_file(const char *uri, const char *method, int client_sock);
+int         serve_file(const char *uri, const char *method, int client_sock, const char *request, struct uring *ring);
 int         check_file_status(char *filepath);
-int         read_file(const char *filepath, const char *method, int client_socket);
+int         read_file(const char *filepath, const char *method, int client_socket, const char *request, struct uring *ring);
 const char *get_content_type(const char *filename);
 int         verify_method(const char *method);
 void        form_response(int newsockfd, const char *status, int content_length, const char *content_type);
+void        form_response_extra(int newsockfd, const char *status, off_t content_length, const char *content_type, const char *extra_headers);
+size_t      format_response_header(char *header, size_t max_len, const char *status, off_t content_length, const char *content_type, const char *extra_headers);
 void        format_time(struct tm tm_result, char *time_buffer);
 int         is_directory(const char *filepath);
 int         get_file_size(const char *filepath);
-int         handle_post_request(const char *uri, int client_sock, char *request_body, sem_t *semaphore);
+int         handle_post_request(const char *uri, int client_sock, char *request_body, struct handler_ctx *ctx);
+int         handle_upload(const char *uri, int client_sock, size_t request_len, struct handler_ctx *ctx);
 int         add_to_db(const char *key_str, const char *value_str);
 void        read_all_entries(void);
 int         find_in_db(const char *key_str, char *returned_value, size_t max_len);
-int         fetch_entry(const char *uri, const char *method, int client_sock, sem_t *semaphore);
+int         fetch_entry(char *uri, const char *method, int client_sock, struct handler_ctx *ctx);
 void        handle_file_serve_error(const char *method, int retval, int client_sock);
 void        handle_verify_method_error(int client_sock);
 void        handle_check_format_error(const char *method, int client_sock);
 void        handle_file_not_found(const char *method, int client_sock);
 void        handle_forbidden(const char *method, int client_sock);
-char       *parse_value(char *body_start);
-char       *parse_key(char *body_start);
+char       *parse_value(struct arena *arena, char *body_start);
+char       *parse_key(struct arena *arena, char *body_start);
+int         get_header_value(const char *request, const char *name, char *value, size_t max_len);
+void        format_validators(const struct stat *file_stat, char *etag, size_t etag_len, char *last_modified);
+int         if_range_matches(const char *if_range, const char *etag, const char *last_modified);
+int         parse_range_header(const char *range_header, off_t file_size, struct byte_range *ranges, int max_ranges);
+int         send_partial_content(int filefd, int client_socket, const struct stat *file_stat, const struct byte_range *range, const char *content_type, const char *representation_headers);
+int         send_multipart_ranges(int filefd, int client_socket, const struct stat *file_stat, const struct byte_range *ranges, int range_count, const char *content_type, const char *representation_headers);
+int         send_file_range(int filefd, int client_socket, off_t offset, off_t length);
+int         send_file_response(const char *filepath, const char *content_type, const char *content_encoding, const char *method, int client_socket, const char *request, struct uring *ring);
+int         is_compressible_type(const char *content_type);
+int         accepted_quality(const char *accept_encoding, const char *coding);
+const char *select_precompressed(const char *filepath, const char *request, char *encoded_path, size_t max_len);
+int         list_entries(const char *method, int client_sock, struct handler_ctx *ctx);
+void        chunk_writer_begin(struct chunk_writer *writer, int client_sock, const char *status, const char *content_type);
+int         chunk_writer_write(struct chunk_writer *writer, const char *data, size_t len);
+int         chunk_writer_puts(struct chunk_writer *writer, const char *str);
+int         chunk_writer_write_json(struct chunk_writer *writer, const char *data, size_t len);
+int         chunk_writer_flush(struct chunk_writer *writer);
+int         chunk_writer_end(struct chunk_writer *writer, int headers_only);
+void        send_error_response(int client_sock, enum error_response error, int include_body);
+size_t      find_escape(const char *str, size_t len);
+size_t      percent_decode(char *str, size_t len);
+int         parse_query(char *query, struct query_param *params, int max_params);
+const char *find_query_param(const struct query_param *params, int count, const char *name);
+int         handler_self_test(void);
+void        database_set_path(const char *path);
+void        database_lock(struct handler_ctx *ctx);
+void        database_unlock(struct handler_ctx *ctx);
+int         serve_metrics(const char *method, int client_sock, const struct pool_shared *pool, struct arena *arena);
+int         is_local_client(int client_sock);
+int         serve_trace(char *uri, const char *method, int client_sock, struct trace_shared *trace);
+int         serve_server_status(const char *method, int client_sock, const struct pool_shared *pool);
@@ -0,0 +1,69 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "arena.h"
+#include "handler.h"
+#include "network.h"
+#include "pool.h"
+#include "tls.h"
+#include <pthread.h>
+#include <semaphore.h>
+
+#define THREAD_DEQUE_CAPACITY 64
+
+// a connection received from the dispatcher, with what the dispatcher sent along
+struct queued_conn
+{
+    struct handoff handoff;
+    uint64_t       received_ns;    // when this process took it off the socketpair
+    int            client_fd;
+    char           padding[4];
+};
+
+// the owner pushes and pops at the tail, idle threads steal from the head
+struct conn_deque
+{
+    pthread_mutex_t    lock;
+    size_t             head;
+    size_t             tail;
+    struct queued_conn items[THREAD_DEQUE_CAPACITY];
+};
+
+struct thread_pool;
+
+struct pool_thread
+{
+    struct thread_pool *tp;
+    pthread_t           thread;
+    int                 index;
+    char                padding[4];
+    struct conn_deque   deque;
+    struct handler_ctx  ctx;
+    struct arena        arena;
+};
+
+// the threads of one worker process. the handler can only be swapped while the pool is paused
+struct thread_pool
+{
+    struct pool_thread *members;
+    struct pool_shared *pool;
+    struct worker_slot *slot;
+    SSL_CTX            *tls;    // NULL for plain connections
+    int (*handler)(int, struct handler_ctx *);
+    pthread_mutex_t pause_lock;
+    pthread_cond_t  pause_cond;
+    atomic_int      stop;
+    int             domain_socket;
+    int             wake[2];    // a byte per connection queued for stealing, wakes idle threads
+    int             threads;
+    int             paused;
+    int             active;    // threads inside the handler
+    int             slot_index;
+};
+
+int  thread_pool_start(struct thread_pool *tp, int threads, int domain_socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct deadlines *deadlines, SSL_CTX *tls, int (*handler)(int, struct handler_ctx *));
+void thread_pool_pause(struct thread_pool *tp);
+void thread_pool_resume(struct thread_pool *tp, int (*handler)(int, struct handler_ctx *));
+void thread_pool_stop(struct thread_pool *tp);
+
+#endif
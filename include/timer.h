@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// the deadline a connection missed, also the index into pool_shared.timeouts
+#define TIMEOUT_NONE (-1)
+#define TIMEOUT_IDLE 0      // accepted but nothing sent, enforced by the dispatcher
+#define TIMEOUT_HEADER 1    // request headers not complete, enforced by the handler
+#define TIMEOUT_WRITE 2     // response made no progress, enforced by the kernel through SO_SNDTIMEO
+#define TIMEOUT_KINDS 3
+
+// time units. the nanosecond ones scale the uint64_t clocks and stay unsigned 64 bit everywhere,
+// the millisecond ones scale the int deadlines and timeval fields
+#define NS_PER_SEC ((uint64_t)1000000000)
+#define NS_PER_MS ((uint64_t)1000000)
+#define NS_PER_US ((uint64_t)1000)
+#define MS_PER_SEC 1000
+#define US_PER_MS 1000
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+// per connection deadlines in milliseconds, from the command line
+struct deadlines
+{
+    int idle_ms;
+    int header_ms;
+    int write_ms;
+};
+
+// one entry per id, the ids are file descriptors so the node array is indexed directly and
+// arming, cancelling and expiring are all O(1). entries link by index so the array can grow
+struct timer_node
+{
+    int      next;
+    int      prev;
+    int      slot;    // bucket the node is linked into, -1 when not armed
+    int      kind;
+    uint64_t expires;    // in ticks
+};
+
+// hierarchical wheel, level 0 has one bucket per tick and every level above covers
+// TIMER_SLOTS buckets of the one below. far deadlines cascade down as their bucket comes up
+struct timer_wheel
+{
+    struct timer_node *nodes;
+    uint64_t           now;    // last tick processed
+    int                capacity;
+    int                armed;
+    int                heads[TIMER_LEVELS * TIMER_SLOTS];
+};
+
+int  timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns);
+void timer_wheel_destroy(struct timer_wheel *wheel);
+int  timer_wheel_arm(struct timer_wheel *wheel, int id, uint64_t deadline_ns, int kind);
+void timer_wheel_cancel(struct timer_wheel *wheel, int id);
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns, void (*expired)(void *arg, int id, int kind), void *arg);
+int  timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ns, int max_ms);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "handler.h"
+#include <openssl/ssl.h>
+#include <pthread.h>
+
+#define TLS_RELAY_BUFFER_SIZE 16384    // one full tls record
+
+// one client connection after the handshake. with kernel TLS the handler works on the client socket
+// itself, otherwise on one end of a socketpair whose other end a relay thread moves through the SSL object
+struct tls_conn
+{
+    SSL      *ssl;
+    pthread_t relay;
+    int       client_fd;
+    int       handler_fd;    // what the handler reads and writes, client_fd itself under kernel TLS
+    int       relay_fd;      // the relay thread's end of the socketpair, -1 under kernel TLS
+    int       timed_out;     // the handshake missed the header deadline
+};
+
+SSL_CTX *tls_create_context(const char *cert_path, const char *key_path);
+int      tls_accept(SSL_CTX *context, int client_fd, int timeout_ms, struct tls_conn *conn);
+void     tls_finish(struct tls_conn *conn);
+int      tls_serve(SSL_CTX *context, int client_fd, int (*handler)(int, struct handler_ctx *), struct handler_ctx *ctx);
+
+#endif
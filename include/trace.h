@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "network.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define TRACE_CAPACITY 65536    // spans kept, the oldest are overwritten once it is full
+
+// the parts of one request, as they show up in the trace. the dispatcher writes the first,
+// the worker the rest once it is done with the connection
+#define TRACE_DISPATCH 0    // accepted until the dispatcher passed the fd on
+#define TRACE_HANDOFF 1     // passed on until a worker received it from the socketpair
+#define TRACE_PICKUP 2      // received until a worker thread started on it, threaded workers only
+#define TRACE_HANDLE 3      // the handler call
+#define TRACE_PARSE 4       // reading and parsing the request, inside the handler call
+#define TRACE_KINDS 5
+
+// sequence is written last, a reader that sees it change while copying the span drops the copy
+struct trace_span
+{
+    atomic_uint_least64_t sequence;    // position the span was written at plus one, 0 while it is written
+    uint64_t              request_id;
+    uint64_t              start_ns;
+    uint64_t              end_ns;
+    int                   pid;
+    int                   tid;    // worker thread index, 0 outside the thread pool
+    int                   kind;
+    char                  padding[4];
+};
+
+// a mapping of its own next to pool_shared, written by the dispatcher and every worker
+struct trace_shared
+{
+    atomic_uint_least64_t next_id;         // last request id handed out
+    atomic_uint_least64_t head;            // spans ever written, the next one goes to head % TRACE_CAPACITY
+    atomic_uint           sample_every;    // 0 traces nothing, n traces every nth request
+    char                  padding[4];
+    struct trace_span     spans[TRACE_CAPACITY];
+};
+
+// when the worker got to each point of a traced request
+struct trace_times
+{
+    uint64_t received_ns;
+    uint64_t started_ns;
+    uint64_t parsed_ns;    // 0 if the request never parsed
+    uint64_t handled_ns;
+};
+
+struct trace_shared *trace_create(void);
+void                 trace_destroy(struct trace_shared *trace);
+uint64_t             trace_begin(struct trace_shared *trace, int *traced);
+void                 trace_record(struct trace_shared *trace, uint64_t request_id, int kind, int tid, uint64_t start_ns, uint64_t end_ns);
+void                 trace_worker(struct trace_shared *trace, const struct handoff *handoff, int tid, const struct trace_times *times);
+int                  trace_read(struct trace_shared *trace, uint64_t position, struct trace_span *span);
+const char          *trace_kind_name(int kind);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_BUFFER_COUNT 4
+#define URING_BUFFER_SIZE 65536
+
+// one submission ring with its own registered buffers, owned by a single thread
+struct uring;
+
+struct uring *uring_create(int send_timeout_ms);
+void          uring_destroy(struct uring *ring);
+off_t         uring_send_file(struct uring *ring, int sock, const char *header, size_t header_len, int filefd, off_t offset, off_t length);
+
+#endif
@@ -0,0 +1,198 @@
+#include "../include/affinity.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <sched.h>
+    #include <sys/syscall.h>
+    #define SYSFS_CPU "/sys/devices/system/cpu"
+    #define SYSFS_PATH_LEN 128
+    #define CPU_LIST_LEN 4096
+    #define NODE_PREFIX_LEN 4
+    #define BASE 10
+    // from numaif.h, which needs libnuma installed
+    #define MPOL_PREFERRED 1
+#endif
+
+#if defined(__linux__)
+// read a sysfs cpu list such as "0-3,8-11" into cpus, returns how many were found
+static int read_cpu_list(const char *path, int *cpus, int max_cpus)
+{
+    char  list[CPU_LIST_LEN];
+    char *p;
+    FILE *file;
+    int   count = 0;
+
+    file = fopen(path, "re");
+    if(file == NULL)
+    {
+        return -1;
+    }
+
+    if(fgets(list, sizeof(list), file) == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    p = list;
+    while(*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long  first = strtol(p, &end, BASE);
+        long  last  = first;
+
+        if(end == p)
+        {
+            break;
+        }
+        if(*end == '-')
+        {
+            p    = end + 1;
+            last = strtol(p, &end, BASE);
+        }
+
+        for(long cpu = first; cpu <= last && count < max_cpus; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+// the cpuN directory links to the node it belongs to as nodeM
+static int cpu_node(int cpu)
+{
+    char           path[SYSFS_PATH_LEN];
+    DIR           *dir;
+    struct dirent *entry;
+    int            node = 0;
+
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+    dir = opendir(path);
+    if(dir == NULL)
+    {
+        return 0;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, "node", NODE_PREFIX_LEN) == 0 && entry->d_name[NODE_PREFIX_LEN] >= '0' && entry->d_name[NODE_PREFIX_LEN] <= '9')
+        {
+            node = atoi(entry->d_name + NODE_PREFIX_LEN);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+#endif
+
+// keeps the first hyperthread of every online core. returns -1 when the topology cannot be read
+int affinity_detect(struct cpu_topology *topology)
+{
+#if defined(__linux__)
+    static int online[AFFINITY_MAX_CPUS];
+    int        online_count;
+
+    topology->count = 0;
+
+    online_count = read_cpu_list(SYSFS_CPU "/online", online, AFFINITY_MAX_CPUS);
+    if(online_count <= 0)
+    {
+        fprintf(stderr, "cannot read " SYSFS_CPU "/online\n");
+        return -1;
+    }
+
+    for(int i = 0; i < online_count; i++)
+    {
+        char path[SYSFS_PATH_LEN];
+        int  siblings[AFFINITY_MAX_CPUS];
+        int  node;
+        int  pos;
+
+        snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", online[i]);
+        if(read_cpu_list(path, siblings, AFFINITY_MAX_CPUS) > 0 && siblings[0] != online[i])
+        {
+            continue;
+        }
+
+        // insertion keeps the list sorted by node, then by cpu
+        node = cpu_node(online[i]);
+        pos  = topology->count;
+        while(pos > 0 && topology->nodes[pos - 1] > node)
+        {
+            topology->cpus[pos]  = topology->cpus[pos - 1];
+            topology->nodes[pos] = topology->nodes[pos - 1];
+            pos--;
+        }
+        topology->cpus[pos]  = online[i];
+        topology->nodes[pos] = node;
+        topology->count++;
+    }
+
+    return topology->count > 0 ? 0 : -1;
+#else
+    (void)topology;
+    fprintf(stderr, "cpu pinning is only supported on linux\n");
+    return -1;
+#endif
+}
+
+// pin the calling process to a core and prefer memory from that core's node. the dispatcher (slot -1)
+// takes the first core and workers take the following ones, wrapping around when there are more
+// workers than cores. returns the cpu or -1
+int affinity_place(const struct cpu_topology *topology, int slot_index)
+{
+#if defined(__linux__)
+    cpu_set_t     set;
+    unsigned long nodemask;
+    int           index;
+    int           cpu;
+    int           node;
+
+    if(topology->count <= 1)
+    {
+        index = 0;
+    }
+    else
+    {
+        // the dispatcher keeps its core to itself until the workers outnumber the rest
+        index = (slot_index + 1) % topology->count;
+    }
+
+    cpu  = topology->cpus[index];
+    node = topology->nodes[index];
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    // buffers are first touched after this, so they come from the local node even if the
+    // process was started under an interleaving policy
+    if(node < (int)(sizeof(nodemask) * CHAR_BIT))
+    {
+        nodemask = 1UL << node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * CHAR_BIT);
+    }
+
+    return cpu;
+#else
+    (void)topology;
+    (void)slot_index;
+    return -1;
+#endif
+}
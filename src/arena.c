@@ -0,0 +1,130 @@
+#include "../include/arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(NDEBUG)
+    // freed memory is overwritten so a pointer kept past the end of its request reads garbage, not
+    // the previous request's data. fresh memory is filled too, so nothing comes to rely on it being zero
+    #define ARENA_POISON_FREE 0xDD
+    #define ARENA_POISON_ALLOC 0xCD
+#endif
+
+static void *spill(struct arena *arena, size_t size);
+
+int arena_init(struct arena *arena, size_t size)
+{
+    memset(arena, 0, sizeof(*arena));
+
+    arena->base = (char *)malloc(size);
+    if(arena->base == NULL)
+    {
+        perror("malloc arena");
+        return -1;
+    }
+    arena->size = size;
+
+    return 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    arena_reset(arena);
+
+#if !defined(NDEBUG)
+    fprintf(stderr, "arena: high water %zu of %zu bytes, %llu allocations spilled over %llu requests\n", arena->high_water, arena->size, (unsigned long long)arena->spilled, (unsigned long long)arena->requests);
+#endif
+
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+// only returns NULL when a spill finds malloc failing
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void  *ptr;
+
+    if(start > arena->size || size > arena->size - start)
+    {
+        return spill(arena, size);
+    }
+
+    ptr         = arena->base + start;
+    arena->used = start + size;
+
+#if !defined(NDEBUG)
+    memset(ptr, ARENA_POISON_ALLOC, size);
+#endif
+
+    return ptr;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+    char *copy = (char *)arena_alloc(arena, len + 1);
+
+    if(copy != NULL)
+    {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+
+    return copy;
+}
+
+// called once the request is done. everything handed out since the last reset is gone after it
+void arena_reset(struct arena *arena)
+{
+    while(arena->spills != NULL)
+    {
+        struct arena_spill *next = arena->spills->next;
+
+#if !defined(NDEBUG)
+        memset(arena->spills + 1, ARENA_POISON_FREE, arena->spills->size);
+#endif
+        free(arena->spills);
+        arena->spills = next;
+    }
+
+#if !defined(NDEBUG)
+    if(arena->used > arena->high_water)
+    {
+        arena->high_water = arena->used;
+    }
+    arena->requests++;
+    memset(arena->base, ARENA_POISON_FREE, arena->used);
+#endif
+
+    arena->used = 0;
+}
+
+// the block is sized for the usual request, a large database value or a long listing ends up here
+static void *spill(struct arena *arena, size_t size)
+{
+    struct arena_spill *block;
+
+    if(size > SIZE_MAX - sizeof(struct arena_spill))
+    {
+        return NULL;
+    }
+
+    block = (struct arena_spill *)malloc(sizeof(struct arena_spill) + size);
+    if(block == NULL)
+    {
+        perror("malloc arena spill");
+        return NULL;
+    }
+
+    block->next   = arena->spills;
+    block->size   = size;
+    arena->spills = block;
+
+#if !defined(NDEBUG)
+    arena->spilled++;
+    memset(block + 1, ARENA_POISON_ALLOC, size);
+#endif
+
+    return block + 1;
+}
@@ -0,0 +1,738 @@
+#include "../include/affinity.h"
+#include "../include/arena.h"
+#include "../include/handler.h"
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LIB_PATH "/Users/developer/rm4/src/libmylib.so"
+#define DEFAULT_REPETITIONS 15
+#define DEFAULT_MIN_TIME_MS 20
+#define MAX_REPETITIONS 1000
+#define MAX_TIME_MS 60000
+#define MAX_ITERATIONS (1ULL << 40)
+#define BENCH_DIR_TEMPLATE "/tmp/bench.XXXXXX"
+#define DIR_SIZE 32
+#define BENCH_SEM_NAME "/bench_db_sem"
+#define HEADER_TIMEOUT_MS 1000
+#define DB_KEYS 1024
+#define KEY_SIZE 32
+#define VALUE_SIZE 1024
+#define DB_VALUE_LEN 64
+#define FILE_SIZE 4096
+#define DRAIN_BUFFER_SIZE 65536
+#define BODY_SIZE 128
+#define OK_STATUS 200
+#define BASE 10
+
+// the requests worker_handle_so is timed on. none of them touch the public directory of the server, the
+// static file path is timed through read_file on a file of its own
+#define REQUEST_GET_DATA "GET /dataGET?key=key-42 HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: */*\r\n\r\n"
+#define REQUEST_BAD_METHOD "BREW /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define REQUEST_FILE "GET /bench.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: */*\r\n\r\n"
+#define POST_BODY "{\"key\": \"user-1234\", \"value\": \"a value about as long as the ones the loadgen posts\"}"
+
+// the handler functions, looked up in the library under test so two builds can be compared before one is reloaded
+struct library
+{
+    void *handle;
+    int (*worker_handle_so)(int, struct handler_ctx *);
+    char *(*parse_key)(struct arena *, char *);
+    char *(*parse_value)(struct arena *, char *);
+    const char *(*get_content_type)(const char *);
+    void (*form_response)(int, const char *, int, const char *);
+    int (*check_file_status)(char *);
+    int (*read_file)(const char *, const char *, int, const char *, struct uring *);
+    int (*add_to_db)(const char *, const char *);
+    int (*find_in_db)(const char *, char *, size_t);
+    void (*database_set_path)(const char *);
+};
+
+// avoiding direct casting, one member for every function type in struct library
+union symbol
+{
+    void *ptr;
+    int (*handle)(int, struct handler_ctx *);
+    char *(*parse)(struct arena *, char *);
+    const char *(*content_type)(const char *);
+    void (*response)(int, const char *, int, const char *);
+    int (*file_status)(char *);
+    int (*file)(const char *, const char *, int, const char *, struct uring *);
+    int (*store)(const char *, const char *);
+    int (*find)(const char *, char *, size_t);
+    void (*set_path)(const char *);
+};
+
+struct settings
+{
+    const char *lib_path;
+    const char *only;    // -b, run only the benchmarks whose name starts with this
+    const char *output;
+    int         repetitions;
+    int         min_time_ms;
+    int         core;    // -c, index into the cores in the order the server places workers, -1 to not pin
+    char        padding[4];
+};
+
+// what the benchmarks run against. the socketpair stands in for a client, the handler writes to sock
+// and whatever it sent is drained from peer after every call so the buffer never fills
+struct bench
+{
+    struct library     library;
+    struct handler_ctx ctx;
+    struct arena       arena;
+    sem_t             *sem;
+    uint64_t           counter;    // rotates keys and file names between calls
+    uint64_t           errors;     // calls that failed in the current benchmark
+    int                sock;
+    int                peer;
+    char               dir[DIR_SIZE];
+    char               db_path[PATH_MAX];
+    char               file_path[PATH_MAX];
+    char               body[BODY_SIZE];
+    char               keys[DB_KEYS][KEY_SIZE];
+    char               value[VALUE_SIZE];
+};
+
+struct bench_case
+{
+    const char *name;
+    void (*run)(struct bench *bench);
+};
+
+struct result
+{
+    uint64_t iterations;
+    double   min;
+    double   median;
+    double   mean;
+    double   max;
+};
+
+static void     handle_arguments(int argc, char *argv[], struct settings *settings);
+static long     parse_number(const char *text, int option, long min, long max);
+static int      load_library(struct library *library, const char *lib_path);
+static void    *resolve(void *handle, const char *name);
+static int      setup(struct bench *bench, const char *lib_path);
+static void     teardown(struct bench *bench);
+static void     remove_dir(const char *path);
+static void     pin(const struct settings *settings, int *cpu);
+static void     measure(struct bench *bench, const struct bench_case *bench_case, const struct settings *settings, struct result *result);
+static uint64_t time_batch(struct bench *bench, const struct bench_case *bench_case, uint64_t iterations);
+static int      compare_double(const void *a, const void *b);
+static void     send_request(struct bench *bench, const char *request, size_t len);
+static void     drain(struct bench *bench);
+static uint64_t now_ns(void);
+static void     run_handle_get_data(struct bench *bench);
+static void     run_handle_bad_method(struct bench *bench);
+static void     run_handle_file(struct bench *bench);
+static void     run_parse_key(struct bench *bench);
+static void     run_parse_value(struct bench *bench);
+static void     run_get_content_type(struct bench *bench);
+static void     run_form_response(struct bench *bench);
+static void     run_check_file_status(struct bench *bench);
+static void     run_read_file(struct bench *bench);
+static void     run_add_to_db(struct bench *bench);
+static void     run_find_in_db(struct bench *bench);
+
+static const struct bench_case cases[] = {
+    {"worker_handle_so/get_data",   run_handle_get_data  },
+    {"worker_handle_so/bad_method", run_handle_bad_method},
+    {"worker_handle_so/not_found",  run_handle_file      },
+    {"parse_key",                   run_parse_key        },
+    {"parse_value",                 run_parse_value      },
+    {"get_content_type",            run_get_content_type },
+    {"form_response",               run_form_response    },
+    {"check_file_status",           run_check_file_status},
+    {"read_file",                   run_read_file        },
+    {"add_to_db",                   run_add_to_db        },
+    {"find_in_db",                  run_find_in_db       },
+};
+
+// get_content_type is called with these in turn, so every branch of its lookup is taken
+static const char *const content_type_names[] = {"index.html", "style.css", "app.js", "logo.png", "photo.jpg", "anim.gif", "icon.svg", "data.json", "notes.txt", "archive.bin"};    // NOLINT
+
+int main(int argc, char *argv[])
+{
+    struct settings settings;
+    struct bench   *bench;
+    FILE           *out;
+    int             out_fd;
+    int             null_fd;
+    int             cpu = -1;
+    int             first;
+
+    memset(&settings, 0, sizeof(settings));
+    handle_arguments(argc, argv, &settings);
+
+    // the handler logs every request to stdout. that stays part of what is timed, but goes to /dev/null
+    // so the json is all that is printed
+    out_fd = settings.output ? open(settings.output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : dup(STDOUT_FILENO);    // NOLINT
+    if(out_fd == -1)
+    {
+        perror("open output");
+        exit(EXIT_FAILURE);
+    }
+
+    out = fdopen(out_fd, "w");
+    if(out == NULL)
+    {
+        perror("fdopen");
+        exit(EXIT_FAILURE);
+    }
+
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+    {
+        perror("redirect stdout");
+        exit(EXIT_FAILURE);
+    }
+    close(null_fd);
+
+    // the struct holds the key table and the handler buffers, too much for the stack
+    bench = (struct bench *)calloc(1, sizeof(*bench));
+    if(bench == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(setup(bench, settings.lib_path) == -1)
+    {
+        teardown(bench);
+        free(bench);
+        exit(EXIT_FAILURE);
+    }
+
+    pin(&settings, &cpu);
+
+    fprintf(out, "{\n  \"library\": \"%s\",\n  \"cpu\": %d,\n  \"repetitions\": %d,\n  \"min_time_ms\": %d,\n  \"benchmarks\": [", settings.lib_path, cpu, settings.repetitions, settings.min_time_ms);
+
+    first = 1;
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        struct result result;
+
+        if(settings.only && strncmp(cases[i].name, settings.only, strlen(settings.only)) != 0)
+        {
+            continue;
+        }
+
+        measure(bench, &cases[i], &settings, &result);
+        fprintf(stderr, "%-28s %12.1f ns/op  (min %.1f, max %.1f, %llu errors)\n", cases[i].name, result.median, result.min, result.max, (unsigned long long)bench->errors);
+
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"errors\": %llu, \"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, \"max\": %.2f}}",
+                first ? "" : ",",
+                cases[i].name,
+                (unsigned long long)result.iterations,
+                (unsigned long long)bench->errors,
+                result.min,
+                result.median,
+                result.mean,
+                result.max);
+        first = 0;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+
+    teardown(bench);
+    free(bench);
+
+    return EXIT_SUCCESS;
+}
+
+static void handle_arguments(int argc, char *argv[], struct settings *settings)
+{
+    int option;
+
+    settings->lib_path    = DEFAULT_LIB_PATH;
+    settings->repetitions = DEFAULT_REPETITIONS;
+    settings->min_time_ms = DEFAULT_MIN_TIME_MS;
+    settings->core        = -1;
+
+    while((option = getopt(argc, argv, "b:c:l:o:r:t:")) != -1)
+    {
+        if(option == 'b')
+        {
+            settings->only = optarg;
+        }
+        else if(option == 'c')
+        {
+            settings->core = (int)parse_number(optarg, option, 0, AFFINITY_MAX_CPUS - 1);
+        }
+        else if(option == 'l')
+        {
+            settings->lib_path = optarg;
+        }
+        else if(option == 'o')
+        {
+            settings->output = optarg;
+        }
+        else if(option == 'r')
+        {
+            settings->repetitions = (int)parse_number(optarg, option, 1, MAX_REPETITIONS);
+        }
+        else if(option == 't')
+        {
+            settings->min_time_ms = (int)parse_number(optarg, option, 1, MAX_TIME_MS);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-l library] [-r repetitions] [-t ms per repetition] [-c core] [-b benchmark prefix] [-o output.json]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static long parse_number(const char *text, int option, long min, long max)
+{
+    char *end;
+    long  value;
+
+    errno = 0;
+    value = strtol(text, &end, BASE);
+    if(errno != 0 || end == text || *end != '\0' || value < min || value > max)
+    {
+        fprintf(stderr, "-%c must be a number from %ld to %ld\n", option, min, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+static int load_library(struct library *library, const char *lib_path)
+{
+    union symbol symbol;
+
+    library->handle = dlopen(lib_path, RTLD_NOW);
+    if(library->handle == NULL)
+    {
+        fprintf(stderr, "dlopen failed: %s\n", dlerror());
+        return -1;
+    }
+
+    symbol.ptr                 = resolve(library->handle, "worker_handle_so");
+    library->worker_handle_so  = symbol.handle;
+    symbol.ptr                 = resolve(library->handle, "parse_key");
+    library->parse_key         = symbol.parse;
+    symbol.ptr                 = resolve(library->handle, "parse_value");
+    library->parse_value       = symbol.parse;
+    symbol.ptr                 = resolve(library->handle, "get_content_type");
+    library->get_content_type  = symbol.content_type;
+    symbol.ptr                 = resolve(library->handle, "form_response");
+    library->form_response     = symbol.response;
+    symbol.ptr                 = resolve(library->handle, "check_file_status");
+    library->check_file_status = symbol.file_status;
+    symbol.ptr                 = resolve(library->handle, "read_file");
+    library->read_file         = symbol.file;
+    symbol.ptr                 = resolve(library->handle, "add_to_db");
+    library->add_to_db         = symbol.store;
+    symbol.ptr                 = resolve(library->handle, "find_in_db");
+    library->find_in_db        = symbol.find;
+    symbol.ptr                 = resolve(library->handle, "database_set_path");
+    library->database_set_path = symbol.set_path;
+
+    if(!library->worker_handle_so || !library->parse_key || !library->parse_value || !library->get_content_type || !library->form_response || !library->check_file_status || !library->read_file ||
+       !library->add_to_db || !library->find_in_db || !library->database_set_path)
+    {
+        dlclose(library->handle);
+        library->handle = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *resolve(void *handle, const char *name)
+{
+    void *ptr = dlsym(handle, name);
+
+    if(ptr == NULL)
+    {
+        fprintf(stderr, "dlsym failed for %s: %s\n", name, dlerror());
+    }
+
+    return ptr;
+}
+
+// loads the library and points it at a scratch directory holding the database and the file read_file sends
+static int setup(struct bench *bench, const char *lib_path)
+{
+    int sv[2];
+    int fd;
+
+    bench->sock = -1;
+    bench->peer = -1;
+
+    if(load_library(&bench->library, lib_path) == -1)
+    {
+        return -1;
+    }
+
+    snprintf(bench->dir, sizeof(bench->dir), BENCH_DIR_TEMPLATE);
+    if(mkdtemp(bench->dir) == NULL)
+    {
+        perror("mkdtemp");
+        bench->dir[0] = '\0';
+        return -1;
+    }
+
+    snprintf(bench->db_path, sizeof(bench->db_path), "%s/database.db", bench->dir);
+    snprintf(bench->file_path, sizeof(bench->file_path), "%s/bench.html", bench->dir);
+    bench->library.database_set_path(bench->db_path);
+
+    fd = open(bench->file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);    // NOLINT
+    if(fd == -1)
+    {
+        perror("open bench file");
+        return -1;
+    }
+    memset(bench->value, 'x', sizeof(bench->value));
+    for(size_t written = 0; written < FILE_SIZE; written += sizeof(bench->value))
+    {
+        if(write(fd, bench->value, sizeof(bench->value)) != (ssize_t)sizeof(bench->value))
+        {
+            perror("write bench file");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    // values about as long as the loadgen posts, so find_in_db copies a realistic amount
+    memset(bench->value, 'v', DB_VALUE_LEN);
+    bench->value[DB_VALUE_LEN] = '\0';
+    for(int i = 0; i < DB_KEYS; i++)
+    {
+        snprintf(bench->keys[i], sizeof(bench->keys[i]), "key-%d", i);
+        if(bench->library.add_to_db(bench->keys[i], bench->value) != 0)
+        {
+            fprintf(stderr, "cannot fill the database at %s\n", bench->db_path);
+            return -1;
+        }
+    }
+
+    // the handler blocks on the socket like it does on a client, the drain side must not
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    bench->sock = sv[0];
+    bench->peer = sv[1];
+    if(fcntl(bench->peer, F_SETFL, O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+
+    // unlinked right away, the name only exists to get a semaphore on systems without sem_init
+    bench->sem = sem_open(BENCH_SEM_NAME, O_CREAT, 0644, 1);    // NOLINT
+    if(bench->sem == SEM_FAILED)
+    {
+        perror("sem_open");
+        bench->sem = NULL;
+        return -1;
+    }
+    sem_unlink(BENCH_SEM_NAME);
+
+    // no io_uring, static files go out with sendfile the way they do on a kernel without it
+    bench->ctx.sem               = bench->sem;
+    bench->ctx.header_timeout_ms = HEADER_TIMEOUT_MS;
+    bench->ctx.arena             = &bench->arena;
+    bench->ctx.peer_sock         = bench->sock;
+    if(arena_init(&bench->arena, HANDLER_ARENA_SIZE) == -1)
+    {
+        return -1;
+    }
+    snprintf(bench->body, sizeof(bench->body), "%s", POST_BODY);
+
+    return 0;
+}
+
+static void teardown(struct bench *bench)
+{
+    if(bench->sem)
+    {
+        sem_close(bench->sem);
+    }
+
+    if(bench->sock != -1)
+    {
+        close(bench->sock);
+    }
+
+    if(bench->peer != -1)
+    {
+        close(bench->peer);
+    }
+
+    if(bench->dir[0] != '\0')
+    {
+        remove_dir(bench->dir);
+    }
+
+    if(bench->library.handle)
+    {
+        dlclose(bench->library.handle);
+    }
+
+    if(bench->arena.base)
+    {
+        arena_destroy(&bench->arena);
+    }
+}
+
+// the scratch directory only ever holds plain files, whatever names the dbm implementation gave them
+static void remove_dir(const char *path)
+{
+    DIR                 *dir;
+    const struct dirent *entry;
+
+    dir = opendir(path);
+    if(dir == NULL)
+    {
+        perror("opendir");
+        return;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        char file[PATH_MAX];
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+
+    closedir(dir);
+    rmdir(path);
+}
+
+// -c counts cores in the order the server pins them with -a, 0 being the dispatcher's, so the numbers
+// come from a core a worker would run on
+static void pin(const struct settings *settings, int *cpu)
+{
+    struct cpu_topology topology;
+
+    if(settings->core == -1)
+    {
+        return;
+    }
+
+    if(affinity_detect(&topology) == -1)
+    {
+        fprintf(stderr, "running unpinned\n");
+        return;
+    }
+
+    *cpu = affinity_place(&topology, settings->core - 1);
+}
+
+// doubles the batch until it runs for at least the minimum time, which also warms the caches and the
+// database pages. then times that batch repeatedly, every repetition gives one ns per call figure
+static void measure(struct bench *bench, const struct bench_case *bench_case, const struct settings *settings, struct result *result)
+{
+    double  *samples;
+    uint64_t iterations = 1;
+    uint64_t min_time   = (uint64_t)settings->min_time_ms * NS_PER_MS;
+    double   sum        = 0.0;
+
+    while(time_batch(bench, bench_case, iterations) < min_time && iterations < MAX_ITERATIONS)
+    {
+        iterations *= 2;
+    }
+
+    samples = (double *)calloc((size_t)settings->repetitions, sizeof(*samples));
+    if(samples == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    bench->errors = 0;
+    for(int i = 0; i < settings->repetitions; i++)
+    {
+        uint64_t elapsed = time_batch(bench, bench_case, iterations);
+
+        samples[i] = (double)elapsed / (double)iterations;
+        sum += samples[i];
+    }
+
+    qsort(samples, (size_t)settings->repetitions, sizeof(*samples), compare_double);
+
+    result->iterations = iterations;
+    result->min        = samples[0];
+    result->median     = samples[settings->repetitions / 2];
+    result->mean       = sum / settings->repetitions;
+    result->max        = samples[settings->repetitions - 1];
+
+    free(samples);
+}
+
+static uint64_t time_batch(struct bench *bench, const struct bench_case *bench_case, uint64_t iterations)
+{
+    uint64_t start = now_ns();
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        bench_case->run(bench);
+    }
+
+    return now_ns() - start;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// the request is small enough to always fit the socket buffer in one write
+static void send_request(struct bench *bench, const char *request, size_t len)
+{
+    if(write(bench->peer, request, len) != (ssize_t)len)
+    {
+        bench->errors++;
+    }
+}
+
+static void drain(struct bench *bench)
+{
+    char    buffer[DRAIN_BUFFER_SIZE];
+    ssize_t valread;
+
+    do
+    {
+        valread = read(bench->peer, buffer, sizeof(buffer));
+    } while(valread > 0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void run_handle_get_data(struct bench *bench)
+{
+    send_request(bench, REQUEST_GET_DATA, sizeof(REQUEST_GET_DATA) - 1);
+    if(bench->library.worker_handle_so(bench->sock, &bench->ctx) != 0)
+    {
+        bench->errors++;
+    }
+    drain(bench);
+}
+
+static void run_handle_bad_method(struct bench *bench)
+{
+    send_request(bench, REQUEST_BAD_METHOD, sizeof(REQUEST_BAD_METHOD) - 1);
+    if(bench->library.worker_handle_so(bench->sock, &bench->ctx) != 0)
+    {
+        bench->errors++;
+    }
+    drain(bench);
+}
+
+// the whole static file path up to the stat, which misses in the server's public directory
+static void run_handle_file(struct bench *bench)
+{
+    send_request(bench, REQUEST_FILE, sizeof(REQUEST_FILE) - 1);
+    if(bench->library.worker_handle_so(bench->sock, &bench->ctx) != 0)
+    {
+        bench->errors++;
+    }
+    drain(bench);
+}
+
+// the arena is reset the way worker_handle_so resets it after every request
+static void run_parse_key(struct bench *bench)
+{
+    if(bench->library.parse_key(&bench->arena, bench->body) == NULL)
+    {
+        bench->errors++;
+    }
+    arena_reset(&bench->arena);
+}
+
+static void run_parse_value(struct bench *bench)
+{
+    if(bench->library.parse_value(&bench->arena, bench->body) == NULL)
+    {
+        bench->errors++;
+    }
+    arena_reset(&bench->arena);
+}
+
+static void run_get_content_type(struct bench *bench)
+{
+    const char *name = content_type_names[bench->counter++ % (sizeof(content_type_names) / sizeof(content_type_names[0]))];
+
+    if(bench->library.get_content_type(name) == NULL)
+    {
+        bench->errors++;
+    }
+}
+
+static void run_form_response(struct bench *bench)
+{
+    bench->library.form_response(bench->sock, "200 OK", FILE_SIZE, "text/html");
+    drain(bench);
+}
+
+static void run_check_file_status(struct bench *bench)
+{
+    if(bench->library.check_file_status(bench->file_path) != OK_STATUS)
+    {
+        bench->errors++;
+    }
+}
+
+static void run_read_file(struct bench *bench)
+{
+    if(bench->library.read_file(bench->file_path, "GET", bench->sock, REQUEST_FILE, NULL) != 0)
+    {
+        bench->errors++;
+    }
+    drain(bench);
+}
+
+// replaces existing keys, so the database does not grow with the number of iterations
+static void run_add_to_db(struct bench *bench)
+{
+    if(bench->library.add_to_db(bench->keys[bench->counter++ % DB_KEYS], bench->value) != 0)
+    {
+        bench->errors++;
+    }
+}
+
+static void run_find_in_db(struct bench *bench)
+{
+    char value[VALUE_SIZE];
+
+    if(bench->library.find_in_db(bench->keys[bench->counter++ % DB_KEYS], value, sizeof(value)) != 0)
+    {
+        bench->errors++;
+    }
+}
@@ -0,0 +1,183 @@
+#include "../include/histogram.h"
+#include <string.h>
+
+#define PERCENT 100.0
+#define TICKS_PER_HALF_DISTANCE 5
+
+void histogram_init(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+
+    if(value < histogram->min)
+    {
+        histogram->min = value;
+    }
+
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+
+    into->count += from->count;
+    into->sum += from->sum;
+
+    if(from->min < into->min)
+    {
+        into->min = from->min;
+    }
+
+    if(from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+// highest value that is still equivalent to the bucket holding the percentile, capped at the largest value seen
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t running = 0;
+
+    if(histogram->count == 0)
+    {
+        return 0;
+    }
+
+    target = (uint64_t)(percentile / PERCENT * (double)histogram->count + 0.5);
+    if(target == 0)
+    {
+        target = 1;
+    }
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        running += histogram->counts[i];
+        if(running >= target)
+        {
+            uint64_t value = histogram_bucket_highest(i);
+
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+double histogram_mean(const struct histogram *histogram)
+{
+    if(histogram->count == 0)
+    {
+        return 0.0;
+    }
+
+    return (double)histogram->sum / (double)histogram->count;
+}
+
+// percentile distribution in the .hgrm text format, so the output can go straight into the HdrHistogram plotter.
+// reporting steps halve along with the distance to 100%, which keeps the tail readable. values are divided by unit
+void histogram_print(const struct histogram *histogram, FILE *out, double unit)
+{
+    double   next    = 0.0;
+    uint64_t running = 0;
+
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    for(int i = 0; i < HISTOGRAM_BUCKETS && running < histogram->count; i++)
+    {
+        double   reached;
+        uint64_t value;
+
+        if(histogram->counts[i] == 0)
+        {
+            continue;
+        }
+
+        running += histogram->counts[i];
+        reached = PERCENT * (double)running / (double)histogram->count;
+        value   = histogram_bucket_highest(i);
+        if(value > histogram->max)
+        {
+            value = histogram->max;
+        }
+
+        while(next <= reached)
+        {
+            double ticks     = TICKS_PER_HALF_DISTANCE * 2.0;
+            double remaining = PERCENT;
+
+            fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", (double)value / unit, next / PERCENT, (unsigned long long)running, PERCENT / (PERCENT - next));
+            if(running == histogram->count)
+            {
+                break;
+            }
+
+            // each halving of the distance to 100% doubles the number of reporting steps
+            while(PERCENT - next <= remaining / 2.0)
+            {
+                remaining /= 2.0;
+                ticks *= 2.0;
+            }
+            next += PERCENT / ticks;
+        }
+    }
+
+    fprintf(out, "%12.3f %2.12f %10llu\n", (double)histogram->max / unit, 1.0, (unsigned long long)histogram->count);
+    fprintf(out, "#[Mean    = %12.3f, Max            = %12.3f]\n", histogram_mean(histogram) / unit, (double)histogram->max / unit);
+    fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1, HISTOGRAM_SUB_COUNT);
+}
+
+// also used directly by histograms kept elsewhere, such as the shared memory stage metrics
+int histogram_bucket(uint64_t value)
+{
+    int magnitude;
+    int shift;
+
+    if(value < HISTOGRAM_SUB_COUNT)
+    {
+        return (int)value;
+    }
+
+    magnitude = 63 - __builtin_clzll(value);    // NOLINT
+    if(magnitude >= HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    // the top HISTOGRAM_SUB_BITS + 1 bits pick the bucket inside the power of two
+    shift = magnitude - HISTOGRAM_SUB_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+// the largest value that falls into the bucket
+uint64_t histogram_bucket_highest(int index)
+{
+    int shift;
+    int sub;
+
+    if(index < HISTOGRAM_SUB_COUNT)
+    {
+        return (uint64_t)index;
+    }
+
+    shift = index / HISTOGRAM_SUB_COUNT - 1;
+    sub   = index % HISTOGRAM_SUB_COUNT;
+
+    return ((uint64_t)(HISTOGRAM_SUB_COUNT + sub + 1) << shift) - 1;
+}
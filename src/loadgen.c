@@ -0,0 +1,1201 @@
+#include "../include/histogram.h"
+#include "../include/timer.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <sys/epoll.h>
+#endif
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8000
+#define DEFAULT_PUBLIC_DIR "public"
+#define DEFAULT_THREADS 1
+#define DEFAULT_CONNECTIONS 10
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_KEYS 100
+#define MAX_PORT 65535
+#define MAX_THREADS 64
+#define MAX_CONNECTIONS 100000
+#define MAX_DURATION_S 86400
+#define MAX_RATE 10000000
+#define MAX_KEYS 1000000
+#define MAX_FILES 256
+#define MAX_WEIGHT 1000
+#define BASE 10
+
+// request mix, relative weights. the defaults apply when -m is not given
+#define REQUEST_KINDS 3
+#define KIND_STATIC 0
+#define KIND_GET 1
+#define KIND_POST 2
+#define DEFAULT_STATIC_WEIGHT 80
+#define DEFAULT_GET_WEIGHT 15
+#define DEFAULT_POST_WEIGHT 5
+
+// connection states
+#define CONN_IDLE 0
+#define CONN_CONNECTING 1
+#define CONN_WRITING 2
+#define CONN_READING 3
+#define CONN_BACKLOG 4    // a unix socket connect found the listen backlog full, tried again at retry_at
+
+// how the end of a response body is found
+#define FRAMING_LENGTH 0
+#define FRAMING_CHUNKED 1
+#define FRAMING_CLOSE 2
+
+#define REQUEST_SIZE 512
+#define HEADER_SIZE 4096
+#define READ_BUFFER_SIZE 65536
+#define CHUNKED_END "\r\n0\r\n\r\n"
+#define CHUNKED_END_LEN 7
+#define STATUS_CLASSES 6
+#define MAX_EVENTS 256
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+// percentiles in the summary line, the full spectrum follows it
+static const double report_percentiles[] = {50.0, 90.0, 99.0, 99.9};    // NOLINT
+
+// a connection that failed waits this long before a closed loop tries again, so a dead server is not spun on
+#define ERROR_BACKOFF_NS 10000000ULL
+
+// a full backlog on a unix socket is the server being busy, not an error. the request keeps its
+// intended time and the connect is retried after this long
+#define CONNECT_RETRY_NS 1000000ULL
+
+// one ready to send request, built once before the run and shared read only by every thread
+struct request
+{
+    size_t len;
+    char   text[REQUEST_SIZE];
+};
+
+struct settings
+{
+    struct sockaddr_storage address;    // tcp, or a unix socket with -u
+    struct request         *requests[REQUEST_KINDS];
+    int                     request_counts[REQUEST_KINDS];
+    int                     weights[REQUEST_KINDS];
+    uint64_t                start;
+    uint64_t                end;
+    uint64_t                interval_ns;    // open loop: time between requests on one connection, 0 for closed loop
+    long                    rate;           // -r, requests per second across all connections
+    const char             *host;
+    const char             *unix_path;      // -u, replaces -a and -p
+    const char             *public_dir;
+    socklen_t               address_len;
+    int                     port;
+    int                     threads;
+    int                     connections;
+    int                     duration_s;
+    int                     keys;
+    int                     keep_alive;
+    char                    padding[4];
+};
+
+struct connection
+{
+    const struct request *request;
+    uint64_t              intended;    // when the request was due, latency is measured from here
+    uint64_t              next_due;    // when the next request on this connection may start
+    uint64_t              retry_at;    // with CONN_BACKLOG, when the connect is tried again
+    size_t                sent;
+    size_t                header_len;
+    long long             remaining;    // body bytes still to come with FRAMING_LENGTH
+    int                   fd;
+    int                   state;
+    int                   status;
+    int                   framing;
+    int                   reusable;    // the server left the connection open after this response
+    int                   header_done;
+    short                 events;    // what the poll fallback waits for
+    char                  tail[CHUNKED_END_LEN];
+    char                  padding[7];
+    char                  header[HEADER_SIZE];
+};
+
+struct counters
+{
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t opened;
+    uint64_t status[STATUS_CLASSES];    // by first digit, 0 for a status line that did not parse
+    uint64_t connect_errors;
+    uint64_t connect_retries;    // unix socket connects that found the backlog full
+    uint64_t read_errors;
+    uint64_t write_errors;
+};
+
+// one thread and the connections it drives
+struct worker
+{
+    pthread_t              thread;
+    const struct settings *settings;
+    struct connection     *connections;
+    struct pollfd         *pollfds;    // only used without epoll
+    struct histogram      *latency;
+    struct counters        counters;
+    uint64_t               random;
+    int                    first_connection;    // index of connections[0] across all threads
+    int                    connection_count;
+    int                    poller;
+    char                   padding[4];
+};
+
+static void     handle_arguments(int argc, char *argv[], struct settings *settings);
+static long     parse_number(const char *text, int option, long min, long max);
+static void     set_unix_address(struct settings *settings);
+static void     parse_mix(const char *text, struct settings *settings);
+static int      build_requests(struct settings *settings);
+static int      list_static_files(struct settings *settings);
+static void     print_report(const struct settings *settings, const struct worker *workers, const struct histogram *latency, uint64_t elapsed);
+static void    *run_worker(void *arg);
+static void     start_request(struct worker *worker, struct connection *conn, uint64_t now);
+static void     open_connection(struct worker *worker, struct connection *conn);
+static void     write_request(struct worker *worker, struct connection *conn);
+static void     read_response(struct worker *worker, struct connection *conn);
+static int      parse_header(struct connection *conn, size_t *body_offset);
+static int      consume_body(struct connection *conn, const char *data, size_t len);
+static void     finish_request(struct worker *worker, struct connection *conn);
+static void     fail_request(struct worker *worker, struct connection *conn, uint64_t *errors);
+static void     close_connection(struct connection *conn);
+static int      pick_kind(struct worker *worker);
+static uint64_t next_random(struct worker *worker);
+static uint64_t now_ns(void);
+static int      poller_open(struct worker *worker);
+static void     poller_close(struct worker *worker);
+static int      poller_watch(struct worker *worker, struct connection *conn, short events, int added);
+static int      poller_wait(struct worker *worker, struct connection **ready, int max_ready, int timeout_ms);
+
+int main(int argc, char *argv[])
+{
+    struct settings  settings;
+    struct worker   *workers;
+    struct histogram total;
+    uint64_t         elapsed;
+    int              per_thread;
+    int              extra;
+    int              first;
+
+    memset(&settings, 0, sizeof(settings));
+    handle_arguments(argc, argv, &settings);
+
+    if(build_requests(&settings) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // a server that closes mid write should show up as a write error, not end the run
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = (struct worker *)calloc((size_t)settings.threads, sizeof(*workers));
+    if(workers == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(settings.unix_path)
+    {
+        printf("Running %ds test @ unix:%s\n", settings.duration_s, settings.unix_path);
+    }
+    else
+    {
+        printf("Running %ds test @ %s:%d\n", settings.duration_s, settings.host, settings.port);
+    }
+    if(settings.rate)
+    {
+        printf("  %d threads and %d connections, open loop at %ld req/s, keep-alive %s\n", settings.threads, settings.connections, settings.rate, settings.keep_alive ? "on" : "off");
+    }
+    else
+    {
+        printf("  %d threads and %d connections, closed loop, keep-alive %s\n", settings.threads, settings.connections, settings.keep_alive ? "on" : "off");
+    }
+    printf("  mix static:dataGET:dataPOST %d:%d:%d over %d files and %d keys\n",
+           settings.weights[KIND_STATIC],
+           settings.weights[KIND_GET],
+           settings.weights[KIND_POST],
+           settings.request_counts[KIND_STATIC],
+           settings.keys);
+
+    settings.start = now_ns();
+    settings.end   = settings.start + (uint64_t)settings.duration_s * NS_PER_SEC;
+
+    // connections are spread as evenly as they go, the first threads take the remainder
+    per_thread = settings.connections / settings.threads;
+    extra      = settings.connections % settings.threads;
+    first      = 0;
+    for(int i = 0; i < settings.threads; i++)
+    {
+        workers[i].settings         = &settings;
+        workers[i].first_connection = first;
+        workers[i].connection_count = per_thread + (i < extra ? 1 : 0);
+        workers[i].random           = settings.start ^ ((uint64_t)(i + 1) * UINT64_C(0x9E3779B97F4A7C15));    // NOLINT
+        first += workers[i].connection_count;
+
+        if(pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(int i = 0; i < settings.threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    elapsed = now_ns() - settings.start;
+
+    histogram_init(&total);
+    for(int i = 0; i < settings.threads; i++)
+    {
+        if(workers[i].latency)
+        {
+            histogram_merge(&total, workers[i].latency);
+            free(workers[i].latency);
+        }
+    }
+
+    print_report(&settings, workers, &total, elapsed);
+    printf("\nLatency distribution in ms, HdrHistogram percentile spectrum\n");
+    histogram_print(&total, stdout, (double)NS_PER_MS);
+
+    for(int i = 0; i < REQUEST_KINDS; i++)
+    {
+        free(settings.requests[i]);
+    }
+    free(workers);
+
+    return EXIT_SUCCESS;
+}
+
+// the path as the server takes it with -l unix:, a leading @ is a name in the linux abstract namespace
+static void set_unix_address(struct settings *settings)
+{
+    struct sockaddr_un *address  = (struct sockaddr_un *)&settings->address;
+    size_t              path_len = strlen(settings->unix_path);
+
+    if(path_len == 0 || path_len >= sizeof(address->sun_path))
+    {
+        printf("-u must be a path shorter than %zu.\n", sizeof(address->sun_path));
+        exit(EXIT_FAILURE);
+    }
+
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, settings->unix_path, path_len);
+    settings->address_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+    if(settings->unix_path[0] == '@')
+    {
+        address->sun_path[0]  = '\0';
+        settings->address_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+    }
+}
+
+static void handle_arguments(int argc, char *argv[], struct settings *settings)
+{
+    int option;
+
+    settings->host                  = DEFAULT_HOST;
+    settings->public_dir            = DEFAULT_PUBLIC_DIR;
+    settings->port                  = DEFAULT_PORT;
+    settings->threads               = DEFAULT_THREADS;
+    settings->connections           = DEFAULT_CONNECTIONS;
+    settings->duration_s            = DEFAULT_DURATION_S;
+    settings->keys                  = DEFAULT_KEYS;
+    settings->weights[KIND_STATIC]  = DEFAULT_STATIC_WEIGHT;
+    settings->weights[KIND_GET]     = DEFAULT_GET_WEIGHT;
+    settings->weights[KIND_POST]    = DEFAULT_POST_WEIGHT;
+
+    while((option = getopt(argc, argv, "a:c:d:f:km:n:p:r:t:u:")) != -1)
+    {
+        if(option == 'a')
+        {
+            settings->host = optarg;
+        }
+        else if(option == 'c')
+        {
+            settings->connections = (int)parse_number(optarg, option, 1, MAX_CONNECTIONS);
+        }
+        else if(option == 'd')
+        {
+            settings->duration_s = (int)parse_number(optarg, option, 1, MAX_DURATION_S);
+        }
+        else if(option == 'f')
+        {
+            settings->public_dir = optarg;
+        }
+        else if(option == 'k')
+        {
+            settings->keep_alive = 1;
+        }
+        else if(option == 'm')
+        {
+            parse_mix(optarg, settings);
+        }
+        else if(option == 'n')
+        {
+            settings->keys = (int)parse_number(optarg, option, 1, MAX_KEYS);
+        }
+        else if(option == 'p')
+        {
+            settings->port = (int)parse_number(optarg, option, 1, MAX_PORT);
+        }
+        else if(option == 'r')
+        {
+            settings->rate = parse_number(optarg, option, 1, MAX_RATE);
+        }
+        else if(option == 't')
+        {
+            settings->threads = (int)parse_number(optarg, option, 1, MAX_THREADS);
+        }
+        else if(option == 'u')
+        {
+            settings->unix_path = optarg;
+        }
+        else
+        {
+            printf("Usage: %s [-a <address>] [-p <port>] [-t <threads>] [-c <connections>] [-d <sec>] [-r <req/s>] [-k]\n", argv[0]);
+            printf("          [-m <static>:<get>:<post>] [-n <keys>] [-f <dir>] [-u <unix socket path>]\n");
+            printf("Without -r every connection sends its next request as soon as the last one is answered (closed loop).\n");
+            printf("With -r requests go out on a fixed schedule and latency counts from when each was due (open loop).\n");
+            printf("-k asks the server to keep connections open, -m weights static files from -f (default %s),\n", DEFAULT_PUBLIC_DIR);
+            printf("dataGET lookups and dataPOST writes over -n keys (default %d:%d:%d over %d keys).\n", DEFAULT_STATIC_WEIGHT, DEFAULT_GET_WEIGHT, DEFAULT_POST_WEIGHT, DEFAULT_KEYS);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(settings->threads > settings->connections)
+    {
+        settings->threads = settings->connections;
+    }
+
+    if(settings->unix_path)
+    {
+        set_unix_address(settings);
+    }
+    else
+    {
+        struct sockaddr_in *address = (struct sockaddr_in *)&settings->address;
+
+        if(inet_pton(AF_INET, settings->host, &address->sin_addr) != 1)
+        {
+            printf("-a must be an IPv4 address.\n");
+            exit(EXIT_FAILURE);
+        }
+        address->sin_family   = AF_INET;
+        address->sin_port     = htons((uint16_t)settings->port);
+        settings->address_len = sizeof(*address);
+    }
+
+    // every connection gets an equal share of the rate and keeps its own schedule
+    if(settings->rate)
+    {
+        settings->interval_ns = NS_PER_SEC * (uint64_t)settings->connections / (uint64_t)settings->rate;
+    }
+}
+
+static long parse_number(const char *text, int option, long min, long max)
+{
+    long  val;
+    char *endptr;
+
+    errno = 0;
+    val   = strtol(text, &endptr, BASE);
+    if(errno != 0 || *endptr != '\0' || val < min || val > max)
+    {
+        printf("-%c must be an integer between %ld and %ld.\n", option, min, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
+// -m static:get:post, relative weights
+static void parse_mix(const char *text, struct settings *settings)
+{
+    const char *pos = text;
+
+    for(int i = 0; i < REQUEST_KINDS; i++)
+    {
+        long  val;
+        char *endptr;
+
+        errno = 0;
+        val   = strtol(pos, &endptr, BASE);
+        if(errno != 0 || endptr == pos || val < 0 || val > MAX_WEIGHT || *endptr != (i < REQUEST_KINDS - 1 ? ':' : '\0'))
+        {
+            printf("-m must be three weights between 0 and %d, as <static>:<get>:<post>.\n", MAX_WEIGHT);
+            exit(EXIT_FAILURE);
+        }
+
+        settings->weights[i] = (int)val;
+        pos                  = endptr + 1;
+    }
+}
+
+// renders every request the run can send, so the threads only ever copy bytes out
+static int build_requests(struct settings *settings)
+{
+    const char *connection = settings->keep_alive ? "keep-alive" : "close";
+
+    if(settings->weights[KIND_STATIC] && list_static_files(settings) == -1)
+    {
+        return -1;
+    }
+
+    if(settings->request_counts[KIND_STATIC] == 0)
+    {
+        settings->weights[KIND_STATIC] = 0;
+    }
+
+    settings->requests[KIND_GET]  = (struct request *)calloc((size_t)settings->keys, sizeof(struct request));
+    settings->requests[KIND_POST] = (struct request *)calloc((size_t)settings->keys, sizeof(struct request));
+    if(settings->requests[KIND_GET] == NULL || settings->requests[KIND_POST] == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    for(int i = 0; i < settings->keys; i++)
+    {
+        struct request *get  = &settings->requests[KIND_GET][i];
+        struct request *post = &settings->requests[KIND_POST][i];
+        char            body[REQUEST_SIZE / 4];
+        int             body_len;
+        int             len;
+
+        len = snprintf(get->text, sizeof(get->text), "GET /dataGET?key=loadgen-%d HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n", i, settings->host, settings->port, connection);
+        get->len = (size_t)len;
+
+        // the handler wants the body in the same read as the headers, so both go out in one send
+        body_len = snprintf(body, sizeof(body), "{\"key\":\"loadgen-%d\",\"value\":\"value-%d\"}", i, i);
+        len      = snprintf(post->text,
+                       sizeof(post->text),
+                       "POST /dataPOST HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+                       settings->host,
+                       settings->port,
+                       connection,
+                       body_len,
+                       body);
+        post->len = (size_t)len;
+    }
+    settings->request_counts[KIND_GET]  = settings->keys;
+    settings->request_counts[KIND_POST] = settings->keys;
+
+    if(settings->weights[KIND_STATIC] + settings->weights[KIND_GET] + settings->weights[KIND_POST] == 0)
+    {
+        fprintf(stderr, "nothing to send, every weight in the request mix is 0\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// every regular file directly under the public directory, by the name the server serves it under
+static int list_static_files(struct settings *settings)
+{
+    DIR                 *dir;
+    const struct dirent *entry;
+    const char          *connection = settings->keep_alive ? "keep-alive" : "close";
+    int                  count      = 0;
+
+    settings->requests[KIND_STATIC] = (struct request *)calloc(MAX_FILES, sizeof(struct request));
+    if(settings->requests[KIND_STATIC] == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    dir = opendir(settings->public_dir);
+    if(dir == NULL)
+    {
+        perror("opendir");
+        return -1;
+    }
+
+    while((entry = readdir(dir)) != NULL && count < MAX_FILES)
+    {
+        struct request *request = &settings->requests[KIND_STATIC][count];
+        struct stat     file_stat;
+        char            path[PATH_MAX];
+        int             len;
+
+        if(entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", settings->public_dir, entry->d_name);
+        if(stat(path, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))
+        {
+            continue;
+        }
+
+        len = snprintf(request->text, sizeof(request->text), "GET /%s HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n\r\n", entry->d_name, settings->host, settings->port, connection);
+        if(len < 0 || (size_t)len >= sizeof(request->text))
+        {
+            continue;
+        }
+
+        request->len = (size_t)len;
+        count++;
+    }
+
+    closedir(dir);
+    settings->request_counts[KIND_STATIC] = count;
+
+    return 0;
+}
+
+static void print_report(const struct settings *settings, const struct worker *workers, const struct histogram *latency, uint64_t elapsed)
+{
+    struct counters total;
+    double          seconds = (double)elapsed / (double)NS_PER_SEC;
+
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < settings->threads; i++)
+    {
+        const struct counters *counters = &workers[i].counters;
+
+        total.requests += counters->requests;
+        total.bytes += counters->bytes;
+        total.opened += counters->opened;
+        total.connect_errors += counters->connect_errors;
+        total.connect_retries += counters->connect_retries;
+        total.read_errors += counters->read_errors;
+        total.write_errors += counters->write_errors;
+        for(int j = 0; j < STATUS_CLASSES; j++)
+        {
+            total.status[j] += counters->status[j];
+        }
+    }
+
+    printf("  Latency (ms) %10s", "mean");
+    for(size_t i = 0; i < sizeof(report_percentiles) / sizeof(report_percentiles[0]); i++)
+    {
+        char label[16];    // NOLINT
+
+        snprintf(label, sizeof(label), "p%g", report_percentiles[i]);
+        printf(" %10s", label);
+    }
+    printf(" %10s\n", "max");
+
+    printf("  %23.3f", histogram_mean(latency) / (double)NS_PER_MS);
+    for(size_t i = 0; i < sizeof(report_percentiles) / sizeof(report_percentiles[0]); i++)
+    {
+        uint64_t value = histogram_percentile(latency, report_percentiles[i]);
+
+        printf(" %10.3f", (double)value / (double)NS_PER_MS);
+    }
+    printf(" %10.3f\n", (double)latency->max / (double)NS_PER_MS);
+    printf("  %llu requests in %.2fs, %.2f MB read, %llu connections opened\n", (unsigned long long)total.requests, seconds, (double)total.bytes / BYTES_PER_MB, (unsigned long long)total.opened);
+    printf("  responses: 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, unparsed %llu\n",
+           (unsigned long long)total.status[1],
+           (unsigned long long)total.status[2],
+           (unsigned long long)total.status[3],
+           (unsigned long long)total.status[4],
+           (unsigned long long)total.status[5],    // NOLINT
+           (unsigned long long)total.status[0]);
+    printf("  errors: connect %llu, read %llu, write %llu\n", (unsigned long long)total.connect_errors, (unsigned long long)total.read_errors, (unsigned long long)total.write_errors);
+    if(total.connect_retries)
+    {
+        printf("  connects retried on a full backlog: %llu\n", (unsigned long long)total.connect_retries);
+    }
+    printf("Requests/sec: %.2f\n", (double)total.requests / seconds);
+    printf("Transfer/sec: %.2f MB\n", (double)total.bytes / BYTES_PER_MB / seconds);
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker         *worker   = (struct worker *)arg;
+    const struct settings *settings = worker->settings;
+    uint64_t               now;
+
+    worker->connections = (struct connection *)calloc((size_t)worker->connection_count, sizeof(struct connection));
+    worker->latency     = (struct histogram *)malloc(sizeof(struct histogram));
+    if(worker->connections == NULL || worker->latency == NULL || poller_open(worker) == -1)
+    {
+        perror("starting load thread");
+        free(worker->connections);
+        return NULL;
+    }
+    histogram_init(worker->latency);
+
+    // open loop schedules are staggered across the interval so the connections do not fire in bursts
+    for(int i = 0; i < worker->connection_count; i++)
+    {
+        struct connection *conn = &worker->connections[i];
+
+        conn->fd       = -1;
+        conn->state    = CONN_IDLE;
+        conn->next_due = settings->start + settings->interval_ns * (uint64_t)(worker->first_connection + i) / (uint64_t)settings->connections;
+    }
+
+    while((now = now_ns()) < settings->end)
+    {
+        struct connection *ready[MAX_EVENTS];
+        uint64_t           wake = settings->end;
+        int                timeout_ms;
+        int                count;
+
+        for(int i = 0; i < worker->connection_count; i++)
+        {
+            struct connection *conn = &worker->connections[i];
+
+            if(conn->state == CONN_IDLE)
+            {
+                if(conn->next_due <= now)
+                {
+                    start_request(worker, conn, now);
+                }
+                else if(conn->next_due < wake)
+                {
+                    wake = conn->next_due;
+                }
+            }
+            else if(conn->state == CONN_BACKLOG && conn->retry_at <= now)
+            {
+                open_connection(worker, conn);
+            }
+
+            // the backlog may have been found full just now, by the request started above
+            if(conn->state == CONN_BACKLOG && conn->retry_at < wake)
+            {
+                wake = conn->retry_at;
+            }
+        }
+
+        // timeouts round down, the last millisecond before a due request is spent polling without sleeping
+        timeout_ms = (int)((wake - now) / NS_PER_MS);
+        count      = poller_wait(worker, ready, MAX_EVENTS, timeout_ms);
+        for(int i = 0; i < count; i++)
+        {
+            struct connection *conn = ready[i];
+
+            if(conn->state == CONN_CONNECTING)
+            {
+                int       error = 0;
+                socklen_t len   = sizeof(error);
+
+                if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+                {
+                    fail_request(worker, conn, &worker->counters.connect_errors);
+                    continue;
+                }
+
+                conn->state = CONN_WRITING;
+                write_request(worker, conn);
+            }
+            else if(conn->state == CONN_WRITING)
+            {
+                write_request(worker, conn);
+            }
+            else if(conn->state == CONN_READING)
+            {
+                read_response(worker, conn);
+            }
+        }
+    }
+
+    // whatever is still in flight when the time is up is not counted
+    for(int i = 0; i < worker->connection_count; i++)
+    {
+        close_connection(&worker->connections[i]);
+    }
+    poller_close(worker);
+    free(worker->connections);
+    free(worker->pollfds);
+
+    return NULL;
+}
+
+static void start_request(struct worker *worker, struct connection *conn, uint64_t now)
+{
+    const struct settings *settings = worker->settings;
+    int                    kind     = pick_kind(worker);
+
+    // in the open loop a request that is late because the connection was busy still counts from its slot
+    if(settings->interval_ns)
+    {
+        conn->intended = conn->next_due;
+        conn->next_due += settings->interval_ns;
+    }
+    else
+    {
+        conn->intended = now;
+    }
+
+    conn->request     = &settings->requests[kind][next_random(worker) % (uint64_t)settings->request_counts[kind]];
+    conn->sent        = 0;
+    conn->header_len  = 0;
+    conn->header_done = 0;
+    conn->status      = 0;
+    conn->reusable    = 0;
+
+    if(conn->fd == -1)
+    {
+        open_connection(worker, conn);
+        return;
+    }
+
+    conn->state = CONN_WRITING;
+    write_request(worker, conn);
+}
+
+static void open_connection(struct worker *worker, struct connection *conn)
+{
+    const struct settings *settings = worker->settings;
+    int                    flags;
+    int                    one = 1;
+
+    conn->fd = socket(settings->address.ss_family, SOCK_STREAM, 0);
+    if(conn->fd == -1)
+    {
+        fail_request(worker, conn, &worker->counters.connect_errors);
+        return;
+    }
+
+    flags = fcntl(conn->fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        fail_request(worker, conn, &worker->counters.connect_errors);
+        return;
+    }
+
+    // requests are written in one piece, there is nothing to gain from waiting to coalesce
+    if(settings->address.ss_family == AF_INET)
+    {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if(connect(conn->fd, (const struct sockaddr *)&settings->address, settings->address_len) == 0)
+    {
+        worker->counters.opened++;
+        if(poller_watch(worker, conn, POLLOUT, 0) == -1)
+        {
+            fail_request(worker, conn, &worker->counters.connect_errors);
+            return;
+        }
+        conn->state = CONN_WRITING;
+        write_request(worker, conn);
+        return;
+    }
+
+    // unix sockets do not complete a connect later, a full backlog fails it straight away
+    if(errno == EAGAIN && settings->address.ss_family == AF_UNIX)
+    {
+        close_connection(conn);
+        worker->counters.connect_retries++;
+        conn->state    = CONN_BACKLOG;
+        conn->retry_at = now_ns() + CONNECT_RETRY_NS;
+        return;
+    }
+
+    if(errno != EINPROGRESS || poller_watch(worker, conn, POLLOUT, 0) == -1)
+    {
+        fail_request(worker, conn, &worker->counters.connect_errors);
+        return;
+    }
+
+    worker->counters.opened++;
+    conn->state = CONN_CONNECTING;
+}
+
+static void write_request(struct worker *worker, struct connection *conn)
+{
+    while(conn->sent < conn->request->len)
+    {
+        ssize_t n = send(conn->fd, conn->request->text + conn->sent, conn->request->len - conn->sent, 0);
+
+        if(n == -1)
+        {
+            if(errno == EAGAIN)
+            {
+                if(conn->events != POLLOUT && poller_watch(worker, conn, POLLOUT, 1) == -1)
+                {
+                    fail_request(worker, conn, &worker->counters.write_errors);
+                }
+                return;
+            }
+
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            fail_request(worker, conn, &worker->counters.write_errors);
+            return;
+        }
+
+        conn->sent += (size_t)n;
+    }
+
+    conn->state = CONN_READING;
+    memcpy(conn->tail, CHUNKED_END, CHUNKED_END_LEN);
+    if(conn->events != POLLIN && poller_watch(worker, conn, POLLIN, 1) == -1)
+    {
+        fail_request(worker, conn, &worker->counters.read_errors);
+    }
+}
+
+// reads whatever is available. headers are kept until they are complete, the body is only counted
+static void read_response(struct worker *worker, struct connection *conn)
+{
+    char buffer[READ_BUFFER_SIZE];
+
+    for(;;)
+    {
+        ssize_t     n = recv(conn->fd, buffer, sizeof(buffer), 0);
+        const char *body;
+        size_t      body_len;
+
+        if(n == -1)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                return;
+            }
+
+            fail_request(worker, conn, &worker->counters.read_errors);
+            return;
+        }
+
+        if(n == 0)
+        {
+            // only a response without a length may end with the connection
+            if(conn->header_done && conn->framing == FRAMING_CLOSE)
+            {
+                conn->reusable = 0;
+                finish_request(worker, conn);
+            }
+            else
+            {
+                fail_request(worker, conn, &worker->counters.read_errors);
+            }
+            return;
+        }
+
+        worker->counters.bytes += (uint64_t)n;
+        body     = buffer;
+        body_len = (size_t)n;
+
+        if(!conn->header_done)
+        {
+            size_t copy = (size_t)n;
+            size_t body_offset;
+            size_t previous = conn->header_len;
+            int    result;
+
+            if(copy > HEADER_SIZE - 1 - conn->header_len)
+            {
+                copy = HEADER_SIZE - 1 - conn->header_len;
+            }
+            memcpy(conn->header + conn->header_len, buffer, copy);
+            conn->header_len += copy;
+            conn->header[conn->header_len] = '\0';
+
+            result = parse_header(conn, &body_offset);
+            if(result == -1)
+            {
+                fail_request(worker, conn, &worker->counters.read_errors);
+                return;
+            }
+
+            if(result == 0)
+            {
+                continue;
+            }
+
+            // body_offset counts from the start of the header, the part before this read is already consumed
+            body     = buffer + (body_offset - previous);
+            body_len = (size_t)n - (body_offset - previous);
+        }
+
+        if(consume_body(conn, body, body_len))
+        {
+            finish_request(worker, conn);
+            return;
+        }
+    }
+}
+
+// returns 1 once the header is complete, 0 if more is needed and -1 if it can not be a response
+static int parse_header(struct connection *conn, size_t *body_offset)
+{
+    const char *end = strstr(conn->header, "\r\n\r\n");
+    const char *field;
+
+    if(end == NULL)
+    {
+        return conn->header_len == HEADER_SIZE - 1 ? -1 : 0;
+    }
+
+    *body_offset      = (size_t)(end - conn->header) + 4;    // NOLINT
+    conn->header_done = 1;
+
+    // "HTTP/1.x NNN", the class is the first digit
+    if(strncmp(conn->header, "HTTP/1.", 7) == 0 && conn->header[9] >= '1' && conn->header[9] <= '5')    // NOLINT
+    {
+        conn->status = conn->header[9] - '0';    // NOLINT
+    }
+
+    conn->reusable = strstr(conn->header, "Connection: close") == NULL && strncmp(conn->header, "HTTP/1.0", 8) != 0;    // NOLINT
+    conn->framing  = FRAMING_CLOSE;
+
+    field = strstr(conn->header, "Content-Length:");
+    if(field != NULL && field < end)
+    {
+        conn->framing   = FRAMING_LENGTH;
+        conn->remaining = strtoll(field + 15, NULL, BASE);    // NOLINT
+    }
+    else if(strstr(conn->header, "Transfer-Encoding: chunked") != NULL)
+    {
+        conn->framing = FRAMING_CHUNKED;
+    }
+    else
+    {
+        conn->reusable = 0;
+    }
+
+    return 1;
+}
+
+// returns 1 when the body is complete. chunked bodies are not decoded, the zero size chunk that
+// ends them is spotted in the last bytes seen
+static int consume_body(struct connection *conn, const char *data, size_t len)
+{
+    if(conn->framing == FRAMING_LENGTH)
+    {
+        conn->remaining -= (long long)len;
+        return conn->remaining <= 0;
+    }
+
+    if(conn->framing == FRAMING_CHUNKED && len > 0)
+    {
+        if(len >= CHUNKED_END_LEN)
+        {
+            memcpy(conn->tail, data + len - CHUNKED_END_LEN, CHUNKED_END_LEN);
+        }
+        else
+        {
+            memmove(conn->tail, conn->tail + len, CHUNKED_END_LEN - len);
+            memcpy(conn->tail + CHUNKED_END_LEN - len, data, len);
+        }
+
+        return memcmp(conn->tail, CHUNKED_END, CHUNKED_END_LEN) == 0;
+    }
+
+    return 0;
+}
+
+static void finish_request(struct worker *worker, struct connection *conn)
+{
+    uint64_t now = now_ns();
+
+    histogram_record(worker->latency, now - conn->intended);
+    worker->counters.requests++;
+    worker->counters.status[conn->status]++;
+
+    if(!conn->reusable || !worker->settings->keep_alive)
+    {
+        close_connection(conn);
+    }
+
+    conn->state = CONN_IDLE;
+    if(!worker->settings->interval_ns)
+    {
+        conn->next_due = now;
+    }
+}
+
+static void fail_request(struct worker *worker, struct connection *conn, uint64_t *errors)
+{
+    (*errors)++;
+    close_connection(conn);
+    conn->state = CONN_IDLE;
+
+    // the open loop keeps its schedule, the request that failed is simply not measured
+    if(!worker->settings->interval_ns)
+    {
+        conn->next_due = now_ns() + ERROR_BACKOFF_NS;
+    }
+}
+
+static void close_connection(struct connection *conn)
+{
+    if(conn->fd != -1)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->events = 0;
+}
+
+static int pick_kind(struct worker *worker)
+{
+    const int *weights = worker->settings->weights;
+    int        pick    = (int)(next_random(worker) % (uint64_t)(weights[KIND_STATIC] + weights[KIND_GET] + weights[KIND_POST]));
+
+    for(int i = 0; i < REQUEST_KINDS; i++)
+    {
+        if(pick < weights[i])
+        {
+            return i;
+        }
+        pick -= weights[i];
+    }
+
+    return KIND_POST;
+}
+
+// xorshift64, cheap and good enough to pick requests
+static uint64_t next_random(struct worker *worker)
+{
+    uint64_t x = worker->random;
+
+    x ^= x << 13;    // NOLINT
+    x ^= x >> 7;     // NOLINT
+    x ^= x << 17;    // NOLINT
+    worker->random = x;
+
+    return x;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+#if defined(__linux__)
+
+static int poller_open(struct worker *worker)
+{
+    worker->poller = epoll_create1(EPOLL_CLOEXEC);
+
+    return worker->poller == -1 ? -1 : 0;
+}
+
+static void poller_close(struct worker *worker)
+{
+    close(worker->poller);
+}
+
+// added says whether the descriptor is already registered
+static int poller_watch(struct worker *worker, struct connection *conn, short events, int added)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events   = events == POLLIN ? EPOLLIN : EPOLLOUT;
+    event.data.ptr = conn;
+    conn->events   = events;
+
+    return epoll_ctl(worker->poller, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+static int poller_wait(struct worker *worker, struct connection **ready, int max_ready, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int                count;
+
+    count = epoll_wait(worker->poller, events, max_ready < MAX_EVENTS ? max_ready : MAX_EVENTS, timeout_ms);
+    for(int i = 0; i < count; i++)
+    {
+        ready[i] = (struct connection *)events[i].data.ptr;
+    }
+
+    return count < 0 ? 0 : count;
+}
+
+#else
+
+// without epoll the descriptors are collected into a pollfd array on every wait
+static int poller_open(struct worker *worker)
+{
+    worker->poller  = -1;
+    worker->pollfds = (struct pollfd *)calloc((size_t)worker->connection_count, sizeof(struct pollfd));
+
+    return worker->pollfds == NULL ? -1 : 0;
+}
+
+static void poller_close(struct worker *worker)
+{
+    (void)worker;
+}
+
+static int poller_watch(struct worker *worker, struct connection *conn, short events, int added)
+{
+    (void)worker;
+    (void)added;
+    conn->events = events;
+
+    return 0;
+}
+
+static int poller_wait(struct worker *worker, struct connection **ready, int max_ready, int timeout_ms)
+{
+    nfds_t count = 0;
+    int    found = 0;
+
+    for(int i = 0; i < worker->connection_count; i++)
+    {
+        const struct connection *conn = &worker->connections[i];
+
+        if(conn->fd != -1 && conn->state != CONN_IDLE)
+        {
+            worker->pollfds[count].fd      = conn->fd;
+            worker->pollfds[count].events  = conn->events;
+            worker->pollfds[count].revents = 0;
+            count++;
+        }
+    }
+
+    if(poll(worker->pollfds, count, timeout_ms) <= 0)
+    {
+        return 0;
+    }
+
+    // the busy connections are walked in the same order they were collected in
+    count = 0;
+    for(int i = 0; i < worker->connection_count && found < max_ready; i++)
+    {
+        struct connection *conn = &worker->connections[i];
+
+        if(conn->fd != -1 && conn->state != CONN_IDLE)
+        {
+            if(worker->pollfds[count].revents)
+            {
+                ready[found++] = conn;
+            }
+            count++;
+        }
+    }
+
+    return found;
+}
+
+#endif
@@ -1,8 +1,20 @@
+#include "../include/affinity.h"
+#include "../include/arena.h"
+#include "../include/handler.h"
+#include "../include/metrics.h"
 #include "../include/network.h"
+#include "../include/pool.h"
+#include "../include/reload.h"
+#include "../include/scoreboard.h"
+#include "../include/threadpool.h"
+#include "../include/tls.h"
+#include "../include/trace.h"
+#include "../include/uring.h"
 #include <arpa/inet.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <semaphore.h>
@@ -10,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,36 +31,298 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+    #include <sys/signalfd.h>
+#endif
+
+#define LIB_PATH "/Users/developer/rm4/src/libmylib.so"
 #define MIN_WORKERS 1
-#define MAX_WORKERS 5
+#define MAX_WORKERS POOL_MAX_WORKERS
 #define BASE 10
 
-int         socketfork(int workers_num);
-int         parent(int socket);
-void        start_monitor(int socket, int workers_num);
-void        worker(int socket, sem_t *semaphore);
-static void setup_signal_handler(void);
-static void sigint_handler(int signum);
-int (*load_lib(void **handle, const char *lib_path))(int, sem_t *);
-void handle_arguments(int argc, char *argv[], int *workers_num);
+// admission control. without -c the cap leaves this many descriptors of the limit for everything else
+#define FD_HEADROOM 32
+#define MIN_CONNECTIONS 1
+#define MAX_CONNECTIONS 1000000
+#define MAX_THREADS 64
+#define MIN_ACCEPT_CAPACITY 64
+
+// connection deadlines, in seconds on the command line
+#define DEFAULT_IDLE_TIMEOUT_S 10
+#define DEFAULT_HEADER_TIMEOUT_S 10
+#define DEFAULT_WRITE_TIMEOUT_S 30
+#define MAX_TIMEOUT_S 3600
+
+// autoscaling. pressure has to hold for several ticks before the pool changes size,
+// the grow and shrink thresholds are far apart, and every change is followed by a cool-down
+#define SCALE_UP_QUEUE_PER_WORKER 2
+#define SCALE_UP_BUSY_PERCENT 80
+#define SCALE_DOWN_BUSY_PERCENT 30
+#define SCALE_UP_TICKS 2
+#define SCALE_DOWN_TICKS 10
+#define SCALE_COOLDOWN_NS 5000000000ULL
+#define PERCENT 100
+
+// supervision. workers are replaced as soon as they exit, unless they keep dying right after starting
+#define MONITOR_TICK_NS 1000000000ULL
+#define CRASH_LOOP_WINDOW_NS 1000000000ULL
+#define RESPAWN_BACKOFF_MIN_NS 50000000ULL
+#define RESPAWN_BACKOFF_MAX_SHIFT 8
+#if !defined(__linux__)
+    #define PIPE_DRAIN_SIZE 64
+#endif
+
+// hot reload. writes to the library are left to settle before the new build is validated,
+// then the workers switch over one at a time
+#define RELOAD_SETTLE_NS 100000000ULL
+#define RELOAD_STEP_NS 10000000ULL
+
+// canary rollout. with -k a validated library goes to that share of the workers first. once they all
+// run it, their handler latency and failures are compared against the rest of the pool, and it either
+// goes everywhere or is taken back. p99 may be worse by the tolerance plus a slack that covers the
+// jitter of sub-millisecond handlers, the failure rate by a fixed number of requests per thousand
+#define MIN_CANARY_PERCENT 1
+#define MAX_CANARY_PERCENT 99
+#define CANARY_MIN_REQUESTS 1000
+#define CANARY_MIN_NS 10000000000ULL
+#define CANARY_MAX_NS 120000000000ULL
+#define CANARY_P99_TOLERANCE_PERCENT 20
+#define CANARY_P99_SLACK_NS 100000ULL
+#define CANARY_ERROR_TOLERANCE_PERMILLE 10
+#define PERMILLE 1000
+#define P99 99.0
+
+// graceful restart. the new generation inherits the listening sockets through the environment and
+// reports on the ready pipe once it polls them, then the old one stops accepting and drains
+#define LISTEN_FD_ENV "HTTP_LISTEN_FD"    // comma separated, in the order of -l
+#define READY_FD_ENV "HTTP_READY_FD"
+#define FD_ENV_LEN 16
+#define LISTEN_ENV_LEN (FD_ENV_LEN * MAX_LISTENERS)
+#define READY_TIMEOUT_NS 10000000000ULL
+#define DRAIN_TIMEOUT_NS 30000000000ULL
+#define POLL_TIMEOUT_MS 1000
+#define RESTART_POLL_MS 100
+
+// command line settings, read once in main and passed down to every process
+struct options
+{
+    const struct cpu_topology *topology;                           // NULL unless processes are pinned
+    const char                *tls_cert;                           // -T, certificate chain in PEM
+    const char                *tls_key;                            // -K, its private key
+    SSL_CTX                   *tls;                                // NULL serves plain http
+    const char                *listen_addresses[MAX_LISTENERS];    // -l, none listens on the default port
+    nfds_t                     max_connections;                    // connections the dispatcher holds before it sheds with 503 (-c)
+    int                        workers_num;                        // -w
+    int                        max_workers;                        // -x, defaults to -w
+    int                        pin_cpus;                           // -a
+    int                        threads;                            // -t, threads per worker. 0 keeps each worker single threaded
+    int                        canary_percent;                     // -k, share of the workers that try a new library first. 0 moves all of them
+    int                        listener_count;
+    struct deadlines           deadlines;                          // -i, -r and -s
+    char                       padding[4];
+};
+
+// what the deadline callback needs to drop a connection from the dispatcher
+struct connections
+{
+    int                **client_sockets;
+    struct pollfd      **fds;
+    nfds_t              *max_clients;
+    struct client_index *index;    // finds the connection of an expired fd
+    struct pool_shared  *pool;
+};
+
+// the generation started by SIGUSR2, while it is still coming up
+struct restart
+{
+    pid_t    pid;
+    int      ready_fd;    // read end of the ready pipe, -1 when no restart is under way
+    uint64_t deadline;
+};
+
+struct autoscaler
+{
+    uint64_t last_busy_ns;
+    uint64_t last_tick_ns;
+    uint64_t last_scale_ns;
+    int      high_ticks;
+    int      low_ticks;
+};
+
+// monitor-only bookkeeping for one worker slot
+struct supervision
+{
+    uint64_t spawned_ns;
+    uint64_t respawn_at;    // when a crashed worker is due to be replaced, 0 if nothing is pending
+    int      crashes;       // consecutive deaths inside the crash loop window
+    char     padding[4];
+};
+
+// which library generations the workers are told to run. every generation is loaded from a copy of
+// its own, so the stable one is still there to go back to after a deploy replaced LIB_PATH
+struct rollout
+{
+    uint64_t     measuring_since;    // when every canary worker had switched and the comparison began, 0 before
+    uint64_t     decide_by;          // when to decide on whatever was measured, for a pool with little traffic
+    unsigned int stable;             // generation new workers start with, the whole pool outside a canary
+    unsigned int canary;             // generation on trial in some of the workers, 0 when there is none
+};
+
+struct monitor
+{
+    int                        domain_socket;
+    int                        child_events;    // readable whenever a worker has exited
+    sem_t                     *semaphore;
+    struct pool_shared        *pool;
+    const struct options      *options;
+    int                        min_workers;
+    int                        max_workers;
+    int                        lib_watch;       // inotify fd on the library directory, -1 when polling with stat
+    int                        reload_slot;     // worker currently switching to the new library, -1 if none
+    uint64_t                   reload_due;      // when to validate a changed library, 0 if no change is pending
+    struct lib_version         lib_version;     // library the workers are told to run
+    struct rollout             rollout;
+    struct autoscaler          scaler;
+    struct supervision         supervision[POOL_MAX_WORKERS];
+};
+
+int             socketfork(const struct options *options);
+int             parent(int socket, const int *listeners, int listener_count, int ready_fd, struct pool_shared *pool, const struct options *options);
+void            start_monitor(int socket, struct pool_shared *pool, const struct options *options);
+_Noreturn void  worker(int socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct options *options);
+static void     setup_signal_handler(void);
+static void     sigint_handler(int signum);
+static void     retire_handler(int signum);
+static void     restart_handler(int signum);
+#if !defined(__linux__)
+static void sigchld_handler(int signum);
+#endif
+static void     setup_retire_signal(sigset_t *wait_mask);
+static void     worker_threaded(int domain_socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct options *options);
+static void     spawn_worker(struct monitor *monitor, int slot_index);
+static void     reap_workers(struct monitor *monitor);
+static void     respawn_due_workers(struct monitor *monitor);
+static uint64_t next_respawn_time(const struct monitor *monitor);
+static int      slot_in_use(const struct monitor *monitor, int slot_index);
+static void     autoscale(struct monitor *monitor);
+static int      setup_child_events(void);
+static void     drain_child_events(int child_events);
+static void     check_library(struct monitor *monitor);
+static void     roll_out_library(struct monitor *monitor);
+static int      start_canary(struct monitor *monitor, unsigned int generation);
+static void     check_canary(struct monitor *monitor);
+static int      canary_regressed(const struct monitor *monitor, uint64_t now);
+static void     promote_library(struct monitor *monitor, unsigned int generation);
+static void     roll_back_library(struct monitor *monitor);
+static void     library_copy_path(const struct pool_shared *pool, unsigned int generation, char *path, size_t max_len);
+static void     remove_library_copy(const struct pool_shared *pool, unsigned int generation);
+static void     stop_workers(struct monitor *monitor);
+static int      fd_from_env(const char *name);
+static int      listeners_from_env(int *listeners);
+static void     start_new_generation(const int *listeners, int listener_count, int domain_socket, const struct pollfd *fds, nfds_t max_clients, struct restart *restart);
+static int      check_new_generation(struct restart *restart);
+static void     expire_connection(void *arg, int fd, int kind);
+static void     note_accept(struct client_index *index, int fd, nfds_t slot, uint64_t now);
+static nfds_t   default_max_connections(void);
+int (*load_lib(void **handle, const char *lib_path))(int, struct handler_ctx *);
+static int (*load_assigned_lib(void **handle, struct pool_shared *pool, int slot_index, int threads))(int, struct handler_ctx *);
+void handle_arguments(int argc, char *argv[], struct options *options);
 
-static volatile sig_atomic_t exit_flag = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t exit_flag    = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t restart_flag = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static char                **restart_argv = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 int main(int argc, char *argv[])
 {
-    int status;
-    int workers_num = 0;
+    int                 status;
+    struct options      options;
+    struct cpu_topology topology;
 
     setup_signal_handler();
 
-    handle_arguments(argc, argv, &workers_num);
-    if(!workers_num)
+    // a graceful restart runs the same command line again
+    restart_argv = argv;
+
+    memset(&options, 0, sizeof(options));
+    handle_arguments(argc, argv, &options);
+    if(!options.workers_num)
     {
         printf("Select number of workers -w <num>. Must be an integer between %d and %d.\n", MIN_WORKERS, MAX_WORKERS);
+        printf("Optionally let the pool grow under load up to -x <max>.\n");
+        printf("Pin the dispatcher and workers to separate physical cores with -a.\n");
+        printf("Cap open connections with -c <max>, beyond it clients get 503. Defaults to the fd limit.\n");
+        printf("Run each worker as a pool of -t <threads> threads instead of a single thread.\n");
+        printf("Close connections idle for -i <sec> (default %d), slow to send headers for -r <sec> (default %d)\n", DEFAULT_IDLE_TIMEOUT_S, DEFAULT_HEADER_TIMEOUT_S);
+        printf("or not reading the response for -s <sec> (default %d).\n", DEFAULT_WRITE_TIMEOUT_S);
+        printf("Try a new handler library on -k <percent> of the workers first, it is taken back if it does worse than the rest.\n");
+        printf("Listen on -l <[host:]port>, -l unix:<path> or -l unix:@<abstract name>, up to %d times (default port 8000).\n", MAX_LISTENERS);
+        printf("/metrics, /server-status and /trace answer loopback clients and unix socket clients running as the server's user.\n");
+        printf("Serve https with the certificate -T <cert.pem> and its key -K <key.pem>, sent through kernel TLS where available.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!options.deadlines.idle_ms)
+    {
+        options.deadlines.idle_ms = DEFAULT_IDLE_TIMEOUT_S * MS_PER_SEC;
+    }
+
+    if(!options.deadlines.header_ms)
+    {
+        options.deadlines.header_ms = DEFAULT_HEADER_TIMEOUT_S * MS_PER_SEC;
+    }
+
+    if(!options.deadlines.write_ms)
+    {
+        options.deadlines.write_ms = DEFAULT_WRITE_TIMEOUT_S * MS_PER_SEC;
+    }
+
+    // without -x the pool stays at a fixed size
+    if(!options.max_workers)
+    {
+        options.max_workers = options.workers_num;
+    }
+
+    if(options.max_workers < options.workers_num)
+    {
+        printf("-x must not be smaller than -w.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!options.max_connections)
+    {
+        options.max_connections = default_max_connections();
+    }
+
+    if((options.tls_cert == NULL) != (options.tls_key == NULL))
+    {
+        printf("-T and -K go together.\n");
         exit(EXIT_FAILURE);
     }
 
-    status = socketfork(workers_num);
+    // loaded before the fork, so every worker shares the context and a bad key stops the server right away
+    if(options.tls_cert)
+    {
+        options.tls = tls_create_context(options.tls_cert, options.tls_key);
+        if(options.tls == NULL)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options.pin_cpus)
+    {
+        if(affinity_detect(&topology) == 0)
+        {
+            options.topology = &topology;
+            printf("pinning to %d physical cores\n", topology.count);
+        }
+        else
+        {
+            fprintf(stderr, "cpu topology not available, processes are not pinned\n");
+        }
+    }
+
+    status = socketfork(&options);
     if(status == -1)
     {
         perror("starting monitor");
@@ -58,16 +334,16 @@ int main(int argc, char *argv[])
     return EXIT_SUCCESS;
 }
 
-int (*load_lib(void **handle, const char *lib_path))(int, sem_t *)
+int (*load_lib(void **handle, const char *lib_path))(int, struct handler_ctx *)
 {
     // avoiding direct casting
     union
     {
         void *ptr;
-        int (*func)(int, sem_t *);
+        int (*func)(int, struct handler_ctx *);
     } cast_helper;
 
-    int (*worker_handle_so)(int, sem_t *) = NULL;
+    int (*worker_handle_so)(int, struct handler_ctx *) = NULL;
 
     *handle = dlopen(lib_path, RTLD_LAZY);
     if(*handle == NULL)
@@ -89,269 +365,1394 @@ int (*load_lib(void **handle, const char *lib_path))(int, sem_t *)
     return worker_handle_so;
 }
 
-void worker(int domain_socket, sem_t *semaphore)
+// the generation the monitor assigned to the slot, from the monitor's copy of it. exits if it cannot be loaded
+static int (*load_assigned_lib(void **handle, struct pool_shared *pool, int slot_index, int threads))(int, struct handler_ctx *)
+{
+    struct worker_slot *slot = &pool->slots[slot_index];
+    char                path[PATH_MAX];
+    unsigned int        generation;
+    int (*worker_handle)(int, struct handler_ctx *);
+
+    generation = atomic_load(&slot->target_generation);
+    library_copy_path(pool, generation, path, sizeof(path));
+
+    worker_handle = load_lib(handle, path);
+    if(!worker_handle)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_store(&slot->loaded_generation, generation);
+    scoreboard_loaded(&pool->scoreboard->workers[slot_index], path, threads);
+
+    return worker_handle;
+}
+
+_Noreturn void worker(int domain_socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct options *options)
 {
     void *handle;
-    int (*worker_handle)(int, sem_t *);
-    struct stat lib_stat;
-    struct stat prev_lib_stat;
-    const char *lib_path = "/Users/developer/rm4/src/libmylib.so";
+    int (*worker_handle)(int, struct handler_ctx *);
+    struct worker_slot *slot = &pool->slots[slot_index];
+    sigset_t            wait_mask;
+    struct handler_ctx  ctx;
+    struct arena        arena;
 
-    // initially set prev_lib_stat so we can compare changes
-    if(stat(lib_path, &prev_lib_stat) == -1)
+    if(options->threads > 0)
     {
-        perror("stat failed");
-        return;
+        worker_threaded(domain_socket, semaphore, pool, slot_index, options);
     }
 
-    // load shared object entry function
-    worker_handle = load_lib(&handle, lib_path);
-    if(!worker_handle)
+    setup_retire_signal(&wait_mask);
+    ctx.sem               = semaphore;
+    ctx.uring             = uring_create(options->deadlines.write_ms);
+    ctx.header_timeout_ms = options->deadlines.header_ms;
+    ctx.pool              = pool;
+    ctx.metrics           = &pool->metrics->workers[slot_index];
+    ctx.scoreboard        = &pool->scoreboard->workers[slot_index].thread[0];
+    ctx.arena             = &arena;
+    ctx.peer_sock         = -1;
+    if(arena_init(&arena, HANDLER_ARENA_SIZE) == -1)
     {
         exit(EXIT_FAILURE);
     }
 
-    while(!exit_flag)
+    // load shared object entry function
+    worker_handle = load_assigned_lib(&handle, pool, slot_index, 1);
+
+    while(!exit_flag && !atomic_load(&slot->retiring))
     {
-        int client_fd;
-        int original_fd;
-        client_fd = recv_fd(domain_socket, &original_fd);    // request was given at this point
-        if(client_fd < 0)
+        int            client_fd;
+        struct handoff handoff;
+        uint64_t       start;
+        uint64_t       handled;
+        uint64_t       end;
+        fd_set         read_fds;
+
+        // the monitor has assigned this worker another build and it is its turn to switch
+        if(atomic_exchange(&slot->reload, 0))
         {
-            perror("recv fd");
-            exit(EXIT_FAILURE);
+            dlclose(handle);
+            worker_handle = load_assigned_lib(&handle, pool, slot_index, 1);
+            printf("worker %d reloaded handler library (generation %u)\n", getpid(), atomic_load(&slot->loaded_generation));
+            continue;
         }
 
-        // get new stat when request was given
-        if(stat(lib_path, &lib_stat) == -1)
+        FD_ZERO(&read_fds);
+        FD_SET(domain_socket, &read_fds);
+
+        // the retire and reload signals are only let through while idle here, so neither cuts a connection short
+        if(pselect(domain_socket + 1, &read_fds, NULL, NULL, NULL, &wait_mask) == -1)
         {
-            perror("stat failed");
-            break;
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("pselect");
+            exit(EXIT_FAILURE);
         }
 
-        // if time of last update was changed, reload the library
-        if(lib_stat.st_mtime != prev_lib_stat.st_mtime)
+        client_fd = recv_fd(domain_socket, &handoff);    // request was given at this point
+        if(client_fd < 0)
         {
-            printf("Library updated. Reloading...\n");
-
-            dlclose(handle);
-            worker_handle = load_lib(&handle, lib_path);
-            if(!worker_handle)
+            // another worker was woken for the same fd and got it first
+            if(errno == EAGAIN || errno == EINTR)
             {
-                break;
+                continue;
             }
-
-            prev_lib_stat = lib_stat;
+            perror("recv fd");
+            exit(EXIT_FAILURE);
         }
 
+        atomic_fetch_add(&pool->picked_up, 1);
+        start = monotonic_ns();
+        metrics_record(ctx.metrics, STAGE_QUEUE, handoff.sent_ns - handoff.accepted_ns);
+        metrics_record(ctx.metrics, STAGE_HANDOFF, start - handoff.sent_ns);
+
         // on successfully recieved file descriptor
         if(client_fd > 0)
         {
-            while(1)
+            int status;
+
+            ctx.peer_sock = client_fd;
+            status        = options->tls ? tls_serve(options->tls, client_fd, worker_handle, &ctx) : worker_handle(client_fd, &ctx);
+
+            handled = monotonic_ns();
+            if(ctx.timeout != TIMEOUT_NONE)
             {
-                int work_done;
-                work_done = worker_handle(client_fd, semaphore);
-                // work was completed by the worker
-                if(work_done == 0)
-                {
-                    // write back the fd to be closed
-                    write(domain_socket, &original_fd, sizeof(original_fd));
-                    close(client_fd);
-                }
-                if(work_done == -1)
-                {
-                    break;
-                }
+                atomic_fetch_add(&pool->timeouts[ctx.timeout], 1);
+            }
+            metrics_record_version(pool, slot, handled - start, status != 0 || ctx.timeout != TIMEOUT_NONE);
+            scoreboard_done(ctx.scoreboard, client_fd);
+
+            // received and started are the same moment without a thread pool
+            if(handoff.traced)
+            {
+                struct trace_times times;
+
+                times.received_ns = start;
+                times.started_ns  = start;
+                times.parsed_ns   = ctx.parsed_ns;
+                times.handled_ns  = handled;
+                trace_worker(pool->trace, &handoff, 0, &times);
             }
+
+            // hand back the fd to be closed, also when the client hung up without a request.
+            // otherwise the dispatcher keeps it open and it counts against the connection cap forever
+            pool_complete(pool, slot_index, handoff.original_fd);
         }
         close(client_fd);
+
+        end = monotonic_ns();
+        metrics_record(ctx.metrics, STAGE_TOTAL, end - handoff.accepted_ns);
+        atomic_fetch_add(&slot->busy_ns, end - start);
+        atomic_fetch_add(&slot->served, 1);
     }
     dlclose(handle);
+    uring_destroy(ctx.uring);
+    arena_destroy(&arena);
     exit(EXIT_SUCCESS);
 }
 
-_Noreturn void start_monitor(int domain_socket, int workers_num)
+// one process, several threads sharing the library and the database handle. the main thread only
+// waits for signals and does the reloads, the pool threads serve connections
+static void worker_threaded(int domain_socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct options *options)
 {
-    pid_t *workers;
-    sem_t *semaphore;
+    void *handle;
+    int (*worker_handle)(int, struct handler_ctx *);
+    struct worker_slot *slot = &pool->slots[slot_index];
+    struct thread_pool  tp;
+    sigset_t            wait_mask;
+    sigset_t            block_mask;
+
+    // the threads inherit this mask, so SIGINT and SIGUSR1 are only ever taken by pselect below
+    setup_retire_signal(&wait_mask);
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block_mask, NULL);
+
+    worker_handle = load_assigned_lib(&handle, pool, slot_index, options->threads);
 
-    if(workers_num <= 0)
+    if(thread_pool_start(&tp, options->threads, domain_socket, semaphore, pool, slot_index, &options->deadlines, options->tls, worker_handle) == -1)
     {
-        fprintf(stderr, "workers_num must be greater than 0\n");
         exit(EXIT_FAILURE);
     }
 
-    workers = (pid_t *)malloc(sizeof(pid_t) * (size_t)workers_num);
-    if(workers == NULL)
+    while(!exit_flag && !atomic_load(&slot->retiring))
+    {
+        if(atomic_exchange(&slot->reload, 0))
+        {
+            // every thread has to be out of the old library before it is closed
+            thread_pool_pause(&tp);
+            dlclose(handle);
+
+            // marks the new generation loaded before the threads run again, so their first requests
+            // count for the right side of a canary
+            worker_handle = load_assigned_lib(&handle, pool, slot_index, options->threads);
+            thread_pool_resume(&tp, worker_handle);
+            printf("worker %d reloaded handler library (generation %u)\n", getpid(), atomic_load(&slot->loaded_generation));
+            continue;
+        }
+
+        pselect(0, NULL, NULL, NULL, NULL, &wait_mask);
+    }
+
+    thread_pool_stop(&tp);
+    dlclose(handle);
+    exit(EXIT_SUCCESS);
+}
+
+_Noreturn void start_monitor(int domain_socket, struct pool_shared *pool, const struct options *options)
+{
+    struct monitor monitor;
+    char           path[PATH_MAX];
+    uint64_t       next_tick;
+
+    if(options->workers_num <= 0)
     {
-        perror("malloc failed");
+        fprintf(stderr, "workers_num must be greater than 0\n");
         exit(EXIT_FAILURE);
     }
 
-    semaphore = sem_open("/db_sem", O_CREAT, 0644, 1);    // NOLINT
-    if(semaphore == SEM_FAILED)
+    memset(&monitor, 0, sizeof(monitor));
+    monitor.domain_socket = domain_socket;
+    monitor.pool          = pool;
+    monitor.options       = options;
+    monitor.min_workers   = options->workers_num;
+    monitor.max_workers   = options->max_workers;
+    monitor.reload_slot   = -1;
+
+    monitor.semaphore = sem_open("/db_sem", O_CREAT, 0644, 1);    // NOLINT
+    if(monitor.semaphore == SEM_FAILED)
     {
         perror("sem_open");
         exit(EXIT_FAILURE);
     }
 
-    for(int i = 0; i < workers_num; ++i)
+    // must exist before the first fork so no exit is missed
+    monitor.child_events = setup_child_events();
+    if(monitor.child_events == -1)
     {
-        int p = fork();
-        if(p == 0)
-        {
-            worker(domain_socket, semaphore);
-        }
-        if(p < 0)
-        {
-            perror("fork fail");
-            exit(EXIT_FAILURE);
-        }
+        exit(EXIT_FAILURE);
+    }
+
+    if(lib_version_read(LIB_PATH, &monitor.lib_version) == -1)
+    {
+        perror("stat " LIB_PATH);
+        exit(EXIT_FAILURE);
+    }
+    monitor.lib_watch = reload_watch_open(LIB_PATH);
 
-        workers[i] = p;
-        printf("process spawned pid: %d\n", p);
+    // the workers never load LIB_PATH itself, only the copies the monitor makes of every generation
+    pool->library_owner    = getpid();
+    monitor.rollout.stable = atomic_load(&pool->generation);
+    library_copy_path(pool, monitor.rollout.stable, path, sizeof(path));
+    if(reload_copy(LIB_PATH, path) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < options->workers_num; ++i)
+    {
+        spawn_worker(&monitor, i);
     }
 
+    monitor.scaler.last_tick_ns = monotonic_ns();
+    next_tick                   = monitor.scaler.last_tick_ns + MONITOR_TICK_NS;
+
     // MONITOR WORKER HEALTH
+    // sleeps until a worker exits, the library changes, a delayed respawn or reload step is due or the autoscaler ticks
     while(!exit_flag)
     {
-        sleep(1);
-        for(int i = 0; i < workers_num; ++i)
+        struct pollfd pfds[2];
+        uint64_t      now = monotonic_ns();
+        uint64_t      wake_at;
+
+        wake_at = next_respawn_time(&monitor);
+        if(wake_at == 0 || wake_at > next_tick)
+        {
+            wake_at = next_tick;
+        }
+        if(monitor.reload_due != 0 && monitor.reload_due < wake_at)
+        {
+            wake_at = monitor.reload_due;
+        }
+        if(monitor.reload_slot != -1 && now + RELOAD_STEP_NS < wake_at)
         {
-            int   status;
-            pid_t result = waitpid(workers[i], &status, WNOHANG);
+            wake_at = now + RELOAD_STEP_NS;
+        }
 
-            if(result == -1)
-            {
-                perror("waitpid failed");
-                continue;
-            }
+        // poll skips the watch entry when it is -1
+        pfds[0].fd      = monitor.child_events;
+        pfds[0].events  = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd      = monitor.lib_watch;
+        pfds[1].events  = POLLIN;
+        pfds[1].revents = 0;
 
-            if(result == 0)
-            {
-                continue;
-            }
+        if(poll(pfds, 2, wake_at > now ? (int)((wake_at - now + NS_PER_MS - 1) / NS_PER_MS) : 0) == -1 && errno != EINTR)
+        {
+            perror("monitor poll");
+            break;
+        }
 
-            // worker killed, spawn new
-            if(WIFEXITED(status) || WIFSIGNALED(status))
-            {
-                pid_t p;
-                printf("worker %d failed, spawning new...\n", workers[i]);
-                sleep(3);    // NOLINT
-                p = fork();
-                if(p == 0)
-                {
-                    worker(domain_socket, semaphore);
-                }
-                if(p < 0)
-                {
-                    perror("fork failed");
-                    exit(EXIT_FAILURE);
-                }
+        if(pfds[0].revents & POLLIN)
+        {
+            drain_child_events(monitor.child_events);
+        }
+
+        if((pfds[1].revents & POLLIN) && reload_watch_drain(monitor.lib_watch, LIB_PATH))
+        {
+            monitor.reload_due = monotonic_ns() + RELOAD_SETTLE_NS;
+        }
+
+        reap_workers(&monitor);
+        respawn_due_workers(&monitor);
+        check_library(&monitor);
+        roll_out_library(&monitor);
+        check_canary(&monitor);
 
-                workers[i] = p;
-                printf("spawned worker with pid: %d\n", p);
+        now = monotonic_ns();
+        if(now >= next_tick)
+        {
+            // without inotify the library is polled once per tick instead
+            if(monitor.lib_watch == -1 && monitor.reload_due == 0)
+            {
+                monitor.reload_due = now;
             }
+            autoscale(&monitor);
+            next_tick = now + MONITOR_TICK_NS;
         }
     }
 
+    stop_workers(&monitor);
+    remove_library_copy(pool, monitor.rollout.stable);
+    if(monitor.rollout.canary != 0)
+    {
+        remove_library_copy(pool, monitor.rollout.canary);
+    }
     close(domain_socket);
-    free(workers);
     exit(EXIT_SUCCESS);
 }
 
-// TEST SOCKETPAIR. CHANGE TO MAIN SERVER LOGIC
-int parent(int domain_socket)
+// retire every worker and wait for them. they exit once idle, and after a drain they all are
+static void stop_workers(struct monitor *monitor)
 {
-    int server_socket;
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        struct worker_slot *slot = &monitor->pool->slots[i];
 
-    int           *client_sockets = NULL;
-    nfds_t         max_clients    = 0;
-    struct pollfd *fds;    // keeping track of all fds
+        if(slot->pid != 0)
+        {
+            atomic_store(&slot->retiring, 1);
+            kill(slot->pid, SIGUSR1);
+        }
+    }
 
-    // SETUP NETWORK SOCKET TO ACCEPT CLIENTS
-    server_socket = initialize_socket();
-    if(server_socket == -1)
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR)
     {
-        perror("network socket");
-        return -1;
     }
+}
+
+static void spawn_worker(struct monitor *monitor, int slot_index)
+{
+    struct worker_slot *slot = &monitor->pool->slots[slot_index];
+    pid_t               p;
 
-    fds = initialize_pollfds(server_socket, &client_sockets);
+    atomic_store(&slot->retiring, 0);
+    atomic_store(&slot->reload, 0);
+    atomic_store(&slot->target_generation, monitor->rollout.stable);
+    scoreboard_reset(&monitor->pool->scoreboard->workers[slot_index]);
 
-    set_socket_nonblock(domain_socket);
+    // otherwise the child inherits and prints whatever is still buffered
+    fflush(stdout);
 
-    while(!exit_flag)
+    p = fork();
+    if(p == 0)
+    {
+        close(monitor->child_events);
+        if(monitor->lib_watch != -1)
+        {
+            close(monitor->lib_watch);
+        }
+        if(monitor->options->topology)
+        {
+            affinity_place(monitor->options->topology, slot_index);
+        }
+        worker(monitor->domain_socket, monitor->semaphore, monitor->pool, slot_index, monitor->options);
+        exit(EXIT_FAILURE);
+    }
+    if(p < 0)
     {
-        int activity;
+        perror("fork fail");
+        exit(EXIT_FAILURE);
+    }
 
-        // poll for connection attempt
-        activity = poll(fds, max_clients + 1, 1000);    //  NOLINT
-        if(activity < 0)
+    slot->pid                                   = p;
+    monitor->supervision[slot_index].spawned_ns = monotonic_ns();
+    monitor->supervision[slot_index].respawn_at = 0;
+    printf("process spawned pid: %d\n", p);
+}
+
+// collect every exited worker without blocking. a worker that dies soon after starting is treated as
+// crash looping and waits before it is replaced, with the wait doubling on every further quick death
+static void reap_workers(struct monitor *monitor)
+{
+    int   status;
+    pid_t pid;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for(int i = 0; i < POOL_MAX_WORKERS; ++i)
         {
-            if(errno == EINTR)
+            struct worker_slot *slot        = &monitor->pool->slots[i];
+            struct supervision *supervision = &monitor->supervision[i];
+            uint64_t            now;
+
+            if(slot->pid != pid)
             {
                 continue;
             }
 
-            perror("Poll error");
-            exit(EXIT_FAILURE);
+            slot->pid = 0;
+
+            // retired by the autoscaler, the slot is free again
+            if(atomic_load(&slot->retiring))
+            {
+                printf("worker %d retired\n", pid);
+                break;
+            }
+
+            // a library that takes its worker down has failed the comparison already
+            if(monitor->rollout.canary != 0 && atomic_load(&slot->target_generation) == monitor->rollout.canary)
+            {
+                printf("canary worker %d died, rolling back generation %u\n", pid, monitor->rollout.canary);
+                roll_back_library(monitor);
+            }
+
+            now = monotonic_ns();
+            if(now - supervision->spawned_ns < CRASH_LOOP_WINDOW_NS)
+            {
+                uint64_t backoff = RESPAWN_BACKOFF_MIN_NS << (supervision->crashes < RESPAWN_BACKOFF_MAX_SHIFT ? supervision->crashes : RESPAWN_BACKOFF_MAX_SHIFT);
+                supervision->crashes++;
+                supervision->respawn_at = now + backoff;
+                printf("worker %d failed after %llu ms, respawning in %llu ms\n", pid, (unsigned long long)((now - supervision->spawned_ns) / NS_PER_MS), (unsigned long long)(backoff / NS_PER_MS));
+            }
+            else
+            {
+                supervision->crashes    = 0;
+                supervision->respawn_at = now;
+                printf("worker %d failed, spawning new...\n", pid);
+            }
+            break;
         }
+    }
+}
 
-        // TEST CONNECTIONS
-        handle_new_connection(server_socket, &client_sockets, &max_clients, &fds);
+static void respawn_due_workers(struct monitor *monitor)
+{
+    uint64_t now = monotonic_ns();
 
-        if(client_sockets != NULL)
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        if(monitor->supervision[i].respawn_at != 0 && monitor->supervision[i].respawn_at <= now)
         {
-            // Handle incoming data from existing clients
-            // IF INCOMING DATA SEND FILE DESCRIPTOR TO WORKER
-            handle_client_data(fds, client_sockets, &max_clients, domain_socket);
+            spawn_worker(monitor, i);
         }
-        read_original_fd(domain_socket, &client_sockets, &fds, &max_clients);
     }
+}
 
-    free(fds);
+// earliest pending respawn, 0 if there is none
+static uint64_t next_respawn_time(const struct monitor *monitor)
+{
+    uint64_t earliest = 0;
 
-    // Cleanup and close all client sockets
-    for(size_t i = 0; i < max_clients; i++)
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
     {
-        if(client_sockets != NULL)
+        uint64_t respawn_at = monitor->supervision[i].respawn_at;
+
+        if(respawn_at != 0 && (earliest == 0 || respawn_at < earliest))
         {
-            if(client_sockets[i] > 0)
-            {
-                socket_close(client_sockets[i]);
-            }
+            earliest = respawn_at;
         }
     }
 
-    free(client_sockets);
-    socket_close(server_socket);
+    return earliest;
+}
 
-    return 0;
+// a slot counts as taken while its worker runs or waits to be respawned
+static int slot_in_use(const struct monitor *monitor, int slot_index)
+{
+    return monitor->pool->slots[slot_index].pid != 0 || monitor->supervision[slot_index].respawn_at != 0;
 }
 
-int socketfork(int workers_num)
+// grow the pool when fds queue up or the workers are nearly always busy, shrink it when they are mostly idle
+static void autoscale(struct monitor *monitor)
 {
-    int   sv[2];
-    pid_t pid;
+    struct pool_shared *pool    = monitor->pool;
+    struct autoscaler  *scaler  = &monitor->scaler;
+    uint64_t            now     = monotonic_ns();
+    uint64_t            elapsed = now - scaler->last_tick_ns;
+    uint64_t            busy    = 0;
+    uint64_t            queued  = atomic_load(&pool->dispatched) - atomic_load(&pool->picked_up);
+    int                 active  = 0;
+    int                 busy_percent;
 
-    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
     {
-        perror("socketpair");
-        return -1;
+        busy += atomic_load(&pool->slots[i].busy_ns);
+        if(slot_in_use(monitor, i) && !atomic_load(&pool->slots[i].retiring))
+        {
+            active++;
+        }
     }
 
-    pid = fork();
-
-    if(pid == 0)
+    busy_percent = 0;
+    if(active > 0 && elapsed > 0)
+    {
+        busy_percent = (int)((busy - scaler->last_busy_ns) * PERCENT / (elapsed * (uint64_t)active));
+    }
+
+    scaler->last_busy_ns = busy;
+    scaler->last_tick_ns = now;
+
+    if(queued > (uint64_t)active * SCALE_UP_QUEUE_PER_WORKER || busy_percent >= SCALE_UP_BUSY_PERCENT)
+    {
+        scaler->high_ticks++;
+        scaler->low_ticks = 0;
+    }
+    else if(queued == 0 && busy_percent <= SCALE_DOWN_BUSY_PERCENT)
+    {
+        scaler->low_ticks++;
+        scaler->high_ticks = 0;
+    }
+    else
+    {
+        scaler->high_ticks = 0;
+        scaler->low_ticks  = 0;
+    }
+
+    if(now - scaler->last_scale_ns < SCALE_COOLDOWN_NS)
+    {
+        return;
+    }
+
+    // traffic swings several-fold, so grow by half the pool at a time
+    if(scaler->high_ticks >= SCALE_UP_TICKS && active < monitor->max_workers)
+    {
+        int grow = active / 2 > 1 ? active / 2 : 1;
+
+        for(int i = 0; i < POOL_MAX_WORKERS && grow > 0 && active < monitor->max_workers; ++i)
+        {
+            if(!slot_in_use(monitor, i))
+            {
+                monitor->supervision[i].crashes = 0;
+                spawn_worker(monitor, i);
+                grow--;
+                active++;
+            }
+        }
+
+        printf("scaled up to %d workers (queued %llu, busy %d%%)\n", active, (unsigned long long)queued, busy_percent);
+        scaler->last_scale_ns = now;
+        scaler->high_ticks    = 0;
+        return;
+    }
+
+    // shrink one worker at a time, the newest first
+    if(scaler->low_ticks >= SCALE_DOWN_TICKS && active > monitor->min_workers)
+    {
+        for(int i = POOL_MAX_WORKERS - 1; i >= 0; --i)
+        {
+            struct worker_slot *slot = &pool->slots[i];
+
+            if(slot->pid != 0 && !atomic_load(&slot->retiring))
+            {
+                atomic_store(&slot->retiring, 1);
+                kill(slot->pid, SIGUSR1);
+                printf("retiring worker %d (busy %d%%)\n", slot->pid, busy_percent);
+                break;
+            }
+        }
+
+        scaler->last_scale_ns = now;
+        scaler->low_ticks     = 0;
+    }
+}
+
+// validate a changed library once, then start moving the workers over to it. the copy is made first
+// and validated as it will be loaded, so a deploy landing in between cannot slip past the check
+static void check_library(struct monitor *monitor)
+{
+    struct pool_shared *pool = monitor->pool;
+    struct lib_version  version;
+    char                path[PATH_MAX];
+    unsigned int        generation;
+
+    if(monitor->reload_due == 0 || monotonic_ns() < monitor->reload_due)
+    {
+        return;
+    }
+    monitor->reload_due = 0;
+
+    // mid-rename or mid-copy, the next event brings it back
+    if(lib_version_read(LIB_PATH, &version) == -1 || lib_version_equal(&version, &monitor->lib_version))
+    {
+        return;
+    }
+
+    generation = atomic_load(&pool->generation) + 1;
+    library_copy_path(pool, generation, path, sizeof(path));
+    if(reload_copy(LIB_PATH, path) == -1)
+    {
+        return;
+    }
+
+    if(reload_validate(path) == -1)
+    {
+        fprintf(stderr, "rejected new handler library, workers keep the current one\n");
+        unlink(path);
+        // remembered so the same broken build is not validated again on every poll
+        monitor->lib_version = version;
+        return;
+    }
+
+    monitor->lib_version = version;
+    atomic_store(&pool->generation, generation);
+
+    // a newer build replaces the one still on trial, it is compared against the stable one from scratch
+    if(monitor->rollout.canary != 0)
+    {
+        printf("generation %u superseded while on trial\n", monitor->rollout.canary);
+        roll_back_library(monitor);
+    }
+
+    if(start_canary(monitor, generation) == -1)
+    {
+        promote_library(monitor, generation);
+        printf("handler library validated, reloading workers (generation %u)\n", generation);
+    }
+}
+
+// one worker at a time switches to the generation assigned to it, the next one is asked only after it is done
+static void roll_out_library(struct monitor *monitor)
+{
+    if(monitor->reload_slot != -1)
+    {
+        struct worker_slot *slot = &monitor->pool->slots[monitor->reload_slot];
+
+        // still reloading, or still finishing the connection it had
+        if(slot->pid != 0 && !atomic_load(&slot->retiring) && atomic_load(&slot->loaded_generation) != atomic_load(&slot->target_generation))
+        {
+            return;
+        }
+        monitor->reload_slot = -1;
+    }
+
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        struct worker_slot *slot = &monitor->pool->slots[i];
+
+        if(slot->pid != 0 && !atomic_load(&slot->retiring) && atomic_load(&slot->loaded_generation) != atomic_load(&slot->target_generation))
+        {
+            monitor->reload_slot = i;
+            atomic_store(&slot->reload, 1);
+            kill(slot->pid, SIGUSR1);
+            return;
+        }
+    }
+}
+
+// moves -k percent of the running workers, at least one and never all, to the new generation.
+// returns -1 when there is no canary to run and the generation should go to every worker
+static int start_canary(struct monitor *monitor, unsigned int generation)
+{
+    struct pool_shared *pool   = monitor->pool;
+    int                 active = 0;
+    int                 canaries;
+
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        if(pool->slots[i].pid != 0 && !atomic_load(&pool->slots[i].retiring))
+        {
+            active++;
+        }
+    }
+
+    if(monitor->options->canary_percent == 0 || active < 2)
+    {
+        return -1;
+    }
+
+    canaries = (active * monitor->options->canary_percent + PERCENT - 1) / PERCENT;
+    if(canaries >= active)
+    {
+        canaries = active - 1;
+    }
+
+    monitor->rollout.canary          = generation;
+    monitor->rollout.measuring_since = 0;
+    atomic_store(&pool->canary_generation, generation);
+
+    for(int i = 0, assigned = 0; i < POOL_MAX_WORKERS && assigned < canaries; ++i)
+    {
+        if(pool->slots[i].pid != 0 && !atomic_load(&pool->slots[i].retiring))
+        {
+            atomic_store(&pool->slots[i].target_generation, generation);
+            assigned++;
+        }
+    }
+
+    printf("handler library validated, trying generation %u on %d of %d workers\n", generation, canaries, active);
+
+    return 0;
+}
+
+// starts the comparison once every canary worker has switched, then decides when both sides have
+// seen enough requests, or at the latest CANARY_MAX_NS after it began
+static void check_canary(struct monitor *monitor)
+{
+    struct rollout *rollout = &monitor->rollout;
+    uint64_t        now;
+    int             regressed;
+
+    if(rollout->canary == 0)
+    {
+        return;
+    }
+
+    now = monotonic_ns();
+    if(rollout->measuring_since == 0)
+    {
+        for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+        {
+            struct worker_slot *slot = &monitor->pool->slots[i];
+
+            if(slot->pid != 0 && atomic_load(&slot->target_generation) == rollout->canary && atomic_load(&slot->loaded_generation) != rollout->canary)
+            {
+                return;
+            }
+        }
+
+        metrics_reset_versions(monitor->pool->metrics);
+        rollout->measuring_since = now;
+        rollout->decide_by       = now + CANARY_MAX_NS;
+        return;
+    }
+
+    if(now - rollout->measuring_since < CANARY_MIN_NS)
+    {
+        return;
+    }
+
+    regressed = canary_regressed(monitor, now);
+    if(regressed == 1)
+    {
+        printf("rolling back generation %u to %u\n", rollout->canary, rollout->stable);
+        roll_back_library(monitor);
+    }
+    else if(regressed == 0)
+    {
+        printf("promoting generation %u to every worker\n", rollout->canary);
+        promote_library(monitor, rollout->canary);
+    }
+}
+
+// 1 if the canary side is slower at p99 or fails more often than the tolerances allow, 0 if not,
+// -1 if there is too little to go on yet. with no canary requests at all by the deadline it passes,
+// a pool without traffic would otherwise never take a new build
+static int canary_regressed(const struct monitor *monitor, uint64_t now)
+{
+    struct histogram *canary;
+    struct histogram *baseline;
+    uint64_t          canary_errors;
+    uint64_t          baseline_errors;
+    uint64_t          canary_p99;
+    uint64_t          baseline_p99;
+    uint64_t          canary_permille;
+    uint64_t          baseline_permille;
+    int               regressed;
+
+    canary   = (struct histogram *)malloc(sizeof(struct histogram));
+    baseline = (struct histogram *)malloc(sizeof(struct histogram));
+    if(canary == NULL || baseline == NULL)
+    {
+        perror("malloc canary histograms");
+        free(canary);
+        free(baseline);
+        return -1;
+    }
+
+    canary_errors   = metrics_read_version(monitor->pool->metrics, VERSION_CANARY, canary);
+    baseline_errors = metrics_read_version(monitor->pool->metrics, VERSION_BASELINE, baseline);
+
+    if((canary->count < CANARY_MIN_REQUESTS || baseline->count < CANARY_MIN_REQUESTS) && now < monitor->rollout.decide_by)
+    {
+        free(canary);
+        free(baseline);
+        return -1;
+    }
+
+    canary_p99        = histogram_percentile(canary, P99);
+    baseline_p99      = histogram_percentile(baseline, P99);
+    canary_permille   = canary->count ? canary_errors * PERMILLE / canary->count : 0;
+    baseline_permille = baseline->count ? baseline_errors * PERMILLE / baseline->count : 0;
+
+    printf("canary generation %u: %llu requests, p99 %llu us, %llu errors. baseline: %llu requests, p99 %llu us, %llu errors\n", monitor->rollout.canary, (unsigned long long)canary->count, (unsigned long long)(canary_p99 / NS_PER_US), (unsigned long long)canary_errors, (unsigned long long)baseline->count, (unsigned long long)(baseline_p99 / NS_PER_US), (unsigned long long)baseline_errors);
+
+    regressed = 0;
+    if(canary->count > 0 && baseline->count > 0 && canary_p99 > baseline_p99 + baseline_p99 * CANARY_P99_TOLERANCE_PERCENT / PERCENT + CANARY_P99_SLACK_NS)
+    {
+        regressed = 1;
+    }
+    if(canary_permille > baseline_permille + CANARY_ERROR_TOLERANCE_PERMILLE)
+    {
+        regressed = 1;
+    }
+
+    free(canary);
+    free(baseline);
+
+    return regressed;
+}
+
+// every worker is told to run generation, the copy of the one it replaces is not needed any more
+static void promote_library(struct monitor *monitor, unsigned int generation)
+{
+    struct pool_shared *pool     = monitor->pool;
+    unsigned int        previous = monitor->rollout.stable;
+
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        atomic_store(&pool->slots[i].target_generation, generation);
+    }
+
+    monitor->rollout.stable = generation;
+    monitor->rollout.canary = 0;
+    atomic_store(&pool->canary_generation, 0);
+
+    if(previous != generation)
+    {
+        remove_library_copy(pool, previous);
+    }
+}
+
+// the canary workers go back to the stable generation. monitor->lib_version keeps the rejected build,
+// so it is not tried again until LIB_PATH changes once more
+static void roll_back_library(struct monitor *monitor)
+{
+    struct pool_shared *pool = monitor->pool;
+
+    for(int i = 0; i < POOL_MAX_WORKERS; ++i)
+    {
+        if(atomic_load(&pool->slots[i].target_generation) == monitor->rollout.canary)
+        {
+            atomic_store(&pool->slots[i].target_generation, monitor->rollout.stable);
+        }
+    }
+
+    atomic_store(&pool->canary_generation, 0);
+    remove_library_copy(pool, monitor->rollout.canary);
+    monitor->rollout.canary = 0;
+}
+
+// next to LIB_PATH, named after the monitor so a second server on the same library keeps its own
+static void library_copy_path(const struct pool_shared *pool, unsigned int generation, char *path, size_t max_len)
+{
+    snprintf(path, max_len, "%s.%d.%u", LIB_PATH, (int)pool->library_owner, generation);
+}
+
+// workers that still have it mapped keep running it, only the name goes away
+static void remove_library_copy(const struct pool_shared *pool, unsigned int generation)
+{
+    char path[PATH_MAX];
+
+    library_copy_path(pool, generation, path, sizeof(path));
+    if(unlink(path) == -1 && errno != ENOENT)
+    {
+        perror("unlink library copy");
+    }
+}
+
+#if defined(__linux__)
+// SIGCHLD is blocked and read from a signalfd instead, so child exits wake the monitor's poll
+static int setup_child_events(void)
+{
+    sigset_t mask;
+    int      fd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("signalfd");
+    }
+
+    return fd;
+}
+
+static void drain_child_events(int child_events)
+{
+    struct signalfd_siginfo info;
+
+    while(read(child_events, &info, sizeof(info)) == (ssize_t)sizeof(info))
+    {
+    }
+}
+#else
+static int child_pipe[2] = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// self-pipe for platforms without signalfd, the handler only writes a byte
+static int setup_child_events(void)
+{
+    struct sigaction sa;
+
+    if(pipe(child_pipe) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    set_socket_nonblock(child_pipe[0]);
+    set_socket_nonblock(child_pipe[1]);
+    fcntl(child_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(child_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigchld_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    return child_pipe[0];
+}
+
+static void drain_child_events(int child_events)
+{
+    char drain[PIPE_DRAIN_SIZE];
+
+    while(read(child_events, drain, sizeof(drain)) > 0)
+    {
+    }
+}
+#endif
+
+// TEST SOCKETPAIR. CHANGE TO MAIN SERVER LOGIC
+int parent(int domain_socket, const int *listeners, int listener_count, int ready_fd, struct pool_shared *pool, const struct options *options)
+{
+    int                *client_sockets = NULL;
+    nfds_t              max_clients    = 0;
+    struct pollfd      *fds;    // keeping track of all fds
+    struct restart      restart;
+    uint64_t            drain_deadline = 0;
+    struct client_index index;    // accept time and position by fd
+    struct timer_wheel  timers;
+    struct connections  connections;
+    struct timeval      send_timeout;
+    int                 listener_family[MAX_LISTENERS];
+    int                 listening = 1;
+
+    restart.pid      = 0;
+    restart.ready_fd = -1;
+    restart.deadline = 0;
+    memset(&index, 0, sizeof(index));
+
+    if(options->topology)
+    {
+        printf("dispatcher pinned to cpu %d\n", affinity_place(options->topology, -1));
+    }
+
+    fds = initialize_pollfds(listeners, listener_count, pool->wake_fd[0], &client_sockets);
+
+    set_socket_nonblock(domain_socket);
+
+    // accepted tcp sockets inherit the send timeout from the listening socket, so the write deadline
+    // costs nothing per connection. unix sockets do not, they get it set on accept. the idle deadline
+    // until the first byte is kept here
+    send_timeout.tv_sec  = options->deadlines.write_ms / MS_PER_SEC;
+    send_timeout.tv_usec = (suseconds_t)(options->deadlines.write_ms % MS_PER_SEC) * US_PER_MS;
+    for(int i = 0; i < listener_count; i++)
+    {
+        listener_family[i] = socket_family(listeners[i]);
+        if(setsockopt(listeners[i], SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == -1)
+        {
+            perror("setsockopt SO_SNDTIMEO");
+        }
+    }
+
+    timer_wheel_init(&timers, monotonic_ns());
+    connections.client_sockets = &client_sockets;
+    connections.fds            = &fds;
+    connections.max_clients    = &max_clients;
+    connections.index          = &index;
+    connections.pool           = pool;
+
+    // started by a graceful restart, the previous generation can stop accepting now
+    if(ready_fd != -1)
+    {
+        char ready = 1;
+
+        write(ready_fd, &ready, 1);
+        close(ready_fd);
+    }
+
+    while(!exit_flag)
+    {
+        int      activity;
+        int      timeout_ms;
+        uint64_t now;
+
+        if(restart_flag)
+        {
+            restart_flag = 0;
+            // ignored while a restart is already under way
+            if(listening && restart.ready_fd == -1)
+            {
+                start_new_generation(listeners, listener_count, domain_socket, fds, max_clients, &restart);
+            }
+        }
+
+        // once the new generation is up, hand the listening sockets over and only finish what is open
+        if(restart.ready_fd != -1 && check_new_generation(&restart) == 1)
+        {
+            printf("generation %d took over, draining %lu connections\n", restart.pid, (unsigned long)max_clients);
+            for(int i = 0; i < listener_count; i++)
+            {
+                fds[i].fd = -1;
+                socket_close(listeners[i]);
+            }
+            listening      = 0;
+            drain_deadline = monotonic_ns() + DRAIN_TIMEOUT_NS;
+        }
+
+        // a worker finishing after the wakeup is armed wakes the poll below, anything before it is collected here
+        pool_arm_wakeup(pool);
+        collect_completions(pool->completions, options->max_workers, &client_sockets, &fds, &max_clients, index.slot);
+
+        if(!listening && (max_clients == 0 || monotonic_ns() >= drain_deadline))
+        {
+            break;
+        }
+
+        // poll for connection attempt, waking in time for the next deadline
+        timeout_ms = restart.ready_fd != -1 || !listening ? RESTART_POLL_MS : POLL_TIMEOUT_MS;
+        activity   = poll(fds, max_clients + POLL_CLIENT_BASE, timer_wheel_timeout_ms(&timers, monotonic_ns(), timeout_ms));
+        if(activity < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("Poll error");
+            exit(EXIT_FAILURE);
+        }
+
+        now = monotonic_ns();
+
+        if(fds[POLL_WAKE].revents & POLLIN)
+        {
+            pool_clear_wakeup(pool);
+        }
+
+        // TEST CONNECTIONS
+        for(int i = 0; i < listener_count; i++)
+        {
+            int accepted = handle_new_connection((nfds_t)i, &client_sockets, &max_clients, &fds, options->max_connections);
+
+            if(accepted == -1)
+            {
+                atomic_fetch_add(&pool->shed, 1);
+            }
+            else if(accepted == 1)
+            {
+                int client = client_sockets[max_clients - 1];
+
+                if(listener_family[i] == AF_UNIX && setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == -1)
+                {
+                    perror("setsockopt SO_SNDTIMEO");
+                }
+                timer_wheel_arm(&timers, client, now + (uint64_t)options->deadlines.idle_ms * NS_PER_MS, TIMEOUT_IDLE);
+                note_accept(&index, client, max_clients - 1, now);
+            }
+        }
+
+        if(client_sockets != NULL)
+        {
+            // Handle incoming data from existing clients
+            // IF INCOMING DATA SEND FILE DESCRIPTOR TO WORKER
+            int dispatched = handle_client_data(fds, client_sockets, &max_clients, domain_socket, &timers, index.accepted_at, pool->trace);
+            atomic_fetch_add(&pool->dispatched, (uint_least64_t)dispatched);
+        }
+
+        timer_wheel_advance(&timers, now, expire_connection, &connections);
+    }
+
+    free(fds);
+    free(index.accepted_at);
+    free(index.slot);
+    timer_wheel_destroy(&timers);
+
+    // Cleanup and close all client sockets
+    for(size_t i = 0; i < max_clients; i++)
+    {
+        if(client_sockets != NULL)
+        {
+            if(client_sockets[i] > 0)
+            {
+                socket_close(client_sockets[i]);
+            }
+        }
+    }
+
+    free(client_sockets);
+    for(int i = 0; i < listener_count && listening; i++)
+    {
+        socket_close(listeners[i]);
+    }
+
+    return 0;
+}
+
+// a connection that never sent anything before its idle deadline. it was never handed to a worker,
+// so the dispatcher holds the only descriptor and closing it is all there is to do
+static void expire_connection(void *arg, int fd, int kind)
+{
+    struct connections *connections = (struct connections *)arg;
+    nfds_t              i           = connections->index->slot[fd];
+
+    if(i < *connections->max_clients && (*connections->client_sockets)[i] == fd)
+    {
+        handle_client_disconnection(connections->client_sockets, connections->max_clients, connections->fds, i, connections->index->slot);
+        atomic_fetch_add(&connections->pool->timeouts[kind], 1);
+    }
+}
+
+// indexed by fd like the timer wheel, grown by doubling
+static void note_accept(struct client_index *index, int fd, nfds_t slot, uint64_t now)
+{
+    if(fd >= index->capacity)
+    {
+        int       new_capacity = index->capacity > 0 ? index->capacity : MIN_ACCEPT_CAPACITY;
+        uint64_t *grown;
+        nfds_t   *grown_slot;
+
+        while(new_capacity <= fd)
+        {
+            new_capacity *= 2;
+        }
+
+        grown      = (uint64_t *)realloc(index->accepted_at, (size_t)new_capacity * sizeof(uint64_t));
+        grown_slot = grown ? (nfds_t *)realloc(index->slot, (size_t)new_capacity * sizeof(nfds_t)) : NULL;
+        if(grown == NULL || grown_slot == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        index->accepted_at = grown;
+        index->slot        = grown_slot;
+        index->capacity    = new_capacity;
+    }
+
+    index->accepted_at[fd] = now;
+    index->slot[fd]        = slot;
+}
+
+// fork and exec the current command line with the listening sockets and the ready pipe left open.
+// everything else the dispatcher holds is closed in the child so it does not leak into the new generation
+static void start_new_generation(const int *listeners, int listener_count, int domain_socket, const struct pollfd *fds, nfds_t max_clients, struct restart *restart)
+{
+    int   ready[2];
+    pid_t pid;
+
+    if(pipe(ready) == -1)
+    {
+        perror("restart pipe");
+        return;
+    }
+
+    fflush(stdout);
+
+    pid = fork();
+    if(pid == 0)
+    {
+        char   listen_env[LISTEN_ENV_LEN];
+        char   ready_env[FD_ENV_LEN];
+        size_t len = 0;
+
+        close(ready[0]);
+        close(domain_socket);
+        for(nfds_t i = 0; i < max_clients; i++)
+        {
+            close(fds[i + POLL_CLIENT_BASE].fd);
+        }
+
+        listen_env[0] = '\0';
+        for(int i = 0; i < listener_count; i++)
+        {
+            len += (size_t)snprintf(listen_env + len, sizeof(listen_env) - len, i == 0 ? "%d" : ",%d", listeners[i]);
+        }
+        snprintf(ready_env, sizeof(ready_env), "%d", ready[1]);
+        setenv(LISTEN_FD_ENV, listen_env, 1);
+        setenv(READY_FD_ENV, ready_env, 1);
+
+        execvp(restart_argv[0], restart_argv);
+        perror("execvp");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(ready[1]);
+
+    if(pid < 0)
+    {
+        perror("fork");
+        close(ready[0]);
+        return;
+    }
+
+    set_socket_nonblock(ready[0]);
+    restart->pid      = pid;
+    restart->ready_fd = ready[0];
+    restart->deadline = monotonic_ns() + READY_TIMEOUT_NS;
+
+    printf("graceful restart, started generation %d\n", pid);
+}
+
+// 1 when the new generation reported ready, 0 while it is still starting, -1 when the restart was abandoned
+static int check_new_generation(struct restart *restart)
+{
+    char    ready;
+    ssize_t n;
+
+    n = read(restart->ready_fd, &ready, 1);
+    if(n == -1 && errno == EAGAIN && monotonic_ns() < restart->deadline)
+    {
+        return 0;
+    }
+
+    close(restart->ready_fd);
+    restart->ready_fd = -1;
+
+    if(n == 1)
+    {
+        return 1;
+    }
+
+    // exited or hung before it was ready, this generation keeps serving
+    fprintf(stderr, "generation %d failed to start, restart abandoned\n", restart->pid);
+    kill(restart->pid, SIGINT);
+    waitpid(restart->pid, NULL, WNOHANG);
+
+    return -1;
+}
+
+// descriptor passed down by the previous generation, -1 if there is none
+static int fd_from_env(const char *name)
+{
+    const char *value = getenv(name);
+    char       *endptr;
+    long        fd;
+
+    if(value == NULL)
+    {
+        return -1;
+    }
+
+    errno = 0;
+    fd    = strtol(value, &endptr, BASE);
+    unsetenv(name);
+
+    if(errno != 0 || *endptr != '\0' || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) == -1)
+    {
+        fprintf(stderr, "ignoring invalid %s\n", name);
+        return -1;
+    }
+
+    return (int)fd;
+}
+
+// the listening sockets passed down by the previous generation, returns how many. 0 if there are none
+static int listeners_from_env(int *listeners)
+{
+    char  value[LISTEN_ENV_LEN];
+    char *saveptr;
+    int   count = 0;
+
+    if(getenv(LISTEN_FD_ENV) == NULL)
+    {
+        return 0;
+    }
+
+    snprintf(value, sizeof(value), "%s", getenv(LISTEN_FD_ENV));
+    unsetenv(LISTEN_FD_ENV);
+
+    for(const char *token = strtok_r(value, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr))
+    {
+        char *endptr;
+        long  fd;
+
+        errno = 0;
+        fd    = strtol(token, &endptr, BASE);
+        if(count == MAX_LISTENERS || errno != 0 || *endptr != '\0' || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) == -1)
+        {
+            fprintf(stderr, "ignoring invalid %s\n", LISTEN_FD_ENV);
+            for(int i = 0; i < count; i++)
+            {
+                close(listeners[i]);
+            }
+            return 0;
+        }
+
+        listeners[count++] = (int)fd;
+    }
+
+    return count;
+}
+
+int socketfork(const struct options *options)
+{
+    int                 sv[2];
+    pid_t               pid;
+    struct pool_shared *pool;
+    int                 listeners[MAX_LISTENERS];
+    int                 listener_count;
+    int                 ready_fd;
+
+    // SETUP NETWORK SOCKETS TO ACCEPT CLIENTS
+    // inherited from the previous generation on a graceful restart, so no connection is refused during the swap
+    listener_count = listeners_from_env(listeners);
+    ready_fd       = fd_from_env(READY_FD_ENV);
+    if(listener_count == 0)
+    {
+        do
+        {
+            listeners[listener_count] = initialize_socket(options->listener_count ? options->listen_addresses[listener_count] : NULL);
+            if(listeners[listener_count] == -1)
+            {
+                perror("network socket");
+                return -1;
+            }
+            listener_count++;
+        } while(listener_count < options->listener_count);
+    }
+    else
+    {
+        printf("inherited %d listening sockets\n", listener_count);
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    pool = pool_create();
+    if(pool == NULL)
+    {
+        return -1;
+    }
+
+    // otherwise the monitor inherits and prints whatever is still buffered
+    fflush(stdout);
+
+    pid = fork();
+
+    if(pid == 0)
     {
         close(sv[0]);
-        start_monitor(sv[1], workers_num);
+        for(int i = 0; i < listener_count; i++)
+        {
+            close(listeners[i]);
+        }
+        if(ready_fd != -1)
+        {
+            close(ready_fd);
+        }
+        start_monitor(sv[1], pool, options);
     }
     else if(pid > 0)
     {
         close(sv[1]);
-        parent(sv[0]);
+        printf("dispatcher pid: %d, send SIGUSR2 for a graceful restart\n", getpid());
+        parent(sv[0], listeners, listener_count, ready_fd, pool, options);
+
+        // after a drain the monitor and its workers are still running, take them down with this generation
+        kill(pid, SIGINT);
+        waitpid(pid, NULL, 0);
+        pool_destroy(pool);
     }
     else
     {
@@ -362,12 +1763,105 @@ int socketfork(int workers_num)
     return 0;
 }
 
-void handle_arguments(int argc, char *argv[], int *workers_num)
+void handle_arguments(int argc, char *argv[], struct options *options)
 {
     int option;
-    while((option = getopt(argc, argv, "w:")) != -1)
+    while((option = getopt(argc, argv, "ac:i:k:l:r:s:t:w:x:K:T:")) != -1)
     {
-        if(option == 'w')
+        if(option == 'a')
+        {
+            options->pin_cpus = 1;
+        }
+        else if(option == 'c')
+        {
+            long  val;
+            char *endptr;
+            errno = 0;
+            val   = strtol(optarg, &endptr, BASE);
+
+            if(errno != 0 || *endptr != '\0' || val < MIN_CONNECTIONS || val > MAX_CONNECTIONS)
+            {
+                printf("-c must be an integer between %d and %d.\n", MIN_CONNECTIONS, MAX_CONNECTIONS);
+                exit(EXIT_FAILURE);
+            }
+
+            options->max_connections = (nfds_t)val;
+        }
+        else if(option == 'i' || option == 'r' || option == 's')
+        {
+            long  val;
+            char *endptr;
+            errno = 0;
+            val   = strtol(optarg, &endptr, BASE);
+
+            if(errno != 0 || *endptr != '\0' || val < 1 || val > MAX_TIMEOUT_S)
+            {
+                printf("-%c must be an integer between 1 and %d.\n", option, MAX_TIMEOUT_S);
+                exit(EXIT_FAILURE);
+            }
+
+            if(option == 'i')
+            {
+                options->deadlines.idle_ms = (int)val * MS_PER_SEC;
+            }
+            else if(option == 'r')
+            {
+                options->deadlines.header_ms = (int)val * MS_PER_SEC;
+            }
+            else
+            {
+                options->deadlines.write_ms = (int)val * MS_PER_SEC;
+            }
+        }
+        else if(option == 'k')
+        {
+            long  val;
+            char *endptr;
+            errno = 0;
+            val   = strtol(optarg, &endptr, BASE);
+
+            if(errno != 0 || *endptr != '\0' || val < MIN_CANARY_PERCENT || val > MAX_CANARY_PERCENT)
+            {
+                printf("-k must be an integer between %d and %d.\n", MIN_CANARY_PERCENT, MAX_CANARY_PERCENT);
+                exit(EXIT_FAILURE);
+            }
+
+            options->canary_percent = (int)val;
+        }
+        else if(option == 'l')
+        {
+            if(options->listener_count == MAX_LISTENERS)
+            {
+                printf("-l can be given at most %d times.\n", MAX_LISTENERS);
+                exit(EXIT_FAILURE);
+            }
+
+            options->listen_addresses[options->listener_count++] = optarg;
+        }
+        else if(option == 'K')
+        {
+            options->tls_key = optarg;
+        }
+        else if(option == 'T')
+        {
+            options->tls_cert = optarg;
+        }
+        else if(option == 't')
+        {
+            long  val;
+            char *endptr;
+            errno = 0;
+            val   = strtol(optarg, &endptr, BASE);
+
+            if(errno != 0 || *endptr != '\0' || val < 1 || val > MAX_THREADS)
+            {
+                printf("-t must be an integer between 1 and %d.\n", MAX_THREADS);
+                exit(EXIT_FAILURE);
+            }
+
+            options->threads = (int)val;
+        }
+        else if(option == 'w' || option == 'x')
         {
             long  val;
             char *endptr;
@@ -380,7 +1874,14 @@ void handle_arguments(int argc, char *argv[], int *workers_num)
                 exit(EXIT_FAILURE);
             }
 
-            *workers_num = (int)val;
+            if(option == 'w')
+            {
+                options->workers_num = (int)val;
+            }
+            else
+            {
+                options->max_workers = (int)val;
+            }
         }
         else
         {
@@ -390,6 +1891,24 @@ void handle_arguments(int argc, char *argv[], int *workers_num)
     }
 }
 
+// stay clear of EMFILE, the dispatcher needs a few descriptors besides the clients
+static nfds_t default_max_connections(void)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_CONNECTIONS + FD_HEADROOM)
+    {
+        return MAX_CONNECTIONS;
+    }
+
+    if(limit.rlim_cur <= FD_HEADROOM + MIN_CONNECTIONS)
+    {
+        return MIN_CONNECTIONS;
+    }
+
+    return (nfds_t)(limit.rlim_cur - FD_HEADROOM);
+}
+
 static void setup_signal_handler(void)
 {
     struct sigaction sa;
@@ -403,6 +1922,19 @@ static void setup_signal_handler(void)
     #pragma clang diagnostic pop
 #endif
     sigaction(SIGINT, &sa, NULL);
+
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = restart_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigaction(SIGUSR2, &sa, NULL);
+
+    // a client that hangs up mid response must not take its worker down with it
+    signal(SIGPIPE, SIG_IGN);
 }
 
 #pragma GCC diagnostic push
@@ -412,3 +1944,49 @@ static void sigint_handler(int signum)
 {
     exit_flag = 1;
 }
+
+static void restart_handler(int signum)
+{
+    restart_flag = 1;
+}
+
+// does nothing, it only has to interrupt pselect in an idle worker
+static void retire_handler(int signum)
+{
+}
+
+#if !defined(__linux__)
+static void sigchld_handler(int signum)
+{
+    int  saved_errno = errno;
+    char byte        = 0;
+
+    write(child_pipe[1], &byte, 1);
+    errno = saved_errno;
+}
+#endif
+
+#pragma GCC diagnostic pop
+
+// keep SIGUSR1 blocked while a connection is handled. wait_mask is the mask to wait with
+static void setup_retire_signal(sigset_t *wait_mask)
+{
+    struct sigaction sa;
+    sigset_t         block_mask;
+
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = retire_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigaction(SIGUSR1, &sa, NULL);
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &block_mask, wait_mask);
+    sigdelset(wait_mask, SIGUSR1);
+}
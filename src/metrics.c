@@ -0,0 +1,277 @@
+#include "../include/metrics.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define METRICS_BOUNDS 19
+
+// a prometheus bucket, inclusive upper bound and how it is written in the le label
+struct metrics_bound
+{
+    uint64_t    ns;
+    const char *label;
+};
+
+static const struct metrics_bound bounds[METRICS_BOUNDS] = {
+    {10000,          "0.00001"},
+    {25000,          "0.000025"},
+    {50000,          "0.00005"},
+    {100000,         "0.0001"},
+    {250000,         "0.00025"},
+    {500000,         "0.0005"},
+    {1000000,        "0.001"},
+    {2500000,        "0.0025"},
+    {5000000,        "0.005"},
+    {10000000,       "0.01"},
+    {25000000,       "0.025"},
+    {50000000,       "0.05"},
+    {100000000,      "0.1"},
+    {250000000,      "0.25"},
+    {500000000,      "0.5"},
+    {1000000000,     "1"},
+    {2500000000ULL,  "2.5"},
+    {5000000000ULL,  "5"},
+    {10000000000ULL, "10"},
+};
+
+static const char *const stage_names[STAGE_COUNT]     = {"queue", "handoff", "parse", "lock_wait", "database", "write", "total"};
+static const char *const timeout_names[TIMEOUT_KINDS] = {"idle", "header", "write"};
+
+static size_t advance(size_t len, int written, size_t max_len);
+static size_t render_stage(const struct pool_shared *pool, int stage, char *out, size_t max_len);
+static size_t render_counter(char *out, size_t max_len, const char *name, const char *help, uint64_t value);
+
+// anonymous memory is zero filled, so nothing is written here and the pages stay untouched until used
+struct metrics_shared *metrics_create(void)
+{
+    struct metrics_shared *metrics;
+
+    metrics = (struct metrics_shared *)mmap(NULL, sizeof(struct metrics_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(metrics == MAP_FAILED)
+    {
+        perror("mmap metrics");
+        return NULL;
+    }
+
+    return metrics;
+}
+
+void metrics_destroy(struct metrics_shared *metrics)
+{
+    if(metrics)
+    {
+        munmap(metrics, sizeof(struct metrics_shared));
+    }
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// metrics may be NULL, for a handler running outside a worker
+void metrics_record(struct worker_metrics *metrics, int stage, uint64_t elapsed_ns)
+{
+    struct stage_histogram *histogram;
+
+    if(metrics == NULL)
+    {
+        return;
+    }
+
+    histogram = &metrics->stages[stage];
+    atomic_fetch_add_explicit(&histogram->counts[histogram_bucket(elapsed_ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, elapsed_ns, memory_order_relaxed);
+}
+
+// records the time since the given timestamp and returns the current one, for timing stages back to back
+uint64_t metrics_lap(struct worker_metrics *metrics, int stage, uint64_t since)
+{
+    uint64_t now = metrics_now();
+
+    metrics_record(metrics, stage, now - since);
+
+    return now;
+}
+
+// files the handler call under the side of the canary the worker is on. costs one relaxed load while no canary runs
+void metrics_record_version(struct pool_shared *pool, const struct worker_slot *slot, uint64_t elapsed_ns, int failed)
+{
+    unsigned int          canary = atomic_load_explicit(&pool->canary_generation, memory_order_relaxed);
+    struct version_stats *stats;
+
+    if(canary == 0)
+    {
+        return;
+    }
+
+    stats = &pool->metrics->versions[atomic_load_explicit(&slot->loaded_generation, memory_order_relaxed) == canary ? VERSION_CANARY : VERSION_BASELINE];
+    atomic_fetch_add_explicit(&stats->counts[histogram_bucket(elapsed_ns)], 1, memory_order_relaxed);
+    if(failed)
+    {
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+    }
+}
+
+// called by the monitor once every canary worker runs the new library, so both sides start from the same moment
+void metrics_reset_versions(struct metrics_shared *metrics)
+{
+    for(int version = 0; version < VERSION_COUNT; version++)
+    {
+        struct version_stats *stats = &metrics->versions[version];
+
+        atomic_store_explicit(&stats->errors, 0, memory_order_relaxed);
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            atomic_store_explicit(&stats->counts[i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+// copies one side into a plain histogram so the percentiles come from histogram.c. returns its error count
+uint64_t metrics_read_version(const struct metrics_shared *metrics, int version, struct histogram *histogram)
+{
+    const struct version_stats *stats = &metrics->versions[version];
+
+    histogram_init(histogram);
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t count = atomic_load_explicit(&stats->counts[i], memory_order_relaxed);
+
+        if(count != 0)
+        {
+            histogram->counts[i] = count;
+            histogram->count += count;
+            histogram->max = histogram_bucket_highest(i);
+        }
+    }
+
+    return atomic_load_explicit(&stats->errors, memory_order_relaxed);
+}
+
+// prometheus text format. the stage histograms of every worker are summed, the pool counters follow.
+// returns the length written, cut short if out is too small
+size_t metrics_render(const struct pool_shared *pool, char *out, size_t max_len)
+{
+    size_t len = 0;
+    int    workers;
+
+    len = advance(len, snprintf(out, max_len, "# HELP http_stage_duration_seconds Time requests spent in each stage, over all workers.\n# TYPE http_stage_duration_seconds histogram\n"), max_len);
+    for(int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        len += render_stage(pool, stage, out + len, max_len - len);
+    }
+
+    len += render_counter(out + len, max_len - len, "http_connections_dispatched_total", "Connections handed to the workers.", atomic_load(&pool->dispatched));
+    len += render_counter(out + len, max_len - len, "http_connections_picked_up_total", "Connections received by a worker.", atomic_load(&pool->picked_up));
+    len += render_counter(out + len, max_len - len, "http_connections_shed_total", "Connections answered with 503 at the connection cap.", atomic_load(&pool->shed));
+
+    len = advance(len, snprintf(out + len, max_len - len, "# HELP http_connections_timed_out_total Connections closed for missing a deadline.\n# TYPE http_connections_timed_out_total counter\n"), max_len);
+    for(int kind = 0; kind < TIMEOUT_KINDS; kind++)
+    {
+        len = advance(len, snprintf(out + len, max_len - len, "http_connections_timed_out_total{deadline=\"%s\"} %llu\n", timeout_names[kind], (unsigned long long)atomic_load(&pool->timeouts[kind])), max_len);
+    }
+
+    len = advance(len, snprintf(out + len, max_len - len, "# HELP http_worker_connections_served_total Connections handled, by worker slot.\n# TYPE http_worker_connections_served_total counter\n"), max_len);
+    workers = 0;
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        if(pool->slots[i].pid != 0)
+        {
+            len = advance(len, snprintf(out + len, max_len - len, "http_worker_connections_served_total{slot=\"%d\"} %llu\n", i, (unsigned long long)atomic_load(&pool->slots[i].served)), max_len);
+            workers++;
+        }
+    }
+
+    len = advance(len, snprintf(out + len, max_len - len, "# HELP http_worker_busy_seconds_total Time spent handling connections, by worker slot.\n# TYPE http_worker_busy_seconds_total counter\n"), max_len);
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        if(pool->slots[i].pid != 0)
+        {
+            len = advance(len, snprintf(out + len, max_len - len, "http_worker_busy_seconds_total{slot=\"%d\"} %.9f\n", i, (double)atomic_load(&pool->slots[i].busy_ns) / (double)NS_PER_SEC), max_len);
+        }
+    }
+
+    len = advance(len, snprintf(out + len, max_len - len, "# HELP http_workers Worker processes running.\n# TYPE http_workers gauge\nhttp_workers %d\n", workers), max_len);
+    len = advance(len,
+                  snprintf(out + len, max_len - len, "# HELP http_handler_generation Handler library generation.\n# TYPE http_handler_generation gauge\nhttp_handler_generation %u\n", atomic_load(&pool->generation)),
+                  max_len);
+
+    return len;
+}
+
+// one stage summed over every worker. a fine bucket is counted under the first bound its highest value
+// fits, so a value may show up one prometheus bucket late by less than the 1% bucket width
+static size_t render_stage(const struct pool_shared *pool, int stage, char *out, size_t max_len)
+{
+    uint64_t counts[METRICS_BOUNDS + 1] = {0};
+    uint64_t sum                        = 0;
+    uint64_t running                    = 0;
+    size_t   len                        = 0;
+
+    for(int worker = 0; worker < POOL_MAX_WORKERS; worker++)
+    {
+        const struct stage_histogram *histogram = &pool->metrics->workers[worker].stages[stage];
+        uint64_t                      worker_sum;
+        int                           bound = 0;
+
+        // a slot that never recorded anything is skipped without reading its buckets
+        worker_sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        if(worker_sum == 0)
+        {
+            continue;
+        }
+        sum += worker_sum;
+
+        for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            uint64_t count = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+
+            if(count == 0)
+            {
+                continue;
+            }
+
+            while(bound < METRICS_BOUNDS && histogram_bucket_highest(i) > bounds[bound].ns)
+            {
+                bound++;
+            }
+            counts[bound] += count;
+        }
+    }
+
+    for(int bound = 0; bound < METRICS_BOUNDS; bound++)
+    {
+        running += counts[bound];
+        len = advance(len, snprintf(out + len, max_len - len, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"%s\"} %llu\n", stage_names[stage], bounds[bound].label, (unsigned long long)running), max_len);
+    }
+    running += counts[METRICS_BOUNDS];
+
+    len = advance(len, snprintf(out + len, max_len - len, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage], (unsigned long long)running), max_len);
+    len = advance(len, snprintf(out + len, max_len - len, "http_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[stage], (double)sum / (double)NS_PER_SEC), max_len);
+    len = advance(len, snprintf(out + len, max_len - len, "http_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage_names[stage], (unsigned long long)running), max_len);
+
+    return len;
+}
+
+static size_t render_counter(char *out, size_t max_len, const char *name, const char *help, uint64_t value)
+{
+    return advance(0, snprintf(out, max_len, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value), max_len);
+}
+
+// snprintf reports what it would have written, the length never runs past the end of the buffer
+static size_t advance(size_t len, int written, size_t max_len)
+{
+    if(written < 0)
+    {
+        return len;
+    }
+
+    len += (size_t)written;
+
+    return len < max_len ? len : max_len - 1;
+}
@@ -1,10 +1,13 @@
 #include "../include/network.h"
+#include "../include/pool.h"
+#include "../include/trace.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <semaphore.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,14 +18,49 @@
 #include <unistd.h>
 
 #define PORT 8000
-
-int initialize_socket(void)
+#define MAX_PORT 65535
+#define PORT_BASE 10
+#define UNIX_PREFIX "unix:"
+#define UNIX_PREFIX_LEN 5
+
+#if defined(__linux__)
+    #define ABSTRACT_MARK '@'
+#endif
+#define RESERVE_FD_PATH "/dev/null"
+#define DISCARD_SIZE 1024
+
+// sent as is when the dispatcher is at its connection cap, no date so it never has to be rendered
+static const char overload_response[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                        "Server: HTTPServer/1.0\r\n"
+                                        "Retry-After: 1\r\n"
+                                        "Connection: close\r\n"
+                                        "Content-Length: 0\r\n\r\n";
+
+// spare descriptor given up on EMFILE so the pending connection can still be accepted and answered
+static int reserve_fd = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static void reject_connection(int client);
+static int  shed_with_reserve(int sockfd);
+static int  parse_address(const char *address, struct sockaddr_storage *host_addr, socklen_t *host_addrlen);
+static int  parse_tcp_address(const char *address, struct sockaddr_in *host_addr);
+static void remove_stale_socket(const struct sockaddr_storage *host_addr, socklen_t host_addrlen);
+
+// address is [host:]port for tcp, unix:/path for a unix socket and unix:@name for one in the linux
+// abstract namespace. NULL listens on PORT on every interface
+int initialize_socket(const char *address)
 {
-    struct sockaddr_in host_addr;
-    socklen_t          host_addrlen;
+    struct sockaddr_storage host_addr;
+    socklen_t               host_addrlen;
+    int                     sockfd;
+
+    if(parse_address(address, &host_addr, &host_addrlen) == -1)
+    {
+        fprintf(stderr, "invalid listen address %s\n", address);
+        errno = EINVAL;
+        return -1;
+    }
 
-    // create ipv4 socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);    // NOLINT
+    sockfd = socket(host_addr.ss_family, SOCK_STREAM, 0);    // NOLINT
     if(sockfd == -1)
     {
         perror("socket");
@@ -31,11 +69,10 @@ int initialize_socket(void)
 
     printf("Socket created successfully.\n");
 
-    host_addrlen = sizeof(host_addr);
-
-    host_addr.sin_family      = AF_INET;
-    host_addr.sin_port        = htons(PORT);
-    host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(host_addr.ss_family == AF_UNIX)
+    {
+        remove_stale_socket(&host_addr, host_addrlen);
+    }
 
     if(bind(sockfd, (struct sockaddr *)&host_addr, host_addrlen) != 0)
     {
@@ -44,7 +81,7 @@ int initialize_socket(void)
         return -1;
     }
 
-    printf("socket was bound successfully\n");
+    printf("socket was bound successfully to %s\n", address ? address : "the default port");
 
     if(listen(sockfd, SOMAXCONN) != 0)
     {
@@ -58,6 +95,130 @@ int initialize_socket(void)
     return sockfd;
 }
 
+// AF_INET or AF_UNIX, -1 if it cannot be told
+int socket_family(int sockfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addrlen = sizeof(addr);
+
+    if(getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) == -1)
+    {
+        return -1;
+    }
+
+    return addr.ss_family;
+}
+
+static int parse_address(const char *address, struct sockaddr_storage *host_addr, socklen_t *host_addrlen)
+{
+    memset(host_addr, 0, sizeof(*host_addr));
+
+    if(address != NULL && strncmp(address, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0)
+    {
+        struct sockaddr_un *host_un  = (struct sockaddr_un *)host_addr;
+        const char         *path     = address + UNIX_PREFIX_LEN;
+        size_t              path_len = strlen(path);
+
+        if(path_len == 0 || path_len >= sizeof(host_un->sun_path))
+        {
+            return -1;
+        }
+
+        host_un->sun_family = AF_UNIX;
+        memcpy(host_un->sun_path, path, path_len);
+        *host_addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+
+#if defined(__linux__)
+        // the name starts with a zero byte and has no file, it goes away with the last descriptor.
+        // the length says where it ends, there is no terminator
+        if(path[0] == ABSTRACT_MARK)
+        {
+            host_un->sun_path[0] = '\0';
+            *host_addrlen        = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+        }
+#endif
+
+        return 0;
+    }
+
+    *host_addrlen = sizeof(struct sockaddr_in);
+
+    return parse_tcp_address(address, (struct sockaddr_in *)host_addr);
+}
+
+static int parse_tcp_address(const char *address, struct sockaddr_in *host_addr)
+{
+    const char *port  = address;
+    long        value = PORT;
+
+    host_addr->sin_family      = AF_INET;
+    host_addr->sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if(address != NULL)
+    {
+        const char *colon = strrchr(address, ':');
+        char       *endptr;
+
+        if(colon != NULL && colon != address)
+        {
+            char   host[INET_ADDRSTRLEN];
+            size_t host_len = (size_t)(colon - address);
+
+            if(host_len >= sizeof(host))
+            {
+                return -1;
+            }
+
+            memcpy(host, address, host_len);
+            host[host_len] = '\0';
+            if(inet_pton(AF_INET, host, &host_addr->sin_addr) != 1)
+            {
+                return -1;
+            }
+        }
+        if(colon != NULL)
+        {
+            port = colon + 1;
+        }
+
+        errno = 0;
+        value = strtol(port, &endptr, PORT_BASE);
+        if(errno != 0 || *endptr != '\0' || endptr == port || value < 1 || value > MAX_PORT)
+        {
+            return -1;
+        }
+    }
+
+    host_addr->sin_port = htons((uint16_t)value);
+
+    return 0;
+}
+
+// a socket file left behind by a server that is gone. one somebody still accepts on is left alone and
+// bind fails, and so is anything that is not a socket
+static void remove_stale_socket(const struct sockaddr_storage *host_addr, socklen_t host_addrlen)
+{
+    const struct sockaddr_un *host_un = (const struct sockaddr_un *)host_addr;
+    int                       probe;
+
+    if(host_un->sun_path[0] == '\0')
+    {
+        return;
+    }
+
+    probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(probe == -1)
+    {
+        return;
+    }
+
+    if(connect(probe, (const struct sockaddr *)host_addr, host_addrlen) == -1 && errno == ECONNREFUSED)
+    {
+        unlink(host_un->sun_path);
+    }
+    close(probe);
+}
+
 void set_socket_nonblock(int sockfd)
 {
     int flags;
@@ -83,24 +244,51 @@ void set_fd_blocking(int fd)
     }
 }
 
-void handle_new_connection(int sockfd, int **client_sockets, nfds_t *max_clients, struct pollfd **fds)
+// listener is the index of the listening socket in fds. returns 1 when a client was added, -1 when one
+// was turned away with a 503 and 0 otherwise
+int handle_new_connection(nfds_t listener, int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t max_connections)
 {
-    if((*fds)[0].revents & POLLIN)
+    if((*fds)[listener].revents & POLLIN)
     {
-        socklen_t          addrlen;
-        int                new_socket;
-        int               *temp;
-        struct sockaddr_in addr;
+        socklen_t               addrlen;
+        int                     sockfd = (*fds)[listener].fd;
+        int                     new_socket;
+        int                    *temp;
+        struct sockaddr_storage addr;
+
+        if(reserve_fd == -1)
+        {
+            reserve_fd = open(RESERVE_FD_PATH, O_RDONLY | O_CLOEXEC);
+        }
 
         addrlen    = sizeof(addr);
         new_socket = accept(sockfd, (struct sockaddr *)&addr, &addrlen);
 
         if(new_socket == -1)
         {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                return shed_with_reserve(sockfd);
+            }
+
+            // the client gave up before it was accepted, or the kernel is short on memory for a moment.
+            // none of it concerns the other clients
+            if(errno == EAGAIN || errno == EINTR || errno == ECONNABORTED || errno == EPROTO || errno == ENOBUFS || errno == ENOMEM || errno == EPERM)
+            {
+                return 0;
+            }
+
             perror("Accept error");
             exit(EXIT_FAILURE);
         }
 
+        // at the cap, answer right away instead of queueing behind the busy workers
+        if(*max_clients >= max_connections)
+        {
+            reject_connection(new_socket);
+            return -1;
+        }
+
         (*max_clients)++;
         temp = (int *)realloc(*client_sockets, sizeof(int) * (*max_clients));
 
@@ -116,7 +304,7 @@ void handle_new_connection(int sockfd, int **client_sockets, nfds_t *max_clients
             *client_sockets                       = temp;
             (*client_sockets)[(*max_clients) - 1] = new_socket;
 
-            new_fds = (struct pollfd *)realloc(*fds, (*max_clients + 1) * sizeof(struct pollfd));
+            new_fds = (struct pollfd *)realloc(*fds, (*max_clients + POLL_CLIENT_BASE) * sizeof(struct pollfd));
             if(new_fds == NULL)
             {
                 perror("realloc");
@@ -125,76 +313,141 @@ void handle_new_connection(int sockfd, int **client_sockets, nfds_t *max_clients
             }
             else
             {
-                *fds                        = new_fds;
-                (*fds)[*max_clients].fd     = new_socket;
-                (*fds)[*max_clients].events = POLLIN;
+                // a client removed from this entry may have left its poll result behind, which would
+                // dispatch the new one before it sent anything and take it off its idle deadline
+                *fds                                                = new_fds;
+                (*fds)[*max_clients + POLL_CLIENT_BASE - 1].fd      = new_socket;
+                (*fds)[*max_clients + POLL_CLIENT_BASE - 1].events  = POLLIN;
+                (*fds)[*max_clients + POLL_CLIENT_BASE - 1].revents = 0;
             }
         }
+
+        return 1;
     }
+
+    return 0;
 }
 
-void handle_client_disconnection(int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index)
+// the request is read and thrown away first, closing with unread data would reset the connection
+// and the client could lose the 503 with it
+static void reject_connection(int client)
 {
-    int disconnected_socket = (*client_sockets)[client_index];
-    close(disconnected_socket);
+    char discard[DISCARD_SIZE];
+
+    recv(client, discard, sizeof(discard), MSG_DONTWAIT);
+    send(client, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT);
+    close(client);
+}
+
+// out of descriptors. give up the reserve for a moment so the connection at the head of the backlog can be
+// answered, otherwise it stays there and poll keeps reporting the listening socket as readable
+static int shed_with_reserve(int sockfd)
+{
+    int client;
 
-    for(nfds_t i = client_index; i < *max_clients - 1; i++)
+    if(reserve_fd == -1)
     {
-        (*client_sockets)[i] = (*client_sockets)[i + 1];
+        return 0;
     }
 
-    (*max_clients)--;
+    close(reserve_fd);
+    reserve_fd = -1;
 
-    for(nfds_t i = client_index + 1; i <= *max_clients; i++)
+    client = accept(sockfd, NULL, NULL);
+    if(client != -1)
     {
-        (*fds)[i] = (*fds)[i + 1];
+        reject_connection(client);
     }
+    reserve_fd = open(RESERVE_FD_PATH, O_RDONLY | O_CLOEXEC);
+
+    return client != -1 ? -1 : 0;
 }
 
-void read_original_fd(int domain_socket, int **client_sockets, struct pollfd **fds, nfds_t *max_clients)
+// the last client takes the freed place, so nothing is shifted. slot is the fd to position index,
+// updated for the client that moved
+void handle_client_disconnection(int **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index, nfds_t *slot)
 {
-    int     fd_to_close;
-    ssize_t bytes_read;
+    int    disconnected_socket = (*client_sockets)[client_index];
+    nfds_t last                = *max_clients - 1;
+
+    close(disconnected_socket);
 
-    set_socket_nonblock(domain_socket);
+    if(client_index != last)
+    {
+        (*client_sockets)[client_index]         = (*client_sockets)[last];
+        (*fds)[client_index + POLL_CLIENT_BASE] = (*fds)[last + POLL_CLIENT_BASE];
+        slot[(*client_sockets)[client_index]]   = client_index;
+    }
 
-    bytes_read = read(domain_socket, &fd_to_close, sizeof(fd_to_close));
+    (*max_clients)--;
+}
 
-    if(bytes_read > 0)
+// closes every connection the workers are done with, returns how many there were
+int collect_completions(struct msg_ring *rings, int ring_count, int **client_sockets, struct pollfd **fds, nfds_t *max_clients, nfds_t *slot)
+{
+    int collected = 0;
+
+    for(int r = 0; r < ring_count; r++)
     {
-        for(nfds_t i = 0; i < *max_clients; i++)    // NOLINT
+        int fd_to_close;
+
+        while(ring_pop(&rings[r], &fd_to_close))
         {
-            if((*fds)[i + 1].fd == fd_to_close)
+            nfds_t i = slot[fd_to_close];
+
+            if(i < *max_clients && (*client_sockets)[i] == fd_to_close)
             {
-                handle_client_disconnection(client_sockets, max_clients, fds, i);
+                handle_client_disconnection(client_sockets, max_clients, fds, i, slot);
             }
+            collected++;
         }
-        return;
     }
+
+    return collected;
 }
 
-void handle_client_data(struct pollfd *fds, const int *client_sockets, const nfds_t *max_clients, int domain_sock)
+// returns the number of fds handed to the workers. from here on the worker owns the connection's deadlines
+int handle_client_data(struct pollfd *fds, const int *client_sockets, const nfds_t *max_clients, int domain_sock, struct timer_wheel *timers, const uint64_t *accepted_at, struct trace_shared *trace)
 {
+    int dispatched = 0;
+
     for(nfds_t i = 0; i < *max_clients; i++)
     {
-        if(*max_clients > 0 && client_sockets[i] != -1 && (fds[i + 1].revents & POLLIN))
+        if(*max_clients > 0 && client_sockets[i] != -1 && (fds[i + POLL_CLIENT_BASE].revents & POLLIN))
         {
-            send_fd(domain_sock, client_sockets[i]);
-            fds[i + 1].events = 0;
+            struct handoff handoff;
+
+            memset(&handoff, 0, sizeof(handoff));
+            handoff.accepted_ns = accepted_at[client_sockets[i]];
+            handoff.request_id  = trace_begin(trace, &handoff.traced);
+            send_fd(domain_sock, client_sockets[i], &handoff);
+            if(handoff.traced)
+            {
+                trace_record(trace, handoff.request_id, TRACE_DISPATCH, 0, handoff.accepted_ns, handoff.sent_ns);
+            }
+
+            timer_wheel_cancel(timers, client_sockets[i]);
+            fds[i + POLL_CLIENT_BASE].events = 0;
+            dispatched++;
         }
     }
+
+    return dispatched;
 }
 
-void send_fd(int domain_socket, int fd)
+// the caller fills in the accept time and the request id, the send time and the fd number are set here
+void send_fd(int domain_socket, int fd, struct handoff *handoff)
 {
     struct msghdr   msg = {0};
     struct iovec    io;
-    int             data = fd;
     struct cmsghdr *cmsg;
     char            control[CMSG_SPACE(sizeof(int))];
 
-    io.iov_base        = &data;
-    io.iov_len         = sizeof(data);
+    handoff->sent_ns     = monotonic_ns();
+    handoff->original_fd = fd;
+
+    io.iov_base        = handoff;
+    io.iov_len         = sizeof(*handoff);
     msg.msg_iov        = &io;
     msg.msg_iovlen     = 1;
     msg.msg_control    = control;
@@ -214,26 +467,29 @@ void send_fd(int domain_socket, int fd)
     }
 }
 
-int recv_fd(int socket, int *og_fd)
+int recv_fd(int socket, struct handoff *handoff)
 {
     struct msghdr   msg = {0};
     struct iovec    io;
-    int             data = 0;
+    struct handoff  data;
     struct cmsghdr *cmsg;
     char            control[CMSG_SPACE(sizeof(int))];
     int             fd;
+    memset(&data, 0, sizeof(data));
     io.iov_base        = &data;
     io.iov_len         = sizeof(data);
     msg.msg_iov        = &io;
     msg.msg_iovlen     = 1;
     msg.msg_control    = control;
     msg.msg_controllen = sizeof(control);
-    if(recvmsg(socket, &msg, 0) < 0)
+    // several workers wait on the same socket, so the one that lost the race must not block here
+    if(recvmsg(socket, &msg, MSG_DONTWAIT) < 0)
     {
-        if(errno != EINTR)
+        if(errno == EAGAIN || errno == EINTR)
         {
-            perror("recv");
+            return -1;
         }
+        perror("recv");
         exit(EXIT_FAILURE);
     }
     cmsg = CMSG_FIRSTHDR(&msg);
@@ -241,23 +497,24 @@ int recv_fd(int socket, int *og_fd)
     {
         memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
 
-        if(og_fd)
+        if(handoff)
         {
-            *og_fd = data;
+            *handoff = data;
         }
 
         return fd;
     }
+    errno = EBADMSG;
     return -1;
 }
 
-struct pollfd *initialize_pollfds(int sockfd, int **client_sockets)
+struct pollfd *initialize_pollfds(const int *listeners, int listener_count, int wake_fd, int **client_sockets)
 {
     struct pollfd *fds;
 
     *client_sockets = NULL;
 
-    fds = (struct pollfd *)malloc((1) * sizeof(struct pollfd));
+    fds = (struct pollfd *)malloc(POLL_CLIENT_BASE * sizeof(struct pollfd));
 
     if(fds == NULL)
     {
@@ -265,8 +522,14 @@ struct pollfd *initialize_pollfds(int sockfd, int **client_sockets)
         exit(EXIT_FAILURE);
     }
 
-    fds[0].fd     = sockfd;
-    fds[0].events = POLLIN;
+    // poll skips the negative fds of the unused listener slots
+    for(int i = 0; i < MAX_LISTENERS; i++)
+    {
+        fds[i].fd     = i < listener_count ? listeners[i] : -1;
+        fds[i].events = POLLIN;
+    }
+    fds[POLL_WAKE].fd     = wake_fd;
+    fds[POLL_WAKE].events = POLLIN;
 
     return fds;
 }
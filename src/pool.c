@@ -0,0 +1,184 @@
+#include "../include/pool.h"
+#include "../include/metrics.h"
+#include "../include/scoreboard.h"
+#include "../include/trace.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <sys/eventfd.h>
+#endif
+
+#if !defined(__linux__)
+    #define WAKE_DRAIN_SIZE 64
+#endif
+
+static int  open_wakeup(int wake_fd[2]);
+static void wake_dispatcher(const struct pool_shared *pool);
+
+// shared mapping inherited by every process forked afterwards
+struct pool_shared *pool_create(void)
+{
+    struct pool_shared *pool;
+
+    pool = (struct pool_shared *)mmap(NULL, sizeof(struct pool_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(pool == MAP_FAILED)
+    {
+        perror("mmap pool");
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(struct pool_shared));
+
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        ring_init(&pool->completions[i]);
+    }
+
+    pool->metrics = metrics_create();
+    if(pool->metrics == NULL)
+    {
+        munmap(pool, sizeof(struct pool_shared));
+        return NULL;
+    }
+
+    pool->trace = trace_create();
+    if(pool->trace == NULL)
+    {
+        metrics_destroy(pool->metrics);
+        munmap(pool, sizeof(struct pool_shared));
+        return NULL;
+    }
+
+    pool->scoreboard = scoreboard_create();
+    if(pool->scoreboard == NULL)
+    {
+        trace_destroy(pool->trace);
+        metrics_destroy(pool->metrics);
+        munmap(pool, sizeof(struct pool_shared));
+        return NULL;
+    }
+
+    if(open_wakeup(pool->wake_fd) == -1)
+    {
+        scoreboard_destroy(pool->scoreboard);
+        trace_destroy(pool->trace);
+        metrics_destroy(pool->metrics);
+        munmap(pool, sizeof(struct pool_shared));
+        return NULL;
+    }
+
+    return pool;
+}
+
+void pool_destroy(struct pool_shared *pool)
+{
+    if(pool)
+    {
+        close(pool->wake_fd[0]);
+        if(pool->wake_fd[1] != pool->wake_fd[0])
+        {
+            close(pool->wake_fd[1]);
+        }
+        scoreboard_destroy(pool->scoreboard);
+        trace_destroy(pool->trace);
+        metrics_destroy(pool->metrics);
+        munmap(pool, sizeof(struct pool_shared));
+    }
+}
+
+// hands a finished connection back to the dispatcher. only the first completion after the dispatcher
+// went to sleep pays for a wakeup, the rest are picked up in the same pass. a full ring means the
+// dispatcher is far behind, so this waits for it rather than lose the fd
+void pool_complete(struct pool_shared *pool, int slot_index, int original_fd)
+{
+    while(ring_push(&pool->completions[slot_index], original_fd) == -1)
+    {
+        wake_dispatcher(pool);
+        sched_yield();
+    }
+
+    // the push has to be visible before the flag is read, or the dispatcher could arm, find the ring
+    // empty and sleep while this sees the flag still clear
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&pool->wake_armed, memory_order_relaxed) && atomic_exchange(&pool->wake_armed, 0))
+    {
+        wake_dispatcher(pool);
+    }
+}
+
+// called by the dispatcher before it checks the rings one last time and goes to sleep
+void pool_arm_wakeup(struct pool_shared *pool)
+{
+    atomic_store(&pool->wake_armed, 1);
+}
+
+void pool_clear_wakeup(const struct pool_shared *pool)
+{
+#if defined(__linux__)
+    uint64_t count;
+
+    read(pool->wake_fd[0], &count, sizeof(count));
+#else
+    char buf[WAKE_DRAIN_SIZE];
+
+    while(read(pool->wake_fd[0], buf, sizeof(buf)) > 0)
+    {
+    }
+#endif
+}
+
+// a full pipe or a saturated counter already means a wakeup is pending, so a failed write is fine
+static void wake_dispatcher(const struct pool_shared *pool)
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+#else
+    char one = 0;
+#endif
+
+    write(pool->wake_fd[1], &one, sizeof(one));
+}
+
+// eventfd on linux, elsewhere a pipe. both ends non-blocking and closed on exec, a new generation
+// makes its own
+static int open_wakeup(int wake_fd[2])
+{
+#if defined(__linux__)
+    wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(wake_fd[0] == -1)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    wake_fd[1] = wake_fd[0];
+#else
+    if(pipe(wake_fd) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    for(int i = 0; i < 2; i++)
+    {
+        fcntl(wake_fd[i], F_SETFL, fcntl(wake_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return 0;
+}
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
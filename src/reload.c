@@ -0,0 +1,283 @@
+#include "../include/reload.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <sys/inotify.h>
+    #define WATCH_BUFFER_SIZE 4096
+#endif
+
+#define COPY_BUFFER_SIZE 65536
+
+static int write_all(int fd, const char *data, size_t len);
+
+// watch the directory rather than the file, deploys usually replace the library with a rename
+// returns -1 when inotify is not available, the caller falls back to polling with stat
+int reload_watch_open(const char *lib_path)
+{
+#if defined(__linux__)
+    char        dir[PATH_MAX];
+    const char *slash = strrchr(lib_path, '/');
+    size_t      dir_len;
+    int         fd;
+
+    dir_len = slash ? (size_t)(slash - lib_path) : 0;
+    if(dir_len == 0 || dir_len >= sizeof(dir))
+    {
+        fprintf(stderr, "cannot watch %s\n", lib_path);
+        return -1;
+    }
+
+    memcpy(dir, lib_path, dir_len);
+    dir[dir_len] = '\0';
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    if(inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)
+    {
+        perror("inotify_add_watch");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+#else
+    (void)lib_path;
+    return -1;
+#endif
+}
+
+// consume all pending events, returns 1 if any of them touched the library
+int reload_watch_drain(int watch_fd, const char *lib_path)
+{
+#if defined(__linux__)
+    // inotify_event holds an int, keep the buffer aligned for it
+    _Alignas(struct inotify_event) char buffer[WATCH_BUFFER_SIZE];
+    const char *slash   = strrchr(lib_path, '/');
+    const char *name    = slash ? slash + 1 : lib_path;
+    int         touched = 0;
+    ssize_t     n;
+
+    while((n = read(watch_fd, buffer, sizeof(buffer))) > 0)
+    {
+        size_t offset = 0;
+
+        while(offset + sizeof(struct inotify_event) <= (size_t)n)
+        {
+            struct inotify_event event;
+
+            memcpy(&event, buffer + offset, sizeof(event));
+            if(event.len > 0 && strcmp(buffer + offset + sizeof(event), name) == 0)
+            {
+                touched = 1;
+            }
+            offset += sizeof(event) + event.len;
+        }
+    }
+
+    return touched;
+#else
+    (void)watch_fd;
+    (void)lib_path;
+    return 0;
+#endif
+}
+
+int lib_version_read(const char *lib_path, struct lib_version *version)
+{
+    struct stat lib_stat;
+
+    if(stat(lib_path, &lib_stat) == -1)
+    {
+        return -1;
+    }
+
+    version->dev   = lib_stat.st_dev;
+    version->ino   = lib_stat.st_ino;
+    version->mtime = lib_stat.st_mtime;
+    version->size  = lib_stat.st_size;
+
+    return 0;
+}
+
+int lib_version_equal(const struct lib_version *a, const struct lib_version *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->mtime == b->mtime && a->size == b->size;
+}
+
+// load the new build once in a throwaway child before any worker sees it, so a broken library
+// or a crashing constructor costs the monitor nothing. the entry point has to resolve and
+// handler_self_test, when the library exports one, has to return 0
+int reload_validate(const char *lib_path)
+{
+    pid_t pid;
+    int   status;
+
+    fflush(stdout);
+
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("fork validate");
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        union
+        {
+            void *ptr;
+            int (*func)(void);
+        } cast_helper;
+
+        void *handle = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
+
+        if(handle == NULL)
+        {
+            fprintf(stderr, "dlopen failed: %s\n", dlerror());
+            _exit(EXIT_FAILURE);
+        }
+
+        if(dlsym(handle, "worker_handle_so") == NULL)
+        {
+            fprintf(stderr, "dlsym failed for worker_handle_so: %s\n", dlerror());
+            _exit(EXIT_FAILURE);
+        }
+
+        cast_helper.ptr = dlsym(handle, "handler_self_test");
+        if(cast_helper.ptr != NULL && cast_helper.func() != 0)
+        {
+            fprintf(stderr, "handler_self_test failed\n");
+            _exit(EXIT_FAILURE);
+        }
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    while(waitpid(pid, &status, 0) == -1)
+    {
+        if(errno != EINTR)
+        {
+            perror("waitpid validate");
+            return -1;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ? 0 : -1;
+}
+
+// a private copy of the library for the workers to load, so the build they run stays on disk after
+// a deploy replaces lib_path. written next to the target and renamed over it, with the mode and
+// modification time of the original so /server-status still shows which build it is
+int reload_copy(const char *lib_path, const char *copy_path)
+{
+    char            tmp_path[PATH_MAX];
+    char            buffer[COPY_BUFFER_SIZE];
+    struct stat     lib_stat;
+    struct timespec times[2];
+    ssize_t         n;
+    int             in;
+    int             out;
+
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", copy_path) >= (int)sizeof(tmp_path))
+    {
+        fprintf(stderr, "library path too long: %s\n", copy_path);
+        return -1;
+    }
+
+    in = open(lib_path, O_RDONLY | O_CLOEXEC);
+    if(in == -1)
+    {
+        perror("open library");
+        return -1;
+    }
+
+    if(fstat(in, &lib_stat) == -1)
+    {
+        perror("fstat library");
+        close(in);
+        return -1;
+    }
+
+    out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, lib_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+    if(out == -1)
+    {
+        perror("open library copy");
+        close(in);
+        return -1;
+    }
+
+    while((n = read(in, buffer, sizeof(buffer))) > 0)
+    {
+        if(write_all(out, buffer, (size_t)n) == -1)
+        {
+            n = -1;
+            break;
+        }
+    }
+
+    close(in);
+
+    times[0].tv_sec  = lib_stat.st_atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec  = lib_stat.st_mtime;
+    times[1].tv_nsec = 0;
+    if(n == -1 || futimens(out, times) == -1)
+    {
+        perror("copy library");
+        close(out);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if(close(out) == -1)
+    {
+        perror("close library copy");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if(rename(tmp_path, copy_path) == -1)
+    {
+        perror("rename library copy");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        data += written;
+        len -= (size_t)written;
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include "../include/ring.h"
+
+#define RING_MASK (RING_CAPACITY - 1)
+
+void ring_init(struct msg_ring *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    for(unsigned int i = 0; i < RING_CAPACITY; i++)
+    {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+}
+
+// returns -1 when the ring is full, the consumer is that far behind
+int ring_push(struct msg_ring *ring, int value)
+{
+    unsigned int      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct ring_cell *cell;
+
+    for(;;)
+    {
+        unsigned int sequence;
+        int          diff;
+
+        cell     = &ring->cells[pos & RING_MASK];
+        sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff     = (int)(sequence - pos);
+
+        if(diff == 0)
+        {
+            // claim the cell, another producer may have taken it first
+            if(atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+// returns 1 with the oldest value, 0 when there is nothing to read. only ever called by the one consumer
+int ring_pop(struct msg_ring *ring, int *value)
+{
+    unsigned int      pos  = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct ring_cell *cell = &ring->cells[pos & RING_MASK];
+
+    if(atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1)
+    {
+        return 0;
+    }
+
+    *value = cell->value;
+    atomic_store_explicit(&cell->sequence, pos + RING_CAPACITY, memory_order_release);
+    atomic_store_explicit(&ring->head, pos + 1, memory_order_relaxed);
+
+    return 1;
+}
@@ -0,0 +1,161 @@
+#include "../include/scoreboard.h"
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#if defined(__linux__)
+    // glibc's netinet/tcp.h carries an older struct tcp_info without the byte counters
+    #include <linux/tcp.h>
+#endif
+
+#define READ_ATTEMPTS 3
+
+static const char *const state_names[WORKER_STATES] = {"idle", "reading", "handling", "writing"};
+
+static uint64_t now_ns(void);
+static uint64_t socket_bytes_sent(int client_fd);
+
+// anonymous memory is zero filled, so every thread starts out idle
+struct scoreboard *scoreboard_create(void)
+{
+    struct scoreboard *scoreboard;
+
+    scoreboard = (struct scoreboard *)mmap(NULL, sizeof(struct scoreboard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(scoreboard == MAP_FAILED)
+    {
+        perror("mmap scoreboard");
+        return NULL;
+    }
+
+    return scoreboard;
+}
+
+void scoreboard_destroy(struct scoreboard *scoreboard)
+{
+    if(scoreboard)
+    {
+        munmap(scoreboard, sizeof(struct scoreboard));
+    }
+}
+
+// the file is stat'ed right after dlopen, the version shown is the one the worker actually runs
+void scoreboard_loaded(struct scoreboard_worker *worker, const char *lib_path, int threads)
+{
+    struct stat lib_stat;
+
+    if(stat(lib_path, &lib_stat) == 0)
+    {
+        atomic_store(&worker->library_mtime, (int_least64_t)lib_stat.st_mtime);
+        atomic_store(&worker->library_size, (int_least64_t)lib_stat.st_size);
+    }
+    atomic_store(&worker->loaded_at, (uint_least64_t)time(NULL));
+    atomic_store(&worker->threads, threads);
+}
+
+// a worker that died mid request leaves its rows as they were, the replacement starts from idle
+void scoreboard_reset(struct scoreboard_worker *worker)
+{
+    for(int i = 0; i < SCOREBOARD_THREADS; i++)
+    {
+        scoreboard_set_uri(&worker->thread[i], "");
+        scoreboard_set_state(&worker->thread[i], WORKER_IDLE);
+    }
+}
+
+// thread may be NULL, for a handler running outside a worker
+void scoreboard_set_state(struct scoreboard_thread *thread, int state)
+{
+    if(thread == NULL)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&thread->state, state, memory_order_relaxed);
+    atomic_store_explicit(&thread->since_ns, now_ns(), memory_order_relaxed);
+}
+
+void scoreboard_set_uri(struct scoreboard_thread *thread, const char *uri)
+{
+    unsigned int sequence;
+
+    if(thread == NULL)
+    {
+        return;
+    }
+
+    sequence = atomic_load_explicit(&thread->sequence, memory_order_relaxed);
+    atomic_store_explicit(&thread->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    strncpy(thread->uri, uri, sizeof(thread->uri) - 1);
+    thread->uri[sizeof(thread->uri) - 1] = '\0';
+
+    atomic_store_explicit(&thread->sequence, sequence + 2, memory_order_release);
+}
+
+// called by the worker once the handler returned, while the client socket is still open
+void scoreboard_done(struct scoreboard_thread *thread, int client_fd)
+{
+    atomic_fetch_add_explicit(&thread->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&thread->bytes_sent, socket_bytes_sent(client_fd), memory_order_relaxed);
+    scoreboard_set_state(thread, WORKER_IDLE);
+}
+
+// gives up after a few tries against a busy writer and returns whatever was copied last
+void scoreboard_read_uri(const struct scoreboard_thread *thread, char *uri, size_t max_len)
+{
+    size_t len = max_len < sizeof(thread->uri) ? max_len : sizeof(thread->uri);
+
+    for(int attempt = 0; attempt < READ_ATTEMPTS; attempt++)
+    {
+        unsigned int sequence = atomic_load_explicit(&thread->sequence, memory_order_acquire);
+
+        memcpy(uri, thread->uri, len);
+        atomic_thread_fence(memory_order_acquire);
+        if((sequence & 1) == 0 && atomic_load_explicit(&thread->sequence, memory_order_relaxed) == sequence)
+        {
+            break;
+        }
+    }
+
+    uri[len - 1] = '\0';
+}
+
+const char *scoreboard_state_name(int state)
+{
+    return state >= 0 && state < WORKER_STATES ? state_names[state] : "unknown";
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// what the handler wrote to the socket, counted by the kernel so none of the write paths need to keep
+// track: sent once, plus what is still queued. 0 for anything but tcp, and before linux 4.19
+static uint64_t socket_bytes_sent(int client_fd)
+{
+#if defined(__linux__)
+    struct tcp_info info;
+    socklen_t       info_len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(client_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == -1)
+    {
+        return 0;
+    }
+
+    return info.tcpi_bytes_sent - info.tcpi_bytes_retrans + info.tcpi_notsent_bytes;
+#else
+    (void)client_fd;
+    return 0;
+#endif
+}
@@ -1,6 +1,12 @@
 #include "../include/sharedlib.h"
+#include "../include/arena.h"
+#include "../include/scoreboard.h"
+#include "../include/trace.h"
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <ndbm.h>
 #include <netinet/in.h>
 #include <poll.h>
@@ -8,12 +14,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+#endif
+
+// splice moves the body from the socket to the file through a pipe, without copying it to user space
+#if defined(__linux__)
+    #define UPLOAD_PIPE_SIZE 262144
+#endif
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 #ifdef __APPLE__
 typedef size_t datum_size;
 #else
@@ -28,13 +51,26 @@ typedef struct
 
 #define MAKE_CONST_DATUM(str) ((const_datum){(str), (datum_size)strlen(str) + 1})
 #define TO_SIZE_T(x) ((size_t)(x))
-static char *retrieve_string(DBM *db, const char *key);
-static int   store_string(DBM *db, const char *key, const char *value);
+static char  *retrieve_string(struct arena *arena, DBM *db, const char *key);
+static void   fetch_datum(DBM *db, const char *key, datum *result);
+static int    store_string(DBM *db, const char *key, const char *value);
+static int    has_multiple_ranges(const char *request);
+static size_t datum_string_length(datum d);
+static int    write_iov_all(int fd, struct iovec *iov, int iovcnt);
+static int    handle_request(int client_sock, struct handler_ctx *ctx);
+static int    valid_upload_name(const char *name);
+static void   reject_upload(int client_sock, enum error_response error);
+static int    sync_upload_directory(void);
+static int    receive_body(int client_sock, int filefd, off_t remaining, uint64_t deadline, struct handler_ctx *ctx);
+static int    wait_for_body(int client_sock, uint64_t deadline, struct handler_ctx *ctx);
+static int    peer_is_own_user(int client_sock);
+static int    write_trace_event(struct chunk_writer *writer, const struct trace_span *span, int first);
+static int    write_status_thread(struct chunk_writer *writer, const struct scoreboard_thread *thread, int index, uint64_t now, int first);
+static void   format_timestamp(uint64_t seconds, char *out, size_t max_len);
 
 #define BUFFER_SIZE 4096
 #define TIME_BUFFER 64
 #define MAX_KEY_LEN 1000
-#define MAX_VALUE_LEN 3000
 #define CONTENT_LEN_OFFSET 15
 #define BLANK_LINE_OFFSET 4
 #define BASE 10
@@ -42,32 +78,111 @@ static int   store_string(DBM *db, const char *key, const char *value);
 #define FILE_NOT_FOUND 404
 #define PERMISSION_DENIED 403
 #define KEY_OFFSET 13
+#define QUERY_OFFSET 9
+#define MAX_QUERY_PARAMS 16
 #define PERMISSIONS 0644
+#define MAX_RANGES 16
+#define HEADER_VALUE_LEN 256
+#define EXTRA_HEADERS_LEN 512
+#define RANGE_UNIT_OFFSET 6
+#define BOUNDARY_LEN 40
+#define QVALUE_MAX 1000
+#define QVALUE_DIGITS 3
+#define CHUNK_SIZE_LEN 20
+#define JSON_ESCAPE_LEN 7
+#define CHUNK_IOV_MAX 6
+#define PRERENDERED_SIZE 512
+#define HTTP_DATE_LEN 29
+#define DATE_FIELD_OFFSET 6
+#define SIMD_WIDTH 16
+#define HEX_ALPHA_OFFSET 10
+#define HEX_SHIFT 4
+#define PERCENT_ESCAPE_LEN 3
+#define METRICS_BUFFER_SIZE 65536
+#define TRACE_QUERY_OFFSET 7
+#define TRACE_EVENT_SIZE 512
+#define STATUS_LINE_SIZE 512
+#define TIMESTAMP_LEN 32
+#define DEFAULT_DATABASE_PATH "/Users/developer/rm4/database.db"
+#define PUBLIC_ROOT "/Users/developer/rm4/public"
+#define UPLOAD_PREFIX "/uploads/"
+#define UPLOAD_PREFIX_LEN 9
+#define UPLOAD_DIRECTORY PUBLIC_ROOT "/uploads"
+#define UPLOAD_TEMPLATE UPLOAD_DIRECTORY "/.upload-XXXXXX"
+#define UPLOAD_MAX_SIZE (64LL * 1024 * 1024)    // larger bodies are refused with 413 before any of them is read
+#define UPLOAD_RESPONSE_SIZE 512
+#define UPLOAD_MIN_RATE 65536    // bytes per second a body has to keep up on average, on top of the header timeout
+#define UPLOAD_DRAIN_LIMIT 262144    // body bytes read and dropped after a refusal before the connection is closed anyway
+#define UPLOAD_LINGER_MS 2000
+
+// a complete response whose only varying bytes are the date
+struct prerendered_response
+{
+    size_t date_offset;
+    size_t header_len;
+    size_t total_len;
+    char   data[PRERENDERED_SIZE];
+};
+
+static struct prerendered_response error_responses[ERROR_RESPONSE_COUNT];              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static char                        database_path[PATH_MAX] = DEFAULT_DATABASE_PATH;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 void my_function(void)
 {
     printf("Hello from the shared library!\n");
 }
 
-int worker_handle_so(int client_sock, sem_t *sem)
+// every copy of the library starts on the server's database, the benchmark points its copy at a scratch one
+void database_set_path(const char *path)
 {
-    ssize_t valread;
-    int     retval;
-    char    method[BUFFER_SIZE];
-    char    uri[BUFFER_SIZE];
-    char    version[BUFFER_SIZE];
-    char    buffer[BUFFER_SIZE];
+    strncpy(database_path, path, sizeof(database_path) - 1);
+    database_path[sizeof(database_path) - 1] = '\0';
+}
+
+int worker_handle_so(int client_sock, struct handler_ctx *ctx)
+{
+    int retval;
+
+    ctx->timeout     = TIMEOUT_NONE;
+    ctx->parsed_ns   = 0;
+    ctx->database_ns = 0;
+    scoreboard_set_state(ctx->scoreboard, WORKER_READING);
+
+    retval = handle_request(client_sock, ctx);
+
+    // what came after parsing and was not the database is mostly the response going out
+    if(ctx->parsed_ns != 0)
+    {
+        metrics_record(ctx->metrics, STAGE_WRITE, metrics_now() - ctx->parsed_ns - ctx->database_ns);
+    }
 
-    memset(buffer, 0, BUFFER_SIZE);
+    // nothing allocated for the request outlives it, whichever way it returned
+    arena_reset(ctx->arena);
 
-    valread = read(client_sock, buffer, BUFFER_SIZE);
+    return retval;
+}
 
+static int handle_request(int client_sock, struct handler_ctx *ctx)
+{
+    ssize_t  valread;
+    int      retval;
+    char    *method  = ctx->method;
+    char    *uri     = ctx->uri;
+    char    *version = ctx->version;
+    char    *buffer  = ctx->request;
+    uint64_t start   = metrics_now();
+
+    valread = read_request(client_sock, ctx);
     if(valread <= 0)
     {
         // Connection closed or error
         return -1;
     }
 
+    // the scratch buffers are reused, so a short or malformed request line must not leave old tokens behind
+    method[0]  = '\0';
+    uri[0]     = '\0';
+    version[0] = '\0';
     sscanf(buffer, "%15s %255s %15s", method, uri, version);
     printf("%s %s %s\n", method, uri, version);
 
@@ -87,27 +202,101 @@ int worker_handle_so(int client_sock, sem_t *sem)
         return 0;
     }
 
+    ctx->parsed_ns = metrics_lap(ctx->metrics, STAGE_PARSE, start);
+    scoreboard_set_uri(ctx->scoreboard, uri);
+    scoreboard_set_state(ctx->scoreboard, WORKER_HANDLING);
+
+    // files streamed to public/uploads, either method creates or replaces one
+    if((strcmp(method, "PUT") == 0 || strcmp(method, "POST") == 0) && strncmp(uri, UPLOAD_PREFIX, UPLOAD_PREFIX_LEN) == 0)    // NOLINT
+    {
+        retval = handle_upload(uri, client_sock, (size_t)valread, ctx);
+        return retval;
+    }
+
+    // uploads are the only thing that takes PUT
+    if(strcmp(method, "PUT") == 0)
+    {
+        handle_verify_method_error(client_sock);
+        return 0;
+    }
+
     // handle post request, writing to DB
     if(strcmp(method, "POST") == 0)
     {
-        retval = handle_post_request(uri, client_sock, buffer, sem);
+        retval = handle_post_request(uri, client_sock, buffer, ctx);
+        return retval;
+    }
+
+    // LIST THE DATABASE
+    if(strcmp(uri, "/dataGET") == 0)
+    {
+        retval = list_entries(method, client_sock, ctx);
         return retval;
     }
 
     // GET FROM DATABASE
-    if(strncmp(uri, "/dataGET?key=", KEY_OFFSET) == 0)    // NOLINT
+    if(strncmp(uri, "/dataGET?", QUERY_OFFSET) == 0)    // NOLINT
     {
-        retval = fetch_entry(uri, method, client_sock, sem);
+        retval = fetch_entry(uri, method, client_sock, ctx);
+        return retval;
+    }
+
+    // prometheus scrape, only inside a worker where the shared counters exist and for clients on this machine
+    if(strcmp(uri, "/metrics") == 0 && ctx->pool != NULL)
+    {
+        if(!is_local_client(ctx->peer_sock))
+        {
+            handle_forbidden(method, client_sock);
+            return 0;
+        }
+
+        retval = serve_metrics(method, client_sock, ctx->pool, ctx->arena);
+        return retval;
+    }
+
+    // the trace buffer and its sampling rate, for clients on this machine only
+    if((strcmp(uri, "/trace") == 0 || strncmp(uri, "/trace?", TRACE_QUERY_OFFSET) == 0) && ctx->pool != NULL)    // NOLINT
+    {
+        if(!is_local_client(ctx->peer_sock))
+        {
+            handle_forbidden(method, client_sock);
+            return 0;
+        }
+
+        retval = serve_trace(uri, method, client_sock, ctx->pool->trace);
+        return retval;
+    }
+
+    // what every worker thread is doing right now, same restriction
+    if(strcmp(uri, "/server-status") == 0 && ctx->pool != NULL)
+    {
+        if(!is_local_client(ctx->peer_sock))
+        {
+            handle_forbidden(method, client_sock);
+            return 0;
+        }
+
+        retval = serve_server_status(method, client_sock, ctx->pool);
         return retval;
     }
 
     // GET FROM FILES
     if(strcmp(uri, "/") == 0)
     {
-        snprintf(uri, sizeof(uri), "/index.html");
+        snprintf(uri, sizeof(ctx->uri), "/index.html");
+    }
+
+    // past the stat and open, a static file is all sending
+    scoreboard_set_state(ctx->scoreboard, WORKER_WRITING);
+    retval = serve_file(uri, method, client_sock, buffer, ctx->uring);
+
+    // the write stalled past SO_SNDTIMEO, or the io_uring send timeout fired
+    if(retval == -1 && (errno == EAGAIN || errno == ETIMEDOUT))
+    {
+        ctx->timeout = TIMEOUT_WRITE;
+        return -1;
     }
 
-    retval = serve_file(uri, method, client_sock);
     if(retval != OK_STATUS)
     {
         handle_file_serve_error(method, retval, client_sock);
@@ -117,9 +306,85 @@ int worker_handle_so(int client_sock, sem_t *sem)
     return 0;
 }
 
-int handle_post_request(const char *uri, int client_sock, char *request_body, sem_t *sem)
+// reads until the blank line after the headers, a full buffer or the end of what the client sends.
+// the first read does not wait, the dispatcher only hands over connections with data. whatever is
+// still missing after it has to arrive before the header deadline, so a client trickling in a
+// request cannot hold the worker
+ssize_t read_request(int client_sock, struct handler_ctx *ctx)
+{
+    char           *buffer = ctx->request;
+    size_t          len    = 0;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // leave room for the terminator, headers are searched as a string
+    while(len < sizeof(ctx->request) - 1)
+    {
+        ssize_t valread;
+
+        if(len > 0)
+        {
+            struct pollfd   pfd;
+            struct timespec now;
+            long            remaining_ms;
+            int             ready;
+
+            buffer[len] = '\0';
+            if(strstr(buffer, "\n\r\n") != NULL || strstr(buffer, "\n\n") != NULL)
+            {
+                break;
+            }
+
+            // a signal only cuts the wait short, the deadline stays where it was
+            do
+            {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                remaining_ms = ctx->header_timeout_ms - ((now.tv_sec - start.tv_sec) * MS_PER_SEC + (now.tv_nsec - start.tv_nsec) / (long)NS_PER_MS);
+
+                pfd.fd     = client_sock;
+                pfd.events = POLLIN;
+                ready      = remaining_ms > 0 ? poll(&pfd, 1, (int)remaining_ms) : 0;
+            } while(ready == -1 && errno == EINTR);
+
+            if(ready == 0)
+            {
+                ctx->timeout = TIMEOUT_HEADER;
+                return -1;
+            }
+
+            // never fall through to a read that could block without a deadline
+            if(ready == -1)
+            {
+                perror("poll request");
+                return -1;
+            }
+        }
+
+        valread = read(client_sock, buffer + len, sizeof(ctx->request) - 1 - len);
+        if(valread == 0)
+        {
+            break;
+        }
+        if(valread < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        len += (size_t)valread;
+    }
+
+    buffer[len] = '\0';
+
+    return (ssize_t)len;
+}
+
+int handle_post_request(const char *uri, int client_sock, char *request_body, struct handler_ctx *ctx)
 {
-    char        response_body[BUFFER_SIZE];
+    const char *response_body  = "{\"message\": \"Data stored successfully. Thank you\"}";
     long        content_length = 0;
     char       *body_start;
     size_t      body_length;
@@ -136,14 +401,14 @@ int handle_post_request(const char *uri, int client_sock, char *request_body, se
     // ensure endptr is pointing at non number after content length
     if(*endptr != '\0' && *endptr != '\r' && *endptr != '\n')
     {
-        form_response(client_sock, "400 Bad Request", 0, "text/plain");
+        send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
         return 0;
     }
 
     // get endpoint is correct, currently only have 1 POST endpoint
     if(strcmp(uri, "/dataPOST") != 0)
     {
-        form_response(client_sock, "404 Not Found", 0, "text/plain");
+        send_error_response(client_sock, ERROR_NOT_FOUND_PLAIN, 1);
         return 0;
     }
 
@@ -155,7 +420,7 @@ int handle_post_request(const char *uri, int client_sock, char *request_body, se
     }
     else
     {
-        form_response(client_sock, "400 Bad Request", 0, "text/plain");
+        send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
         return 0;
     }
 
@@ -163,19 +428,17 @@ int handle_post_request(const char *uri, int client_sock, char *request_body, se
     body_length = strlen(body_start);
     if(body_length != (size_t)content_length)
     {
-        form_response(client_sock, "400 Bad Request", 0, "text/plain");
+        send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
         return 0;
     }
 
-    key = parse_key(body_start);
+    key = parse_key(ctx->arena, body_start);
 
-    value = parse_value(body_start);
+    value = parse_value(ctx->arena, body_start);
 
     if(!key || !value)
     {
-        form_response(client_sock, "400 Bad Request", 0, "text/plain");
-        free(key);
-        free(value);
+        send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
         return 0;
     }
 
@@ -183,587 +446,2515 @@ int handle_post_request(const char *uri, int client_sock, char *request_body, se
     printf("Extracted key: %s\n", key);
     printf("Extracted value: %s\n", value);
 
-    sem_wait(sem);
+    database_lock(ctx);
 
     if(add_to_db(key, value) != 0)
     {
-        form_response(client_sock, "500 Internal Server Error", 0, "text/plain");
-        free(key);
-        free(value);
-        sem_post(sem);
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        database_unlock(ctx);
         return -1;
     }
 
-    sem_post(sem);
-
-    snprintf(response_body, sizeof(response_body), "{\"message\": \"Data stored successfully. Thank you\"}");
+    database_unlock(ctx);
 
     form_response(client_sock, "200 OK", (int)strlen(response_body), "application/json");
     write(client_sock, response_body, strlen(response_body));
 
     // printing for testing purposes
-    sem_wait(sem);
+    database_lock(ctx);
     read_all_entries();
-    sem_post(sem);
-
-    free(key);
-    free(value);
+    database_unlock(ctx);
 
     return 0;
 }
 
-char *parse_value(char *body_start)
+// the body goes to a temporary file next to the target and is renamed over it once complete, so
+// serve_file only ever sees the old file or the whole new one. request_len is what read_request got,
+// headers and whatever part of the body came with them
+int handle_upload(const char *uri, int client_sock, size_t request_len, struct handler_ctx *ctx)
 {
-    char *value_strn;
-    char *value = NULL;
+    const char *name = uri + UPLOAD_PREFIX_LEN;
+    const char *body_start;
+    char        value[HEADER_VALUE_LEN];
+    char        filepath[BUFFER_SIZE];
+    char        tmp_path[] = UPLOAD_TEMPLATE;
+    char        response[UPLOAD_RESPONSE_SIZE];
+    char        location[BUFFER_SIZE];
+    char       *endptr;
+    long long   content_length;
+    uint64_t    deadline;
+    size_t      received;
+    struct stat existing;
+    int         replaced;
+    int         filefd;
+    int         len;
+
+    if(!valid_upload_name(name))
+    {
+        reject_upload(client_sock, ERROR_BAD_REQUEST_PLAIN);
+        return 0;
+    }
 
-    value_strn = strstr(body_start, "\"value\":");
-    if(value_strn)
+    // the body is streamed as it comes, its length has to be known up front
+    if(get_header_value(ctx->request, "Transfer-Encoding", value, sizeof(value)) == 0 || get_header_value(ctx->request, "Content-Length", value, sizeof(value)) == -1)
     {
-        char *value_start;
-        value_strn += 8;    // NOLINT
+        reject_upload(client_sock, ERROR_LENGTH_REQUIRED);
+        return 0;
+    }
 
-        value_start = strchr(value_strn, '\"');
-        if(value_start)
-        {
-            const char *value_end;
-            value_start++;
+    errno          = 0;
+    content_length = strtoll(value, &endptr, BASE);
+    if(errno != 0 || *endptr != '\0' || endptr == value || content_length < 0)
+    {
+        reject_upload(client_sock, ERROR_BAD_REQUEST_PLAIN);
+        return 0;
+    }
 
-            value_end = strchr(value_start, '\"');
-            if(value_end)
-            {
-                size_t value_len = (size_t)(value_end - value_start);
-                value            = (char *)malloc(value_len + 1);
-                strncpy(value, value_start, value_len);
-                value[value_len] = '\0';
-            }
-            else
-            {
-                return NULL;
-            }
-        }
-        else
-        {
-            return NULL;
-        }
+    if(content_length > UPLOAD_MAX_SIZE)
+    {
+        reject_upload(client_sock, ERROR_PAYLOAD_TOO_LARGE);
+        return 0;
     }
-    return value;
-}
 
-char *parse_key(char *body_start)
-{
-    char *key_strn;
-    char *key = NULL;
+    body_start = strstr(ctx->request, "\r\n\r\n");
+    if(body_start == NULL)
+    {
+        reject_upload(client_sock, ERROR_BAD_REQUEST_PLAIN);
+        return 0;
+    }
+    body_start += BLANK_LINE_OFFSET;
+    received = request_len - (size_t)(body_start - ctx->request);
+    if((long long)received > content_length)
+    {
+        reject_upload(client_sock, ERROR_BAD_REQUEST_PLAIN);
+        return 0;
+    }
 
-    key_strn = strstr(body_start, "\"key\":");
-    if(key_strn)
+    // curl and most other clients hold back a large body until they are told to go ahead
+    if(get_header_value(ctx->request, "Expect", value, sizeof(value)) == 0 && strcasecmp(value, "100-continue") == 0 && (long long)received < content_length)
     {
-        char *key_start;
-        key_strn += 6;    // NOLINT
+        static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
 
-        key_start = strchr(key_strn, '\"');
-        if(key_start)
-        {
-            const char *key_end;
-            key_start++;
+        write(client_sock, continue_response, sizeof(continue_response) - 1);
+    }
 
-            key_end = strchr(key_start, '\"');
-            if(key_end)
-            {
-                size_t key_len = (size_t)(key_end - key_start);
-                key            = (char *)malloc(key_len + 1);
-                strncpy(key, key_start, key_len);
-                key[key_len] = '\0';
-            }
-            else
-            {
-                return NULL;
-            }
-        }
-        else
-        {
-            return NULL;
-        }
+    filefd = mkstemp(tmp_path);
+    if(filefd == -1)
+    {
+        perror("mkstemp upload");
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        return -1;
     }
-    return key;
-}
+    fchmod(filefd, PERMISSIONS);
 
-void form_response(int newsockfd, const char *status, int content_length, const char *content_type)
-{
-    struct tm tm_result;              // time structure
-    char      header[BUFFER_SIZE];    // buffer to hold contents of response
-    char      timestamp[TIME_BUFFER];
+    // one deadline for the whole body, so a client trickling a byte now and then cannot hold the worker
+    deadline = metrics_now() + ((uint64_t)ctx->header_timeout_ms + (uint64_t)content_length * MS_PER_SEC / UPLOAD_MIN_RATE) * NS_PER_MS;
 
-    get_http_date(&tm_result);            // get current time
-    format_time(tm_result, timestamp);    // format time to human readable string
+    scoreboard_set_state(ctx->scoreboard, WORKER_READING);
+    if(write(filefd, body_start, received) != (ssize_t)received || receive_body(client_sock, filefd, (off_t)(content_length - (long long)received), deadline, ctx) == -1)
+    {
+        close(filefd);
+        unlink(tmp_path);
 
-    // format response header for status 200 OK
-    snprintf(header,
-             sizeof(header),
-             "HTTP/1.0 %s\r\n"
-             "Server: HTTPServer/1.0\r\n"
-             "Date: %s\r\n"
-             "Connection: close\r\n"
-             "Content-Length: %d\r\n"
-             "Content-Type: %s\r\n\r\n",
-             status,
-             timestamp,
-             content_length,
-             content_type);
+        // the client stopped sending or went away, there is nobody to answer
+        if(ctx->timeout != TIMEOUT_NONE || errno == ECONNRESET || errno == EPIPE)
+        {
+            return -1;
+        }
 
-    printf("%s\n", header);
-    write(newsockfd, header, strlen(header));    // send response to client
-    fflush(stdout);
-}
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        return -1;
+    }
 
-int verify_method(const char *method)
-{
-    if(strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 && strcmp(method, "POST") != 0)
+    // the data has to be on disk before the rename makes it visible, or a crash can leave an empty file
+    // under the new name
+    if(fsync(filefd) == -1)
     {
+        perror("fsync upload");
+        close(filefd);
+        unlink(tmp_path);
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
         return -1;
     }
+    close(filefd);
 
-    return 0;
-}
-
-static int store_string(DBM *db, const char *key, const char *value)
-{
-    const_datum key_datum   = MAKE_CONST_DATUM(key);
-    const_datum value_datum = MAKE_CONST_DATUM(value);
-
-    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
-}
-
-int add_to_db(const char *key_str, const char *value_str)
-{
-    DBM *db;
-
-    char DATABASE[] = "/Users/developer/rm4/database.db";    // cppcheck-suppress constVariable
+    snprintf(filepath, sizeof(filepath), PUBLIC_ROOT "%s", uri);
+    replaced = stat(filepath, &existing) == 0;
+    if(rename(tmp_path, filepath) == -1)
+    {
+        perror("rename upload");
+        unlink(tmp_path);
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        return -1;
+    }
 
-    db = dbm_open(DATABASE, O_RDWR | O_CREAT, PERMISSIONS);
-    if(db == NULL)
+    // and the rename itself is only durable once the directory is
+    if(sync_upload_directory() == -1)
     {
-        perror("Opening NDBM database");
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
         return -1;
     }
 
-    if(store_string(db, key_str, value_str) != 0)
+    scoreboard_set_state(ctx->scoreboard, WORKER_WRITING);
+    len = snprintf(response, sizeof(response), "{\"path\": \"%s\", \"size\": %lld}", uri, content_length);
+    if(replaced)
     {
-        perror("store_string");
-        dbm_close(db);
-        return EXIT_FAILURE;
+        form_response(client_sock, "200 OK", len, "application/json");
+    }
+    else
+    {
+        snprintf(location, sizeof(location), "Location: %s\r\n", uri);
+        form_response_extra(client_sock, "201 Created", (off_t)len, "application/json", location);
     }
+    write(client_sock, response, (size_t)len);
 
-    dbm_close(db);
     return 0;
 }
 
-int fetch_entry(const char *uri, const char *method, int client_sock, sem_t *sem)
+// the client is most likely still sending the body, and closing with it unread makes the kernel answer
+// with a reset that can overtake the response. so the response goes out, the write side is shut and a
+// bounded part of the body is read and dropped until the client closes or the linger time is up
+static void reject_upload(int client_sock, enum error_response error)
 {
-    char key[MAX_KEY_LEN];
-    char value[MAX_VALUE_LEN];
+    char     drain[BUFFER_SIZE];
+    uint64_t deadline;
+    size_t   drained = 0;
 
-    strncpy(key, uri + KEY_OFFSET, sizeof(key) - 1);
-    key[sizeof(key) - 1] = '\0';
+    send_error_response(client_sock, error, 1);
+    shutdown(client_sock, SHUT_WR);
 
-    sem_wait(sem);
-    if(find_in_db(key, value, sizeof(value)) == 0)
+    deadline = metrics_now() + UPLOAD_LINGER_MS * NS_PER_MS;
+    while(drained < UPLOAD_DRAIN_LIMIT)
     {
-        char response_body[BUFFER_SIZE];
-        // use max length to prevent buffer overflow. Silences warning on linux
-        char key_truncated[MAX_KEY_LEN + 1];
-        char value_truncated[MAX_VALUE_LEN + 1];
-
-        strncpy(key_truncated, key, MAX_KEY_LEN);
-        key_truncated[MAX_KEY_LEN] = '\0';
+        struct pollfd pfd;
+        uint64_t      now = metrics_now();
+        ssize_t       n;
+        int           ready;
 
-        strncpy(value_truncated, value, MAX_VALUE_LEN);
-        value_truncated[MAX_VALUE_LEN] = '\0';
+        if(now >= deadline)
+        {
+            break;
+        }
 
-        snprintf(response_body, sizeof(response_body), "{\"key\": \"%s\", \"value\": \"%s\"}", key_truncated, value_truncated);
+        pfd.fd      = client_sock;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        ready       = poll(&pfd, 1, (int)((deadline - now + NS_PER_MS - 1) / NS_PER_MS));
+        if(ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ready <= 0)
+        {
+            break;
+        }
 
-        if(strcmp(method, "GET") == 0)
+        n = read(client_sock, drain, sizeof(drain));
+        if(n == -1 && errno == EINTR)
         {
-            form_response(client_sock, "200 OK", (int)strlen(response_body), "application/json");
-            write(client_sock, response_body, strlen(response_body));
+            continue;
         }
-        else if(strcmp(method, "HEAD") == 0)
+        if(n <= 0)
         {
-            form_response(client_sock, "200 OK", (int)strlen(response_body), "application/json");
+            break;
         }
+        drained += (size_t)n;
     }
-    else
+}
+
+static int sync_upload_directory(void)
+{
+    int dirfd = open(UPLOAD_DIRECTORY, O_RDONLY | O_DIRECTORY);
+    int retval;
+
+    if(dirfd == -1)
     {
-        handle_file_not_found(method, client_sock);
+        perror("open upload directory");
+        return -1;
     }
 
-    sem_post(sem);
+    retval = fsync(dirfd);
+    if(retval == -1)
+    {
+        perror("fsync upload directory");
+    }
+    close(dirfd);
 
-    return 0;
+    return retval;
 }
 
-static char *retrieve_string(DBM *db, const char *key)
+// a plain file name, no directories and nothing hidden. the temporary files start with a dot, so an
+// upload can never be named like one
+static int valid_upload_name(const char *name)
 {
-    const_datum key_datum;
-    datum       result;
-    char       *retrieved_str;
-
-    key_datum = MAKE_CONST_DATUM(key);
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    result = dbm_fetch(db, *(datum *)&key_datum);
-#pragma GCC diagnostic pop
+    size_t len = strlen(name);
 
-    if(result.dptr == NULL)
+    if(len == 0 || len > NAME_MAX || name[0] == '.')
     {
-        return NULL;
+        return 0;
     }
 
-    retrieved_str = (char *)malloc(TO_SIZE_T(result.dsize));
-
-    if(!retrieved_str)
+    for(size_t i = 0; i < len; i++)
     {
-        return NULL;
+        if(!isalnum((unsigned char)name[i]) && name[i] != '.' && name[i] != '-' && name[i] != '_')
+        {
+            return 0;
+        }
     }
 
-    memcpy(retrieved_str, result.dptr, TO_SIZE_T(result.dsize));
-
-    return retrieved_str;
+    return 1;
 }
 
-int find_in_db(const char *key_str, char *returned_value, size_t max_len)
+// moves remaining body bytes from the socket to filefd, through a pipe with splice where there is one.
+// returns -1 when the client hangs up early, is not done by the deadline or the disk fails
+static int receive_body(int client_sock, int filefd, off_t remaining, uint64_t deadline, struct handler_ctx *ctx)
 {
-    DBM  *db;
-    char *retrieved_str;
-
-    char DATABASE[] = "/Users/developer/rm4/database.db";    // cppcheck-suppress constVariable
+#if defined(__linux__)
+    int pipefd[2];
+    int retval = 0;
 
-    db = dbm_open(DATABASE, O_RDONLY, PERMISSIONS);    // Open as read-only
-    if(db == NULL)
+    if(remaining == 0)
     {
-        perror("Opening NDBM database");
-        return -1;
+        return 0;
     }
 
-    retrieved_str = retrieve_string(db, key_str);
-    if(retrieved_str == NULL)
+    if(pipe2(pipefd, O_CLOEXEC) == -1)
     {
-        dbm_close(db);
+        perror("pipe upload");
         return -1;
     }
 
-    strncpy(returned_value, retrieved_str, max_len - 1);
-    returned_value[max_len - 1] = '\0';
-
-    free(retrieved_str);
+    // fewer round trips for a large body, the default stays if the limit is lower
+    fcntl(pipefd[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
 
-    dbm_close(db);
-    return 0;
-}
+    while(remaining > 0 && retval == 0)
+    {
+        ssize_t in;
+
+        if(wait_for_body(client_sock, deadline, ctx) == -1)
+        {
+            retval = -1;
+            break;
+        }
+
+        in = splice(client_sock, NULL, pipefd[1], NULL, (size_t)remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(in <= 0)
+        {
+            if(in == -1 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue;
+            }
+            if(in == 0)
+            {
+                errno = ECONNRESET;
+            }
+            retval = -1;
+            break;
+        }
+        remaining -= in;
+
+        // drain the pipe completely, the next splice from the socket needs the room
+        while(in > 0)
+        {
+            ssize_t out = splice(pipefd[0], NULL, filefd, NULL, (size_t)in, SPLICE_F_MOVE);
+
+            if(out == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if(out <= 0)
+            {
+                perror("splice upload");
+                retval = -1;
+                break;
+            }
+            in -= out;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    return retval;
+#else
+    char buffer[BUFFER_SIZE];
+
+    while(remaining > 0)
+    {
+        size_t  chunk = remaining < (off_t)sizeof(buffer) ? (size_t)remaining : sizeof(buffer);
+        ssize_t in;
+
+        if(wait_for_body(client_sock, deadline, ctx) == -1)
+        {
+            return -1;
+        }
+
+        in = read(client_sock, buffer, chunk);
+        if(in <= 0)
+        {
+            if(in == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if(in == 0)
+            {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+
+        if(write(filefd, buffer, (size_t)in) != in)
+        {
+            perror("write upload");
+            return -1;
+        }
+        remaining -= in;
+    }
+
+    return 0;
+#endif
+}
+
+// a body that is not in by the deadline is a slow request like stalled headers. every wait only gets
+// what is left of the deadline, pauses do not earn the client more time
+static int wait_for_body(int client_sock, uint64_t deadline, struct handler_ctx *ctx)
+{
+    struct pollfd pfd;
+    uint64_t      now;
+    int           ready;
+
+    pfd.fd      = client_sock;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    // a signal only cuts the wait short, the deadline stays where it was
+    do
+    {
+        now   = metrics_now();
+        ready = now < deadline ? poll(&pfd, 1, (int)((deadline - now + NS_PER_MS - 1) / NS_PER_MS)) : 0;
+    } while(ready == -1 && errno == EINTR);
+
+    if(ready == 0)
+    {
+        ctx->timeout = TIMEOUT_HEADER;
+        return -1;
+    }
+
+    if(ready == -1)
+    {
+        perror("poll upload");
+        return -1;
+    }
+
+    return 0;
+}
+
+// every database access holds the semaphore. waiting for it and holding it are recorded as stages of
+// their own, and kept out of the write stage
+void database_lock(struct handler_ctx *ctx)
+{
+    uint64_t start = metrics_now();
+
+    sem_wait(ctx->sem);
+    ctx->locked_ns = metrics_lap(ctx->metrics, STAGE_LOCK_WAIT, start);
+    ctx->database_ns += ctx->locked_ns - start;
+}
+
+void database_unlock(struct handler_ctx *ctx)
+{
+    uint64_t now = metrics_lap(ctx->metrics, STAGE_DATABASE, ctx->locked_ns);
+
+    sem_post(ctx->sem);
+    ctx->database_ns += now - ctx->locked_ns;
+
+    // the database is the last thing the data endpoints wait on, the response follows
+    scoreboard_set_state(ctx->scoreboard, WORKER_WRITING);
+}
+
+int serve_metrics(const char *method, int client_sock, const struct pool_shared *pool, struct arena *arena)
+{
+    char  *body;
+    size_t len;
+
+    body = (char *)arena_alloc(arena, METRICS_BUFFER_SIZE);
+    if(body == NULL)
+    {
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        return -1;
+    }
+
+    len = metrics_render(pool, body, METRICS_BUFFER_SIZE);
+
+    form_response(client_sock, "200 OK", (int)len, "text/plain; version=0.0.4; charset=utf-8");
+    if(strcmp(method, "GET") == 0)
+    {
+        write(client_sock, body, len);
+    }
+
+    return 0;
+}
+
+// a peer on the loopback network, or on a unix socket running as the user the server runs as. a reverse
+// proxy forwarding outside traffic over a unix socket runs as a user of its own and is not trusted
+int is_local_client(int client_sock)
+{
+    struct sockaddr_storage peer;
+    socklen_t               peer_len = sizeof(peer);
+
+    if(getpeername(client_sock, (struct sockaddr *)&peer, &peer_len) == -1)
+    {
+        return 0;
+    }
+
+    if(peer.ss_family == AF_UNIX)
+    {
+        return peer_is_own_user(client_sock);
+    }
+
+    if(peer.ss_family == AF_INET)
+    {
+        const struct sockaddr_in *peer_in = (const struct sockaddr_in *)&peer;
+
+        return (ntohl(peer_in->sin_addr.s_addr) >> 24) == 127;    // NOLINT
+    }
+
+    if(peer.ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *peer_in6 = (const struct sockaddr_in6 *)&peer;
+
+        return IN6_IS_ADDR_LOOPBACK(&peer_in6->sin6_addr) || (IN6_IS_ADDR_V4MAPPED(&peer_in6->sin6_addr) && peer_in6->sin6_addr.s6_addr[12] == 127);    // NOLINT
+    }
+
+    return 0;
+}
+
+// the kernel records who connected, the address of a unix socket peer says nothing about it
+static int peer_is_own_user(int client_sock)
+{
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t    cred_len = sizeof(cred);
+
+    return getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 && cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(client_sock, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+// /trace streams the buffer as chrome trace event json, oldest span first, for chrome://tracing or perfetto.
+// /trace?sample=n traces every nth request from now on and 0 turns it off
+int serve_trace(char *uri, const char *method, int client_sock, struct trace_shared *trace)
+{
+    struct chunk_writer writer;
+    char                line[TRACE_EVENT_SIZE];
+    uint64_t            head;
+    uint64_t            position;
+    int                 first = 1;
+
+    if(uri[TRACE_QUERY_OFFSET - 1] == '?')
+    {
+        struct query_param params[MAX_QUERY_PARAMS];
+        int                param_count;
+        const char        *sample;
+        char              *end;
+        unsigned long      every;
+        int                len;
+
+        param_count = parse_query(uri + TRACE_QUERY_OFFSET, params, MAX_QUERY_PARAMS);
+        sample      = find_query_param(params, param_count, "sample");
+        if(sample == NULL || *sample == '\0')
+        {
+            send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, strcmp(method, "HEAD") != 0);
+            return 0;
+        }
+
+        errno = 0;
+        every = strtoul(sample, &end, BASE);
+        if(errno != 0 || *end != '\0' || every > UINT_MAX)
+        {
+            send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, strcmp(method, "HEAD") != 0);
+            return 0;
+        }
+
+        atomic_store(&trace->sample_every, (unsigned int)every);
+
+        len = snprintf(line, sizeof(line), "{\"sample_every\": %lu}", every);
+        form_response(client_sock, "200 OK", len, "application/json");
+        if(strcmp(method, "GET") == 0)
+        {
+            write(client_sock, line, (size_t)len);
+        }
+        return 0;
+    }
+
+    chunk_writer_begin(&writer, client_sock, "200 OK", "application/json");
+    if(strcmp(method, "HEAD") == 0)
+    {
+        return chunk_writer_end(&writer, 1);
+    }
+
+    snprintf(line, sizeof(line), "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"sample_every\": %u}, \"traceEvents\": [", atomic_load(&trace->sample_every));
+    chunk_writer_puts(&writer, line);
+
+    // spans written while this runs are left for the next export
+    head     = atomic_load(&trace->head);
+    position = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+    for(; position < head && !writer.error; position++)
+    {
+        struct trace_span span;
+
+        if(trace_read(trace, position, &span) == 0)
+        {
+            write_trace_event(&writer, &span, first);
+            first = 0;
+        }
+    }
+
+    chunk_writer_puts(&writer, "\n]}\n");
+    return chunk_writer_end(&writer, 0);
+}
+
+// a complete event for the span. the end of the dispatch and the start of the handoff are also joined
+// by a flow event, which draws the arrow from the dispatcher to whichever worker got the request
+static int write_trace_event(struct chunk_writer *writer, const struct trace_span *span, int first)
+{
+    char               line[TRACE_EVENT_SIZE];
+    unsigned long long start    = (unsigned long long)span->start_ns;
+    unsigned long long duration = (unsigned long long)(span->end_ns - span->start_ns);
+    int                len;
+
+    len = snprintf(line,
+                   sizeof(line),
+                   "%s\n{\"name\": \"%s\", \"cat\": \"request\", \"ph\": \"X\", \"ts\": %llu.%03llu, \"dur\": %llu.%03llu, \"pid\": %d, \"tid\": %d, \"args\": {\"request_id\": %llu}}",
+                   first ? "" : ",",
+                   trace_kind_name(span->kind),
+                   start / NS_PER_US,
+                   start % NS_PER_US,
+                   duration / NS_PER_US,
+                   duration % NS_PER_US,
+                   span->pid,
+                   span->tid,
+                   (unsigned long long)span->request_id);
+
+    if(span->kind == TRACE_DISPATCH || span->kind == TRACE_HANDOFF)
+    {
+        unsigned long long at = span->kind == TRACE_DISPATCH ? (unsigned long long)span->end_ns : start;
+
+        len += snprintf(line + len,
+                        sizeof(line) - (size_t)len,
+                        ",\n{\"name\": \"request\", \"cat\": \"request\", \"ph\": \"%s\"%s, \"id\": %llu, \"ts\": %llu.%03llu, \"pid\": %d, \"tid\": %d}",
+                        span->kind == TRACE_DISPATCH ? "s" : "f",
+                        span->kind == TRACE_DISPATCH ? "" : ", \"bp\": \"e\"",
+                        (unsigned long long)span->request_id,
+                        at / NS_PER_US,
+                        at % NS_PER_US,
+                        span->pid,
+                        span->tid);
+    }
+
+    return chunk_writer_write(writer, line, (size_t)len);
+}
+
+// one object per running worker with a row for each of its threads. everything comes from the shared
+// counters, the workers do no extra work for it however often it is polled
+int serve_server_status(const char *method, int client_sock, const struct pool_shared *pool)
+{
+    struct chunk_writer writer;
+    char                line[STATUS_LINE_SIZE];
+    uint64_t            now   = metrics_now();
+    int                 first = 1;
+
+    chunk_writer_begin(&writer, client_sock, "200 OK", "application/json");
+    if(strcmp(method, "HEAD") == 0)
+    {
+        return chunk_writer_end(&writer, 1);
+    }
+
+    snprintf(line, sizeof(line), "{\"generation\": %u, \"workers\": [", atomic_load(&pool->generation));
+    chunk_writer_puts(&writer, line);
+
+    for(int i = 0; i < POOL_MAX_WORKERS && !writer.error; i++)
+    {
+        const struct worker_slot       *slot   = &pool->slots[i];
+        const struct scoreboard_worker *worker = &pool->scoreboard->workers[i];
+        char                            loaded_at[TIMESTAMP_LEN];
+        char                            modified[TIMESTAMP_LEN];
+        uint64_t                        bytes_sent = 0;
+        uint64_t                        busy_ns;
+        int                             threads;
+        int                             len;
+
+        if(slot->pid == 0)
+        {
+            continue;
+        }
+
+        threads = atomic_load(&worker->threads);
+        if(threads < 1 || threads > SCOREBOARD_THREADS)
+        {
+            threads = 1;
+        }
+
+        for(int t = 0; t < threads; t++)
+        {
+            bytes_sent += atomic_load_explicit(&worker->thread[t].bytes_sent, memory_order_relaxed);
+        }
+
+        format_timestamp(atomic_load(&worker->loaded_at), loaded_at, sizeof(loaded_at));
+        format_timestamp((uint64_t)atomic_load(&worker->library_mtime), modified, sizeof(modified));
+
+        // seconds are printed from the integer nanoseconds, so every field has a bounded width and the
+        // line always fits. a short line would leave the document cut off mid object
+        busy_ns = atomic_load(&slot->busy_ns);
+        len     = snprintf(line,
+                           sizeof(line),
+                           "%s\n  {\"slot\": %d, \"pid\": %d, \"generation\": %u, \"library\": {\"modified\": \"%s\", \"size\": %lld}, \"loaded_at\": \"%s\", \"served\": %llu, "
+                           "\"bytes_sent\": %llu, \"busy_seconds\": %llu.%03llu, \"threads\": [",
+                           first ? "" : ",",
+                           i,
+                           (int)slot->pid,
+                           atomic_load(&slot->loaded_generation),
+                           modified,
+                           (long long)atomic_load(&worker->library_size),
+                           loaded_at,
+                           (unsigned long long)atomic_load(&slot->served),
+                           (unsigned long long)bytes_sent,
+                           (unsigned long long)(busy_ns / NS_PER_SEC),
+                           (unsigned long long)(busy_ns % NS_PER_SEC / NS_PER_MS));
+        if(len < 0 || (size_t)len >= sizeof(line))
+        {
+            writer.error = 1;
+            break;
+        }
+        chunk_writer_write(&writer, line, (size_t)len);
+        first = 0;
+
+        for(int t = 0; t < threads; t++)
+        {
+            write_status_thread(&writer, &worker->thread[t], t, now, t == 0);
+        }
+        chunk_writer_puts(&writer, "\n  ]}");
+    }
+
+    chunk_writer_puts(&writer, "\n]}\n");
+    return chunk_writer_end(&writer, 0);
+}
+
+static int write_status_thread(struct chunk_writer *writer, const struct scoreboard_thread *thread, int index, uint64_t now, int first)
+{
+    char     line[STATUS_LINE_SIZE];
+    char     uri[SCOREBOARD_URI_LEN];
+    uint64_t since    = atomic_load_explicit(&thread->since_ns, memory_order_relaxed);
+    uint64_t in_state = 0;
+    int      len;
+
+    scoreboard_read_uri(thread, uri, sizeof(uri));
+
+    // a thread that never served anything has no time in its state yet
+    if(since != 0 && now > since)
+    {
+        in_state = now - since;
+    }
+
+    // the uri is the only field of unbounded length, it goes through the escaping writer on its own
+    len = snprintf(line,
+                   sizeof(line),
+                   "%s\n    {\"thread\": %d, \"state\": \"%s\", \"state_seconds\": %llu.%03llu, \"requests\": %llu, \"bytes_sent\": %llu, \"uri\": \"",
+                   first ? "" : ",",
+                   index,
+                   scoreboard_state_name(atomic_load_explicit(&thread->state, memory_order_relaxed)),
+                   (unsigned long long)(in_state / NS_PER_SEC),
+                   (unsigned long long)(in_state % NS_PER_SEC / NS_PER_MS),
+                   (unsigned long long)atomic_load_explicit(&thread->requests, memory_order_relaxed),
+                   (unsigned long long)atomic_load_explicit(&thread->bytes_sent, memory_order_relaxed));
+    if(len < 0 || (size_t)len >= sizeof(line))
+    {
+        writer->error = 1;
+        return -1;
+    }
+    chunk_writer_write(writer, line, (size_t)len);
+    chunk_writer_write_json(writer, uri, strlen(uri));
+
+    return chunk_writer_puts(writer, "\"}");
+}
+
+// utc in iso 8601, empty for 0
+static void format_timestamp(uint64_t seconds, char *out, size_t max_len)
+{
+    time_t    t = (time_t)seconds;
+    struct tm tm_result;
+
+    out[0] = '\0';
+    if(seconds != 0 && gmtime_r(&t, &tm_result) != NULL)
+    {
+        strftime(out, max_len, "%Y-%m-%dT%H:%M:%SZ", &tm_result);
+    }
+}
+
+// the value is copied into the arena, it lives until the request is done
+char *parse_value(struct arena *arena, char *body_start)
+{
+    char *value_strn;
+    char *value = NULL;
+
+    value_strn = strstr(body_start, "\"value\":");
+    if(value_strn)
+    {
+        char *value_start;
+        value_strn += 8;    // NOLINT
+
+        value_start = strchr(value_strn, '\"');
+        if(value_start)
+        {
+            const char *value_end;
+            value_start++;
+
+            value_end = strchr(value_start, '\"');
+            if(value_end)
+            {
+                value = arena_strndup(arena, value_start, (size_t)(value_end - value_start));
+            }
+            else
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    return value;
+}
+
+char *parse_key(struct arena *arena, char *body_start)
+{
+    char *key_strn;
+    char *key = NULL;
+
+    key_strn = strstr(body_start, "\"key\":");
+    if(key_strn)
+    {
+        char *key_start;
+        key_strn += 6;    // NOLINT
+
+        key_start = strchr(key_strn, '\"');
+        if(key_start)
+        {
+            const char *key_end;
+            key_start++;
+
+            key_end = strchr(key_start, '\"');
+            if(key_end)
+            {
+                key = arena_strndup(arena, key_start, (size_t)(key_end - key_start));
+            }
+            else
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            return NULL;
+        }
+    }
+    return key;
+}
+
+void form_response(int newsockfd, const char *status, int content_length, const char *content_type)
+{
+    form_response_extra(newsockfd, status, (off_t)content_length, content_type, NULL);
+}
+
+// same as form_response but takes a 64 bit length and optional extra header lines ending in \r\n
+void form_response_extra(int newsockfd, const char *status, off_t content_length, const char *content_type, const char *extra_headers)
+{
+    char   header[BUFFER_SIZE];    // buffer to hold contents of response
+    size_t header_len;
+
+    header_len = format_response_header(header, sizeof(header), status, content_length, content_type, extra_headers);
+
+    printf("%s\n", header);
+    write(newsockfd, header, header_len);    // send response to client
+    fflush(stdout);
+}
+
+// renders the header form_response_extra sends, for callers that send it together with the body
+size_t format_response_header(char *header, size_t max_len, const char *status, off_t content_length, const char *content_type, const char *extra_headers)
+{
+    struct tm tm_result;    // time structure
+    char      timestamp[TIME_BUFFER];
+    int       len;
+
+    get_http_date(&tm_result);            // get current time
+    format_time(tm_result, timestamp);    // format time to human readable string
+
+    // format response header for status 200 OK
+    len = snprintf(header,
+                   max_len,
+                   "HTTP/1.0 %s\r\n"
+                   "Server: HTTPServer/1.0\r\n"
+                   "Date: %s\r\n"
+                   "Connection: close\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Content-Type: %s\r\n"
+                   "%s\r\n",
+                   status,
+                   timestamp,
+                   (long long)content_length,
+                   content_type,
+                   extra_headers ? extra_headers : "");
+
+    if(len < 0)
+    {
+        header[0] = '\0';
+        return 0;
+    }
+
+    return (size_t)len < max_len ? (size_t)len : max_len - 1;
+}
+
+int verify_method(const char *method)
+{
+    if(strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 && strcmp(method, "POST") != 0 && strcmp(method, "PUT") != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int store_string(DBM *db, const char *key, const char *value)
+{
+    const_datum key_datum   = MAKE_CONST_DATUM(key);
+    const_datum value_datum = MAKE_CONST_DATUM(value);
+
+    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+}
+
+int add_to_db(const char *key_str, const char *value_str)
+{
+    DBM *db;
+
+    db = dbm_open(database_path, O_RDWR | O_CREAT, PERMISSIONS);
+    if(db == NULL)
+    {
+        perror("Opening NDBM database");
+        return -1;
+    }
+
+    if(store_string(db, key_str, value_str) != 0)
+    {
+        perror("store_string");
+        dbm_close(db);
+        return EXIT_FAILURE;
+    }
+
+    dbm_close(db);
+    return 0;
+}
+
+int fetch_entry(char *uri, const char *method, int client_sock, struct handler_ctx *ctx)
+{
+    const char         *key;
+    char               *value;
+    DBM                *db;
+    struct chunk_writer writer;
+    size_t              key_len;
+
+    // common case is a single plain key, use it where it sits in the uri without copying or decoding
+    if(strncmp(uri, "/dataGET?key=", KEY_OFFSET) == 0 && uri[KEY_OFFSET + strcspn(uri + KEY_OFFSET, "&#%+;")] == '\0')    // NOLINT
+    {
+        key     = uri + KEY_OFFSET;
+        key_len = strlen(key);
+    }
+    else
+    {
+        struct query_param params[MAX_QUERY_PARAMS];
+        int                param_count;
+
+        param_count = parse_query(uri + QUERY_OFFSET, params, MAX_QUERY_PARAMS);
+        key         = find_query_param(params, param_count, "key");
+        if(key == NULL)
+        {
+            send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
+            return 0;
+        }
+        key_len = strlen(key);
+    }
+
+    if(key_len == 0 || key_len >= MAX_KEY_LEN)
+    {
+        send_error_response(client_sock, ERROR_BAD_REQUEST_PLAIN, 1);
+        return 0;
+    }
+
+    database_lock(ctx);
+
+    db = dbm_open(database_path, O_RDONLY, PERMISSIONS);    // Open as read-only
+    if(db == NULL)
+    {
+        perror("Opening NDBM database");
+        database_unlock(ctx);
+        handle_file_not_found(method, client_sock);
+        return 0;
+    }
+
+    // copy the value out so the lock is not held while the client reads
+    value = retrieve_string(ctx->arena, db, key);
+    dbm_close(db);
+    database_unlock(ctx);
+
+    if(value == NULL)
+    {
+        handle_file_not_found(method, client_sock);
+        return 0;
+    }
+
+    // the value is no longer truncated to fit a buffer, so the escaped length is not known up front
+    chunk_writer_begin(&writer, client_sock, "200 OK", "application/json");
+    if(strcmp(method, "GET") == 0)
+    {
+        chunk_writer_puts(&writer, "{\"key\": \"");
+        chunk_writer_write_json(&writer, key, strlen(key));
+        chunk_writer_puts(&writer, "\", \"value\": \"");
+        chunk_writer_write_json(&writer, value, strlen(value));
+        chunk_writer_puts(&writer, "\"}");
+    }
+    chunk_writer_end(&writer, strcmp(method, "HEAD") == 0);
+
+    return 0;
+}
+
+// stream every entry as a json array, memory use does not grow with the database
+int list_entries(const char *method, int client_sock, struct handler_ctx *ctx)
+{
+    DBM                *db;
+    datum               key;
+    struct chunk_writer writer;
+    int                 first = 1;
+
+    if(strcmp(method, "HEAD") == 0)
+    {
+        chunk_writer_begin(&writer, client_sock, "200 OK", "application/json");
+        chunk_writer_end(&writer, 1);
+        return 0;
+    }
+
+    database_lock(ctx);
+
+    db = dbm_open(database_path, O_RDONLY, PERMISSIONS);
+    if(db == NULL)
+    {
+        perror("Error opening database");
+        database_unlock(ctx);
+        send_error_response(client_sock, ERROR_INTERNAL_PLAIN, 1);
+        return 0;
+    }
+
+    chunk_writer_begin(&writer, client_sock, "200 OK", "application/json");
+    chunk_writer_puts(&writer, "[");
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    key = dbm_firstkey(db);
+#pragma GCC diagnostic pop
+    while(key.dptr != NULL && writer.error == 0)
+    {
+        datum value;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+        value = dbm_fetch(db, key);
+#pragma GCC diagnostic pop
+
+        chunk_writer_puts(&writer, first ? "{\"key\": \"" : ", {\"key\": \"");
+        chunk_writer_write_json(&writer, key.dptr, datum_string_length(key));
+        chunk_writer_puts(&writer, "\", \"value\": \"");
+        if(value.dptr != NULL)
+        {
+            chunk_writer_write_json(&writer, value.dptr, datum_string_length(value));
+        }
+        chunk_writer_puts(&writer, "\"}");
+        first = 0;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+        key = dbm_nextkey(db);
+#pragma GCC diagnostic pop
+    }
+
+    dbm_close(db);
+    database_unlock(ctx);
+
+    chunk_writer_puts(&writer, "]");
+    chunk_writer_end(&writer, 0);
+
+    return 0;
+}
+
+// stored strings keep their terminator, leave it out of the output
+static size_t datum_string_length(datum d)
+{
+    size_t len = TO_SIZE_T(d.dsize);
+
+    if(len > 0 && d.dptr[len - 1] == '\0')
+    {
+        len--;
+    }
+
+    return len;
+}
+
+// dbm's copy is only good until the next call on db, the value is copied into the arena
+static char *retrieve_string(struct arena *arena, DBM *db, const char *key)
+{
+    datum result;
+
+    fetch_datum(db, key, &result);
+    if(result.dptr == NULL)
+    {
+        return NULL;
+    }
+
+    return arena_strndup(arena, result.dptr, datum_string_length(result));
+}
+
+static void fetch_datum(DBM *db, const char *key, datum *result)
+{
+    const_datum key_datum = MAKE_CONST_DATUM(key);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    *result = dbm_fetch(db, *(datum *)&key_datum);
+#pragma GCC diagnostic pop
+}
+
+// copies straight out of dbm's buffer, cut short to fit
+int find_in_db(const char *key_str, char *returned_value, size_t max_len)
+{
+    DBM   *db;
+    datum  result;
+    size_t len;
+
+    db = dbm_open(database_path, O_RDONLY, PERMISSIONS);    // Open as read-only
+    if(db == NULL)
+    {
+        perror("Opening NDBM database");
+        return -1;
+    }
+
+    fetch_datum(db, key_str, &result);
+    if(result.dptr == NULL)
+    {
+        dbm_close(db);
+        return -1;
+    }
+
+    len = datum_string_length(result);
+    if(len > max_len - 1)
+    {
+        len = max_len - 1;
+    }
+    memcpy(returned_value, result.dptr, len);
+    returned_value[len] = '\0';
+
+    dbm_close(db);
+    return 0;
+}
 
 void read_all_entries(void)
 {
-    DBM  *db;
-    datum key;
+    DBM  *db;
+    datum key;
+
+    db = dbm_open(database_path, O_RDONLY, 0);
+    if(db == NULL)
+    {
+        perror("Error opening database");
+        return;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    key = dbm_firstkey(db);
+#pragma GCC diagnostic pop
+    while(key.dptr != NULL)
+    {
+        datum value;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+        value = dbm_fetch(db, key);
+#pragma GCC diagnostic pop
+
+        printf("Key: ");
+        fwrite(key.dptr, 1, key.dsize, stdout);
+        printf(", Value: ");
+        fwrite(value.dptr, 1, value.dsize, stdout);
+        printf("\n");
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+        key = dbm_nextkey(db);
+#pragma GCC diagnostic pop
+    }
+
+    dbm_close(db);
+}
+
+void get_http_date(struct tm *result)
+{
+    time_t now = time(NULL);
+    if(localtime_r(&now, result) == NULL)
+    {
+        perror("localtime_r");
+    }
+}
+
+void format_time(struct tm tm_result, char *time_buffer)
+{
+    if(strftime(time_buffer, TIME_BUFFER, "%a, %d %b %Y %H:%M:%S GMT", &tm_result) == 0)
+    {
+        printf("could not format time");
+    }
+}
+
+const char *get_content_type(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    if(!ext)
+    {
+        return "application/octet-stream";
+    }
+
+    if(strcmp(ext, ".html") == 0)
+    {
+        return "text/html";
+    }
+    if(strcmp(ext, ".css") == 0)
+    {
+        return "text/css";
+    }
+    if(strcmp(ext, ".js") == 0)
+    {
+        return "application/javascript";
+    }
+    if(strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+    {
+        return "image/jpeg";
+    }
+    if(strcmp(ext, ".png") == 0)
+    {
+        return "image/png";
+    }
+    if(strcmp(ext, ".gif") == 0)
+    {
+        return "image/gif";
+    }
+    if(strcmp(ext, ".swf") == 0)
+    {
+        return "application/x-shockwave-flash";
+    }
+
+    return "application/octet-stream";
+}
+
+int check_http_format(const char *version, const char *uri)
+{
+    // verify version
+    if(strcmp(version, "HTTP/1.1") != 0)
+    {
+        printf("not correct version\n");
+        return -1;
+    }
+
+    // verify uri
+    if(strstr(uri, "..") != NULL)
+    {
+        printf("invalid uri\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void handle_check_format_error(const char *method, int client_sock)
+{
+    if(strcmp(method, "GET") == 0)
+    {
+        send_error_response(client_sock, ERROR_BAD_REQUEST, 1);
+    }
+    else if(strcmp(method, "HEAD") == 0)
+    {
+        send_error_response(client_sock, ERROR_BAD_REQUEST, 0);
+    }
+}
+
+void handle_file_serve_error(const char *method, int retval, int client_sock)
+{
+    if(retval == FILE_NOT_FOUND)
+    {
+        handle_file_not_found(method, client_sock);
+    }
+
+    if(retval == PERMISSION_DENIED)
+    {
+        handle_forbidden(method, client_sock);
+    }
+}
+
+void handle_verify_method_error(int client_sock)
+{
+    send_error_response(client_sock, ERROR_METHOD_NOT_ALLOWED, 1);
+}
+
+void handle_file_not_found(const char *method, int client_sock)
+{
+    if(strcmp(method, "GET") == 0)
+    {
+        send_error_response(client_sock, ERROR_NOT_FOUND, 1);
+    }
+    else if(strcmp(method, "HEAD") == 0)
+    {
+        send_error_response(client_sock, ERROR_NOT_FOUND, 0);
+    }
+}
+
+void handle_forbidden(const char *method, int client_sock)
+{
+    if(strcmp(method, "GET") == 0)
+    {
+        send_error_response(client_sock, ERROR_FORBIDDEN, 1);
+    }
+    else if(strcmp(method, "HEAD") == 0)
+    {
+        send_error_response(client_sock, ERROR_FORBIDDEN, 0);
+    }
+}
+
+// error responses never change apart from the date, so each one is rendered into a single buffer
+// when the library is loaded. a placeholder date of the same width keeps every offset fixed.
+__attribute__((constructor)) static void prerender_error_responses(void)
+{
+    static const struct
+    {
+        const char *status;
+        const char *content_type;
+        const char *body;
+    } errors[ERROR_RESPONSE_COUNT] = {
+        [ERROR_BAD_REQUEST]        = {"400 Bad Request",           "text/html",  "<html><body><h1>400 Bad Request</h1></body></html>"       },
+        [ERROR_FORBIDDEN]          = {"403 Forbidden",             "text/html",  "<html><body><h1>403 Forbidden</h1></body></html>"         },
+        [ERROR_NOT_FOUND]          = {"404 Not Found",             "text/html",  "<html><body><h1>404 Not Found</h1></body></html>"         },
+        [ERROR_METHOD_NOT_ALLOWED] = {"405 Method Not Allowed",    "text/html",  "<html><body><h1>405 Method Not Allowed</h1></body></html>"},
+        [ERROR_BAD_REQUEST_PLAIN]  = {"400 Bad Request",           "text/plain", ""                                                         },
+        [ERROR_NOT_FOUND_PLAIN]    = {"404 Not Found",             "text/plain", ""                                                         },
+        [ERROR_INTERNAL_PLAIN]     = {"500 Internal Server Error", "text/plain", ""                                                         },
+        [ERROR_LENGTH_REQUIRED]    = {"411 Length Required",       "text/plain", ""                                                         },
+        [ERROR_PAYLOAD_TOO_LARGE]  = {"413 Payload Too Large",     "text/plain", ""                                                         },
+    };
+
+    for(int i = 0; i < ERROR_RESPONSE_COUNT; i++)
+    {
+        struct prerendered_response *response = &error_responses[i];
+        const char                  *date;
+        int                          header_len;
+        size_t                       body_len = strlen(errors[i].body);
+
+        header_len = snprintf(response->data,
+                              sizeof(response->data),
+                              "HTTP/1.0 %s\r\n"
+                              "Server: HTTPServer/1.0\r\n"
+                              "Date: %*s\r\n"
+                              "Connection: close\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Content-Type: %s\r\n\r\n",
+                              errors[i].status,
+                              HTTP_DATE_LEN,
+                              "",
+                              body_len,
+                              errors[i].content_type);
+
+        memcpy(response->data + header_len, errors[i].body, body_len);
+
+        date                  = strstr(response->data, "Date: ");
+        response->date_offset = (size_t)(date - response->data) + DATE_FIELD_OFFSET;
+        response->header_len  = (size_t)header_len;
+        response->total_len   = (size_t)header_len + body_len;
+    }
+}
+
+// send a prerendered error with the current date in one syscall. the date goes in through its own
+// iovec rather than being written into the shared buffer, so concurrent senders never race on it
+void send_error_response(int client_sock, enum error_response error, int include_body)
+{
+    const struct prerendered_response *response = &error_responses[error];
+    struct iovec                       iov[3];
+    struct tm                          tm_result;
+    char                               timestamp[TIME_BUFFER];
+    size_t                             end = include_body ? response->total_len : response->header_len;
+
+    get_http_date(&tm_result);
+    format_time(tm_result, timestamp);
+
+    iov[0].iov_base = (void *)(uintptr_t)response->data;
+    iov[0].iov_len  = response->date_offset;
+    iov[1].iov_base = timestamp;
+    iov[1].iov_len  = HTTP_DATE_LEN;
+    iov[2].iov_base = (void *)(uintptr_t)(response->data + response->date_offset + HTTP_DATE_LEN);
+    iov[2].iov_len  = end - response->date_offset - HTTP_DATE_LEN;
+
+    write_iov_all(client_sock, iov, 3);
+}
+
+int serve_file(const char *uri, const char *method, int client_sock, const char *request, struct uring *ring)
+{
+    char        filepath[BUFFER_SIZE];
+    char        encoded_path[BUFFER_SIZE];
+    const char *content_type;
+    const char *encoding;
+    int         retval;
+
+    snprintf(filepath, sizeof(filepath), PUBLIC_ROOT "/%s", uri);
+
+    retval = check_file_status(filepath);
+    if(retval != OK_STATUS)
+    {
+        return retval;
+    }
+
+    content_type = get_content_type(filepath);
+
+    // serve a precompressed sidecar when the client accepts one, never compress on the fly.
+    // a Content-Encoding would cover the whole multipart body rather than its parts, so several
+    // ranges are always cut from the original
+    if(is_compressible_type(content_type))
+    {
+        encoding = NULL;
+        if(!has_multiple_ranges(request))
+        {
+            encoding = select_precompressed(filepath, request, encoded_path, sizeof(encoded_path));
+        }
+
+        if(encoding)
+        {
+            retval = send_file_response(encoded_path, content_type, encoding, method, client_sock, request, ring);
+        }
+        else
+        {
+            retval = send_file_response(filepath, content_type, "identity", method, client_sock, request, ring);
+        }
+    }
+    else
+    {
+        retval = read_file(filepath, method, client_sock, request, ring);
+    }
+
+    if(retval == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int has_multiple_ranges(const char *request)
+{
+    char range_header[HEADER_VALUE_LEN];
+
+    return get_header_value(request, "Range", range_header, sizeof(range_header)) == 0 && strchr(range_header, ',') != NULL;
+}
+
+int is_compressible_type(const char *content_type)
+{
+    return strcmp(content_type, "text/html") == 0 || strcmp(content_type, "text/css") == 0 || strcmp(content_type, "application/javascript") == 0;
+}
+
+// q values have at most three decimals, keep them as thousandths to stay out of floating point
+static int parse_qvalue(const char *p)
+{
+    int value = 0;
+    int scale = QVALUE_MAX;
+
+    if(*p == '1')
+    {
+        return QVALUE_MAX;
+    }
+
+    if(*p != '0' || p[1] != '.')
+    {
+        return 0;
+    }
+
+    p += 2;
+    for(int i = 0; i < QVALUE_DIGITS && isdigit((unsigned char)p[i]); i++)
+    {
+        scale /= BASE;
+        value += (p[i] - '0') * scale;
+    }
+
+    return value;
+}
+
+// q value (in thousandths) the client gave to coding in Accept-Encoding, or to "*" when the coding is not listed
+int accepted_quality(const char *accept_encoding, const char *coding)
+{
+    const char *p        = accept_encoding;
+    size_t      len      = strlen(coding);
+    int         wildcard = 0;
+
+    while(*p != '\0')
+    {
+        const char *token;
+        size_t      token_len;
+        int         quality = QVALUE_MAX;
+
+        while(*p == ' ' || *p == '\t' || *p == ',')
+        {
+            p++;
+        }
+
+        token = p;
+        while(*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+        {
+            p++;
+        }
+        token_len = (size_t)(p - token);
+
+        // parameters, only q matters
+        while(*p != '\0' && *p != ',')
+        {
+            if((*p == 'q' || *p == 'Q') && p[1] == '=')
+            {
+                quality = parse_qvalue(p + 2);
+            }
+            p++;
+        }
+
+        if(token_len == len && strncasecmp(token, coding, len) == 0)
+        {
+            return quality;
+        }
+
+        if(token_len == 1 && *token == '*')
+        {
+            wildcard = quality;
+        }
+    }
+
+    return wildcard;
+}
+
+// pick the best precompressed sidecar of filepath the client accepts.
+// sidecars older than the original are stale and skipped.
+const char *select_precompressed(const char *filepath, const char *request, char *encoded_path, size_t max_len)
+{
+    // in order of server preference, used to break ties in q values
+    static const char *const codings[]    = {"br", "zstd", "gzip"};
+    static const char *const extensions[] = {".br", ".zst", ".gz"};
+    char                     accept_encoding[HEADER_VALUE_LEN];
+    struct stat              original_stat;
+    const char              *best_coding  = NULL;
+    int                      best_quality = 0;
+
+    if(get_header_value(request, "Accept-Encoding", accept_encoding, sizeof(accept_encoding)) != 0)
+    {
+        return NULL;
+    }
+
+    if(stat(filepath, &original_stat) == -1)
+    {
+        return NULL;
+    }
+
+    for(size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); i++)
+    {
+        struct stat sidecar_stat;
+        char        sidecar[BUFFER_SIZE];
+        int         quality = accepted_quality(accept_encoding, codings[i]);
+
+        if(quality <= best_quality)
+        {
+            continue;
+        }
+
+        snprintf(sidecar, sizeof(sidecar), "%s%s", filepath, extensions[i]);
+        if(stat(sidecar, &sidecar_stat) == -1 || !S_ISREG(sidecar_stat.st_mode) || sidecar_stat.st_mtime < original_stat.st_mtime)
+        {
+            continue;
+        }
+
+        snprintf(encoded_path, max_len, "%s", sidecar);
+        best_coding  = codings[i];
+        best_quality = quality;
+    }
+
+    return best_coding;
+}
+
+// check if requested resource is a directory using stat
+int is_directory(const char *filepath)
+{
+    struct stat file_stat;
 
-    char DATABASE[] = "/Users/developer/rm4/database.db";    // cppcheck-suppress constVariable
+    if(stat(filepath, &file_stat) == -1)
+    {
+        perror("stat");
+        return -1;
+    }
 
-    db = dbm_open(DATABASE, O_RDONLY, 0);
-    if(db == NULL)
+    if(S_ISDIR(file_stat.st_mode))
     {
-        perror("Error opening database");
-        return;
+        return 0;
     }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    key = dbm_firstkey(db);
-#pragma GCC diagnostic pop
-    while(key.dptr != NULL)
+    return -1;
+}
+
+// check if requested resource exists and has appropriate permission
+int check_file_status(char *filepath)
+{
+    struct stat file_stat;
+    int         status_code;
+
+    // printf("filepath: %s\n", filepath);
+
+    if(stat(filepath, &file_stat) == 0 && S_ISREG(file_stat.st_mode))
     {
-        datum value;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-        value = dbm_fetch(db, key);
-#pragma GCC diagnostic pop
+        if(access(filepath, R_OK) == 0)
+        {
+            status_code = OK_STATUS;
+        }
+        else
+        {
+            status_code = PERMISSION_DENIED;
+        }
+    }
+    else if(access(filepath, F_OK) == -1)
+    {
+        status_code = FILE_NOT_FOUND;
+    }
+    else
+    {
+        status_code = PERMISSION_DENIED;
+    }
 
-        printf("Key: ");
-        fwrite(key.dptr, 1, key.dsize, stdout);
-        printf(", Value: ");
-        fwrite(value.dptr, 1, value.dsize, stdout);
-        printf("\n");
+    printf("status: %d\n", status_code);
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-        key = dbm_nextkey(db);
-#pragma GCC diagnostic pop
+    return status_code;
+}
+
+int read_file(const char *filepath, const char *method, int client_socket, const char *request, struct uring *ring)
+{
+    return send_file_response(filepath, get_content_type(filepath), NULL, method, client_socket, request, ring);
+}
+
+// send filepath as the representation of a resource of content_type.
+// content_encoding names the coding of a precompressed sidecar, "identity" for the original of a
+// negotiable resource, or NULL when the resource has no encoded variants. ring is the caller's io_uring,
+// NULL to send with sendfile
+int send_file_response(const char *filepath, const char *content_type, const char *content_encoding, const char *method, int client_socket, const char *request, struct uring *ring)
+{
+    int               filefd;
+    struct stat       file_stat;
+    struct byte_range ranges[MAX_RANGES];
+    int               range_count = 0;
+    char              etag[HEADER_VALUE_LEN];
+    char              last_modified[TIME_BUFFER];
+    char              extra_headers[EXTRA_HEADERS_LEN];
+    char              range_header[HEADER_VALUE_LEN];
+    char              representation_headers[EXTRA_HEADERS_LEN];
+    int               retval;
+
+    filefd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if(filefd < 0)
+    {
+        perror("opening file");
+        return -1;
     }
 
-    dbm_close(db);
+    if(fstat(filefd, &file_stat) == -1)
+    {
+        perror("fstat");
+        close(filefd);
+        return -1;
+    }
+
+    format_validators(&file_stat, etag, sizeof(etag), last_modified);
+
+    // each encoding is its own representation, so it needs its own tag
+    if(content_encoding && strcmp(content_encoding, "identity") != 0)
+    {
+        size_t etag_len = strlen(etag);
+        snprintf(etag + etag_len - 1, sizeof(etag) - etag_len + 1, "-%s\"", content_encoding);
+    }
+
+    if(content_encoding == NULL)
+    {
+        snprintf(representation_headers, sizeof(representation_headers), "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n", etag, last_modified);
+    }
+    else if(strcmp(content_encoding, "identity") == 0)
+    {
+        snprintf(representation_headers, sizeof(representation_headers), "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n", etag, last_modified);
+    }
+    else
+    {
+        snprintf(representation_headers,
+                 sizeof(representation_headers),
+                 "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\nContent-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+                 etag,
+                 last_modified,
+                 content_encoding);
+    }
+
+    // ranges only apply to GET, and only while If-Range still matches the current file
+    if(strcmp(method, "GET") == 0 && get_header_value(request, "Range", range_header, sizeof(range_header)) == 0)
+    {
+        char if_range[HEADER_VALUE_LEN];
+
+        if(get_header_value(request, "If-Range", if_range, sizeof(if_range)) != 0 || if_range_matches(if_range, etag, last_modified))
+        {
+            range_count = parse_range_header(range_header, file_stat.st_size, ranges, MAX_RANGES);
+        }
+    }
+
+    if(range_count == -1)
+    {
+        snprintf(extra_headers, sizeof(extra_headers), "Content-Range: bytes */%lld\r\n", (long long)file_stat.st_size);
+        form_response_extra(client_socket, "416 Range Not Satisfiable", 0, "text/plain", extra_headers);
+        close(filefd);
+        return 0;
+    }
+
+    if(range_count == 1)
+    {
+        retval = send_partial_content(filefd, client_socket, &file_stat, &ranges[0], content_type, representation_headers);
+        close(filefd);
+        return retval;
+    }
+
+    if(range_count > 1)
+    {
+        retval = send_multipart_ranges(filefd, client_socket, &file_stat, ranges, range_count, content_type, representation_headers);
+        close(filefd);
+        return retval;
+    }
+
+    // header and body go out in one submission, files past the registered buffers stay on sendfile
+    // which does not copy them through user space
+    if(ring != NULL && strcmp(method, "GET") == 0 && file_stat.st_size <= (off_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE)
+    {
+        char   header[BUFFER_SIZE];
+        size_t header_len;
+        off_t  sent;
+
+        header_len = format_response_header(header, sizeof(header), "200 OK", file_stat.st_size, content_type, representation_headers);
+        printf("%s\n", header);
+        fflush(stdout);
+
+        sent   = uring_send_file(ring, client_socket, header, header_len, filefd, 0, file_stat.st_size);
+        retval = sent == -1 ? -1 : 0;
+        if(sent >= 0 && sent < file_stat.st_size)
+        {
+            retval = send_file_range(filefd, client_socket, sent, file_stat.st_size - sent);
+        }
+
+        close(filefd);
+        return retval;
+    }
+
+    // SUCCESS HEADER
+    form_response_extra(client_socket, "200 OK", file_stat.st_size, content_type, representation_headers);
+
+    if(strcmp(method, "HEAD") == 0)
+    {
+        close(filefd);
+        return 0;
+    }
+
+    retval = send_file_range(filefd, client_socket, 0, file_stat.st_size);
+
+    close(filefd);
+
+    return retval;
 }
 
-void get_http_date(struct tm *result)
+// strong validators for If-Range, the etag changes whenever size or mtime does
+void format_validators(const struct stat *file_stat, char *etag, size_t etag_len, char *last_modified)
 {
-    time_t now = time(NULL);
-    if(localtime_r(&now, result) == NULL)
+    struct tm tm_result;
+
+    snprintf(etag, etag_len, "\"%llx-%llx\"", (unsigned long long)file_stat->st_mtime, (unsigned long long)file_stat->st_size);
+
+    if(gmtime_r(&file_stat->st_mtime, &tm_result) == NULL)
     {
-        perror("localtime_r");
+        last_modified[0] = '\0';
+        return;
     }
+
+    format_time(tm_result, last_modified);
 }
 
-void format_time(struct tm tm_result, char *time_buffer)
+// If-Range holds either an entity tag or a date, weak tags never match
+int if_range_matches(const char *if_range, const char *etag, const char *last_modified)
 {
-    if(strftime(time_buffer, TIME_BUFFER, "%a, %d %b %Y %H:%M:%S GMT", &tm_result) == 0)
+    if(if_range[0] == '"')
     {
-        printf("could not format time");
+        return strcmp(if_range, etag) == 0;
     }
+
+    return last_modified[0] != '\0' && strcmp(if_range, last_modified) == 0;
 }
 
-const char *get_content_type(const char *filename)
+// copy the value of a request header into value, returns -1 if the header is not present
+int get_header_value(const char *request, const char *name, char *value, size_t max_len)
 {
-    const char *ext = strrchr(filename, '.');
-    if(!ext)
+    size_t      name_len = strlen(name);
+    const char *line     = strstr(request, "\r\n");
+
+    // headers end at the first blank line
+    while(line && strncmp(line, "\r\n\r\n", BLANK_LINE_OFFSET) != 0)
     {
-        return "application/octet-stream";
+        line += 2;
+
+        if(strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            const char *start = line + name_len + 1;
+            const char *end;
+            size_t      len;
+
+            while(*start == ' ' || *start == '\t')
+            {
+                start++;
+            }
+
+            end = strstr(start, "\r\n");
+            if(end == NULL)
+            {
+                end = start + strlen(start);
+            }
+
+            // drop trailing whitespace
+            while(end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            {
+                end--;
+            }
+
+            len = (size_t)(end - start);
+            if(len >= max_len)
+            {
+                return -1;
+            }
+
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 0;
+        }
+
+        line = strstr(line, "\r\n");
+    }
+
+    return -1;
+}
+
+static int parse_range_number(const char **cursor, off_t *result)
+{
+    const char *p     = *cursor;
+    off_t       value = 0;
+
+    if(!isdigit((unsigned char)*p))
+    {
+        return -1;
+    }
+
+    while(isdigit((unsigned char)*p))
+    {
+        // reject anything that would overflow off_t
+        if(value > (((off_t)1 << (sizeof(off_t) * 8 - 2)) / BASE))
+        {
+            return -1;
+        }
+        value = value * BASE + (*p - '0');
+        p++;
+    }
+
+    *cursor = p;
+    *result = value;
+    return 0;
+}
+
+// fills ranges with the satisfiable byte ranges of a Range header value.
+// returns the number of ranges, 0 if the header should be ignored (malformed or too many ranges)
+// and -1 if none of the ranges can be satisfied
+int parse_range_header(const char *range_header, off_t file_size, struct byte_range *ranges, int max_ranges)
+{
+    const char *p     = range_header;
+    int         count = 0;
+    int         specs = 0;
+
+    if(strncasecmp(p, "bytes=", RANGE_UNIT_OFFSET) != 0)
+    {
+        return 0;
+    }
+    p += RANGE_UNIT_OFFSET;
+
+    while(*p != '\0')
+    {
+        off_t start;
+        off_t end;
+
+        while(*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+
+        if(++specs > max_ranges)
+        {
+            return 0;
+        }
+
+        if(*p == '-')
+        {
+            // suffix range, the last n bytes
+            off_t suffix;
+            p++;
+            if(parse_range_number(&p, &suffix) == -1)
+            {
+                return 0;
+            }
+
+            start = suffix >= file_size ? 0 : file_size - suffix;
+            end   = file_size - 1;
+
+            if(suffix == 0)
+            {
+                start = file_size;
+            }
+        }
+        else
+        {
+            if(parse_range_number(&p, &start) == -1 || *p != '-')
+            {
+                return 0;
+            }
+            p++;
+
+            if(isdigit((unsigned char)*p))
+            {
+                if(parse_range_number(&p, &end) == -1 || end < start)
+                {
+                    return 0;
+                }
+            }
+            else
+            {
+                end = file_size - 1;
+            }
+
+            if(end >= file_size)
+            {
+                end = file_size - 1;
+            }
+        }
+
+        // skip ranges that start past the end of the file
+        if(start < file_size)
+        {
+            ranges[count].start = start;
+            ranges[count].end   = end;
+            count++;
+        }
+
+        while(*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+
+        if(*p == ',')
+        {
+            p++;
+        }
+        else if(*p != '\0')
+        {
+            return 0;
+        }
+    }
+
+    if(count == 0)
+    {
+        return -1;
     }
 
-    if(strcmp(ext, ".html") == 0)
+    return count;
+}
+
+int send_partial_content(int filefd, int client_socket, const struct stat *file_stat, const struct byte_range *range, const char *content_type, const char *representation_headers)
+{
+    char extra_headers[EXTRA_HEADERS_LEN + HEADER_VALUE_LEN];
+
+    snprintf(extra_headers,
+             sizeof(extra_headers),
+             "%s"
+             "Content-Range: bytes %lld-%lld/%lld\r\n",
+             representation_headers,
+             (long long)range->start,
+             (long long)range->end,
+             (long long)file_stat->st_size);
+
+    form_response_extra(client_socket, "206 Partial Content", range->end - range->start + 1, content_type, extra_headers);
+
+    return send_file_range(filefd, client_socket, range->start, range->end - range->start + 1);
+}
+
+static int format_part_header(char *part_header, size_t max_len, const char *boundary, const char *content_type, const struct byte_range *range, off_t file_size)
+{
+    return snprintf(part_header,
+                    max_len,
+                    "\r\n--%s\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    boundary,
+                    content_type,
+                    (long long)range->start,
+                    (long long)range->end,
+                    (long long)file_size);
+}
+
+int send_multipart_ranges(int filefd, int client_socket, const struct stat *file_stat, const struct byte_range *ranges, int range_count, const char *content_type, const char *representation_headers)
+{
+    char  boundary[BOUNDARY_LEN];
+    char  part_header[EXTRA_HEADERS_LEN];
+    char  closing[HEADER_VALUE_LEN];
+    char  content_type_header[HEADER_VALUE_LEN];
+    off_t content_length = 0;
+    int   closing_len;
+
+    snprintf(boundary, sizeof(boundary), "%llx%llx", (unsigned long long)file_stat->st_ino, (unsigned long long)time(NULL));
+
+    // the whole body length has to be known before the header goes out
+    for(int i = 0; i < range_count; i++)
     {
-        return "text/html";
+        content_length += format_part_header(part_header, sizeof(part_header), boundary, content_type, &ranges[i], file_stat->st_size);
+        content_length += ranges[i].end - ranges[i].start + 1;
     }
-    if(strcmp(ext, ".css") == 0)
+
+    closing_len = snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+    content_length += closing_len;
+
+    snprintf(content_type_header, sizeof(content_type_header), "multipart/byteranges; boundary=%s", boundary);
+    form_response_extra(client_socket, "206 Partial Content", content_length, content_type_header, representation_headers);
+
+    for(int i = 0; i < range_count; i++)
     {
-        return "text/css";
+        int part_len = format_part_header(part_header, sizeof(part_header), boundary, content_type, &ranges[i], file_stat->st_size);
+
+        if(write(client_socket, part_header, (size_t)part_len) != part_len)
+        {
+            return -1;
+        }
+
+        if(send_file_range(filefd, client_socket, ranges[i].start, ranges[i].end - ranges[i].start + 1) == -1)
+        {
+            return -1;
+        }
     }
-    if(strcmp(ext, ".js") == 0)
+
+    if(write(client_socket, closing, (size_t)closing_len) != closing_len)
     {
-        return "application/javascript";
+        return -1;
     }
-    if(strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+
+    return 0;
+}
+
+// send length bytes of filefd starting at offset without copying through user space where possible
+int send_file_range(int filefd, int client_socket, off_t offset, off_t length)
+{
+#if defined(__linux__)
+    while(length > 0)
     {
-        return "image/jpeg";
+        ssize_t sent = sendfile(client_socket, filefd, &offset, (size_t)length);
+        if(sent <= 0)
+        {
+            if(sent == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("sendfile");
+            return -1;
+        }
+        length -= sent;
     }
-    if(strcmp(ext, ".png") == 0)
+    return 0;
+#elif defined(__APPLE__)
+    while(length > 0)
     {
-        return "image/png";
+        off_t len = length;
+        if(sendfile(filefd, client_socket, offset, &len, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN)
+        {
+            perror("sendfile");
+            return -1;
+        }
+        if(len == 0)
+        {
+            return -1;
+        }
+        offset += len;
+        length -= len;
     }
-    if(strcmp(ext, ".gif") == 0)
+    return 0;
+#else
+    char file_buffer[BUFFER_SIZE];
+
+    while(length > 0)
     {
-        return "image/gif";
+        size_t  chunk      = length < (off_t)sizeof(file_buffer) ? (size_t)length : sizeof(file_buffer);
+        ssize_t bytes_read = pread(filefd, file_buffer, chunk, offset);
+        if(bytes_read <= 0)
+        {
+            return -1;
+        }
+        if(write(client_socket, file_buffer, (size_t)bytes_read) != bytes_read)
+        {
+            return -1;
+        }
+        offset += bytes_read;
+        length -= bytes_read;
     }
-    if(strcmp(ext, ".swf") == 0)
+    return 0;
+#endif
+}
+
+// returns content length of file
+int get_file_size(const char *filepath)
+{
+    struct stat file_stat;
+
+    if(stat(filepath, &file_stat) == 0)
     {
-        return "application/x-shockwave-flash";
+        return (int)file_stat.st_size;
     }
 
-    return "application/octet-stream";
+    perror("stat");
+    return -1;
 }
 
-int check_http_format(const char *version, const char *uri)
+// response writer for bodies whose length is not known up front.
+// output is buffered and sent as one chunk whenever it would pass the high watermark,
+// so memory stays at CHUNK_BUFFER_SIZE no matter how much is written.
+void chunk_writer_begin(struct chunk_writer *writer, int client_sock, const char *status, const char *content_type)
 {
-    // verify version
-    if(strcmp(version, "HTTP/1.1") != 0)
+    struct tm tm_result;
+    char      timestamp[TIME_BUFFER];
+    int       header_len;
+
+    get_http_date(&tm_result);
+    format_time(tm_result, timestamp);
+
+    writer->client_sock = client_sock;
+    writer->len         = 0;
+    writer->error       = 0;
+
+    // chunked encoding only exists in HTTP/1.1
+    header_len = snprintf(writer->header,
+                          sizeof(writer->header),
+                          "HTTP/1.1 %s\r\n"
+                          "Server: HTTPServer/1.0\r\n"
+                          "Date: %s\r\n"
+                          "Connection: close\r\n"
+                          "Transfer-Encoding: chunked\r\n"
+                          "Content-Type: %s\r\n\r\n",
+                          status,
+                          timestamp,
+                          content_type);
+
+    writer->header_len = header_len < (int)sizeof(writer->header) ? (size_t)header_len : sizeof(writer->header) - 1;
+}
+
+// send the buffered bytes plus data as one chunk, the header goes out with the first chunk
+static int chunk_writer_emit(struct chunk_writer *writer, const char *data, size_t data_len, int last)
+{
+    struct iovec iov[CHUNK_IOV_MAX];
+    int          iovcnt = 0;
+    char         size_line[CHUNK_SIZE_LEN];
+    size_t       chunk_len = writer->len + data_len;
+
+    if(writer->error)
     {
-        printf("not correct version\n");
         return -1;
     }
 
-    // verify uri
-    if(strstr(uri, "..") != NULL)
+    if(writer->header_len > 0)
     {
-        printf("invalid uri\n");
-        return -1;
+        iov[iovcnt].iov_base = writer->header;
+        iov[iovcnt].iov_len  = writer->header_len;
+        iovcnt++;
     }
 
-    return 0;
-}
+    if(chunk_len > 0)
+    {
+        int size_len         = snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk_len);
+        iov[iovcnt].iov_base = size_line;
+        iov[iovcnt].iov_len  = (size_t)size_len;
+        iovcnt++;
 
-void handle_check_format_error(const char *method, int client_sock)
-{
-    const char *error_message = "<html><body><h1>400 Bad Request</h1></body></html>";
+        if(writer->len > 0)
+        {
+            iov[iovcnt].iov_base = writer->buffer;
+            iov[iovcnt].iov_len  = writer->len;
+            iovcnt++;
+        }
 
-    if(strcmp(method, "GET") == 0)
+        if(data_len > 0)
+        {
+            iov[iovcnt].iov_base = (void *)(uintptr_t)data;
+            iov[iovcnt].iov_len  = data_len;
+            iovcnt++;
+        }
+
+        iov[iovcnt].iov_base = (void *)(uintptr_t) "\r\n";
+        iov[iovcnt].iov_len  = 2;
+        iovcnt++;
+    }
+
+    if(last)
     {
-        form_response(client_sock, "400 Bad Request", (int)strlen(error_message), "text/html");
-        write(client_sock, error_message, strlen(error_message));
+        iov[iovcnt].iov_base = (void *)(uintptr_t) "0\r\n\r\n";
+        iov[iovcnt].iov_len  = CHUNK_TERMINATOR_LEN;
+        iovcnt++;
     }
-    else if(strcmp(method, "HEAD") == 0)
+
+    writer->header_len = 0;
+    writer->len        = 0;
+
+    if(iovcnt > 0 && write_iov_all(writer->client_sock, iov, iovcnt) == -1)
     {
-        form_response(client_sock, "400 Bad Request", (int)strlen(error_message), "text/html");
+        writer->error = 1;
+        return -1;
     }
+
+    return 0;
 }
 
-void handle_file_serve_error(const char *method, int retval, int client_sock)
+int chunk_writer_write(struct chunk_writer *writer, const char *data, size_t len)
 {
-    if(retval == FILE_NOT_FOUND)
+    if(writer->error)
     {
-        handle_file_not_found(method, client_sock);
+        return -1;
     }
 
-    if(retval == PERMISSION_DENIED)
+    // past the watermark, send what is buffered together with data instead of copying it
+    if(writer->len + len > CHUNK_HIGH_WATERMARK)
     {
-        handle_forbidden(method, client_sock);
+        return chunk_writer_emit(writer, data, len, 0);
     }
+
+    memcpy(writer->buffer + writer->len, data, len);
+    writer->len += len;
+
+    return 0;
 }
 
-void handle_verify_method_error(int client_sock)
+int chunk_writer_puts(struct chunk_writer *writer, const char *str)
 {
-    const char *error_message = "<html><body><h1>405 Method Not Allowed</h1></body></html>";
-    form_response(client_sock, "405 Method Not Allowed", (int)strlen(error_message), "text/html");
-    write(client_sock, error_message, strlen(error_message));
+    return chunk_writer_write(writer, str, strlen(str));
 }
 
-void handle_file_not_found(const char *method, int client_sock)
+// write data as the inside of a json string, escaping quotes, backslashes and control bytes
+int chunk_writer_write_json(struct chunk_writer *writer, const char *data, size_t len)
 {
-    const char *error_message = "<html><body><h1>404 Not Found</h1></body></html>";
+    size_t run_start = 0;
 
-    if(strcmp(method, "GET") == 0)
+    for(size_t i = 0; i < len; i++)
     {
-        form_response(client_sock, "404 Not Found", (int)strlen(error_message), "text/html");
-        write(client_sock, error_message, strlen(error_message));
+        unsigned char c = (unsigned char)data[i];
+        char          escaped[JSON_ESCAPE_LEN];
+
+        if(c != '"' && c != '\\' && c >= ' ')
+        {
+            continue;
+        }
+
+        // write the unescaped run before this byte
+        if(chunk_writer_write(writer, data + run_start, i - run_start) == -1)
+        {
+            return -1;
+        }
+
+        if(c == '"' || c == '\\')
+        {
+            escaped[0] = '\\';
+            escaped[1] = (char)c;
+            escaped[2] = '\0';
+        }
+        else
+        {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        }
+
+        if(chunk_writer_puts(writer, escaped) == -1)
+        {
+            return -1;
+        }
+
+        run_start = i + 1;
     }
-    else if(strcmp(method, "HEAD") == 0)
+
+    return chunk_writer_write(writer, data + run_start, len - run_start);
+}
+
+int chunk_writer_flush(struct chunk_writer *writer)
+{
+    if(writer->len == 0 && writer->header_len == 0)
     {
-        form_response(client_sock, "404 Not Found", (int)strlen(error_message), "text/html");
+        return writer->error ? -1 : 0;
     }
+
+    return chunk_writer_emit(writer, NULL, 0, 0);
 }
 
-void handle_forbidden(const char *method, int client_sock)
+// finish the response with the zero length chunk. headers_only is for HEAD, where no body is sent at all
+int chunk_writer_end(struct chunk_writer *writer, int headers_only)
 {
-    const char *error_message = "<html><body><h1>403 Forbidden</h1></body></html>";
-
-    if(strcmp(method, "GET") == 0)
+    if(headers_only)
     {
-        form_response(client_sock, "403 Forbidden", (int)strlen(error_message), "text/html");
-        write(client_sock, error_message, strlen(error_message));
+        writer->len = 0;
+        return chunk_writer_flush(writer);
     }
-    else if(strcmp(method, "HEAD") == 0)
+
+    return chunk_writer_emit(writer, NULL, 0, 1);
+}
+
+// writev that keeps going after partial writes
+static int write_iov_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while(iovcnt > 0)
     {
-        form_response(client_sock, "403 Forbidden", (int)strlen(error_message), "text/html");
+        ssize_t written = writev(fd, iov, iovcnt);
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("writev");
+            return -1;
+        }
+
+        // skip the buffers that were sent completely
+        while(iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
     }
+
+    return 0;
 }
 
-int serve_file(const char *uri, const char *method, int client_sock)
+// find the first '%' or '+' in str, or len if there is none.
+// long runs without escapes are the common case, so scan 16 bytes at a time where the cpu allows it
+size_t find_escape(const char *str, size_t len)
 {
-    char filepath[BUFFER_SIZE];
-    int  retval;
+    size_t i = 0;
 
-    snprintf(filepath, sizeof(filepath), "/Users/developer/rm4/public/%s", uri);
+#if defined(__SSE2__)
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus    = _mm_set1_epi8('+');
 
-    retval = check_file_status(filepath);
-    if(retval != OK_STATUS)
+    for(; i + SIMD_WIDTH <= len; i += SIMD_WIDTH)
     {
-        return retval;
+        __m128i chunk;
+        int     mask;
+
+        memcpy(&chunk, str + i, SIMD_WIDTH);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent), _mm_cmpeq_epi8(chunk, plus)));
+        if(mask != 0)
+        {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
     }
+#elif defined(__ARM_NEON)
+    const uint8x16_t percent = vdupq_n_u8('%');
+    const uint8x16_t plus    = vdupq_n_u8('+');
 
-    retval = read_file(filepath, method, client_sock);
+    for(; i + SIMD_WIDTH <= len; i += SIMD_WIDTH)
     {
-        if(retval == -1)
+        uint8x16_t chunk;
+
+        memcpy(&chunk, str + i, SIMD_WIDTH);
+        if(vmaxvq_u8(vorrq_u8(vceqq_u8(chunk, percent), vceqq_u8(chunk, plus))) != 0)
         {
-            return -1;
+            break;
         }
     }
+#endif
 
-    return 0;
+    for(; i < len; i++)
+    {
+        if(str[i] == '%' || str[i] == '+')
+        {
+            return i;
+        }
+    }
+
+    return len;
 }
 
-// check if requested resource is a directory using stat
-int is_directory(const char *filepath)
+static int hex_value(char c)
 {
-    struct stat file_stat;
-
-    if(stat(filepath, &file_stat) == -1)
+    if(c >= '0' && c <= '9')
     {
-        perror("stat");
-        return -1;
+        return c - '0';
     }
-
-    if(S_ISDIR(file_stat.st_mode))
+    if(c >= 'a' && c <= 'f')
     {
-        return 0;
+        return c - 'a' + HEX_ALPHA_OFFSET;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + HEX_ALPHA_OFFSET;
     }
-
     return -1;
 }
 
-// check if requested resource exists and has appropriate permission
-int check_file_status(char *filepath)
+// decode %XX escapes and '+' in place, returns the decoded length and terminates str there.
+// malformed escapes are kept as they are
+size_t percent_decode(char *str, size_t len)
 {
-    struct stat file_stat;
-    int         status_code;
-
-    // printf("filepath: %s\n", filepath);
+    size_t read_pos  = find_escape(str, len);
+    size_t write_pos = read_pos;
 
-    if(stat(filepath, &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    while(read_pos < len)
     {
-        if(access(filepath, R_OK) == 0)
+        size_t run;
+
+        if(str[read_pos] == '+')
         {
-            status_code = OK_STATUS;
+            str[write_pos++] = ' ';
+            read_pos++;
+        }
+        else if(read_pos + 2 < len && hex_value(str[read_pos + 1]) >= 0 && hex_value(str[read_pos + 2]) >= 0)
+        {
+            str[write_pos++] = (char)((hex_value(str[read_pos + 1]) << HEX_SHIFT) | hex_value(str[read_pos + 2]));
+            read_pos += PERCENT_ESCAPE_LEN;
         }
         else
         {
-            status_code = PERMISSION_DENIED;
+            str[write_pos++] = str[read_pos++];
         }
-    }
-    else if(access(filepath, F_OK) == -1)
-    {
-        status_code = FILE_NOT_FOUND;
-    }
-    else
-    {
-        status_code = PERMISSION_DENIED;
+
+        // move the plain run up to the next escape in one go
+        run = find_escape(str + read_pos, len - read_pos);
+        memmove(str + write_pos, str + read_pos, run);
+        write_pos += run;
+        read_pos += run;
     }
 
-    printf("status: %d\n", status_code);
+    str[write_pos] = '\0';
 
-    return status_code;
+    return write_pos;
 }
 
-int read_file(const char *filepath, const char *method, int client_socket)
+// split a query string into name/value pairs, decoding both in place.
+// anything from a '#' on is a fragment and ignored. returns the number of pairs found
+int parse_query(char *query, struct query_param *params, int max_params)
 {
-    int     filefd;
-    char    file_buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+    char *p     = query;
+    int   count = 0;
+    char *fragment;
 
-    // SUCCESS HEADER
-    if(strcmp(method, "GET") == 0)
-    {
-        form_response(client_socket, "200 OK", get_file_size(filepath), get_content_type(filepath));
-    }
-    else if(strcmp(method, "HEAD") == 0)
+    fragment = strchr(query, '#');
+    if(fragment)
     {
-        form_response(client_socket, "200 OK", get_file_size(filepath), get_content_type(filepath));
-        return 0;
+        *fragment = '\0';
     }
 
-    filefd = open(filepath, O_RDONLY | O_CLOEXEC);
-    if(filefd < 0)
+    while(*p != '\0' && count < max_params)
     {
-        perror("opening file");
-        return -1;
+        size_t pair_len = strcspn(p, "&;");
+        char  *next     = p[pair_len] == '\0' ? p + pair_len : p + pair_len + 1;
+        char  *equals;
+
+        p[pair_len] = '\0';
+
+        // empty pairs from "a=1&&b=2" are skipped
+        if(pair_len > 0)
+        {
+            equals = (char *)memchr(p, '=', pair_len);
+            if(equals)
+            {
+                *equals                  = '\0';
+                params[count].name       = p;
+                params[count].name_len   = percent_decode(p, (size_t)(equals - p));
+                params[count].value      = equals + 1;
+                params[count].value_len  = percent_decode(equals + 1, pair_len - (size_t)(equals - p) - 1);
+            }
+            else
+            {
+                params[count].name      = p;
+                params[count].name_len  = percent_decode(p, pair_len);
+                params[count].value     = p + params[count].name_len;
+                params[count].value_len = 0;
+            }
+            count++;
+        }
+
+        p = next;
     }
 
-    while((bytes_read = read(filefd, file_buffer, sizeof(file_buffer))) > 0)
+    return count;
+}
+
+// value of the first parameter called name, NULL if there is none
+const char *find_query_param(const struct query_param *params, int count, const char *name)
+{
+    for(int i = 0; i < count; i++)
     {
-        write(client_socket, file_buffer, (size_t)bytes_read);
+        if(strcmp(params[i].name, name) == 0)
+        {
+            return params[i].value;
+        }
     }
 
-    close(filefd);
-
-    return 0;
+    return NULL;
 }
 
-// returns content length of file
-int get_file_size(const char *filepath)
+// run by the monitor in a throwaway process before a new build is handed to the workers.
+// returns 0 when the prerendered responses were built and request parsing behaves
+int handler_self_test(void)
 {
-    struct stat file_stat;
+    char               query[] = "key=a%20b+c&x";
+    struct query_param params[2];
+    const char        *key;
 
-    if(stat(filepath, &file_stat) == 0)
+    for(int i = 0; i < ERROR_RESPONSE_COUNT; i++)
     {
-        return (int)file_stat.st_size;
+        if(error_responses[i].total_len == 0 || strncmp(error_responses[i].data, "HTTP/1.0 ", strlen("HTTP/1.0 ")) != 0)
+        {
+            return -1;
+        }
     }
 
-    perror("stat");
-    return -1;
+    if(parse_query(query, params, 2) != 2)
+    {
+        return -1;
+    }
+
+    key = find_query_param(params, 2, "key");
+    if(key == NULL || strcmp(key, "a b c") != 0)
+    {
+        return -1;
+    }
+
+    return 0;
 }
@@ -0,0 +1,345 @@
+#include "../include/threadpool.h"
+#include "../include/metrics.h"
+#include "../include/network.h"
+#include "../include/scoreboard.h"
+#include "../include/trace.h"
+#include "../include/uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECV_BATCH 8
+#define IDLE_POLL_MS 100
+
+static void *pool_thread_main(void *arg);
+static int   deque_push(struct conn_deque *deque, const struct queued_conn *conn);
+static int   deque_pop(struct conn_deque *deque, struct queued_conn *conn);
+static int   deque_steal(struct conn_deque *deque, struct queued_conn *conn);
+static int   steal_work(struct thread_pool *tp, int thief, struct queued_conn *conn);
+static int   receive_batch(struct pool_thread *self, struct queued_conn *conn);
+static void  wait_for_work(struct thread_pool *tp);
+static void  serve_conn(struct pool_thread *self, const struct queued_conn *conn);
+
+int thread_pool_start(struct thread_pool *tp, int threads, int domain_socket, sem_t *semaphore, struct pool_shared *pool, int slot_index, const struct deadlines *deadlines, SSL_CTX *tls, int (*handler)(int, struct handler_ctx *))
+{
+    memset(tp, 0, sizeof(*tp));
+    tp->domain_socket = domain_socket;
+    tp->threads       = threads;
+    tp->pool          = pool;
+    tp->slot          = &pool->slots[slot_index];
+    tp->slot_index    = slot_index;
+    tp->handler       = handler;
+    tp->tls           = tls;
+    atomic_store(&tp->stop, 0);
+    pthread_mutex_init(&tp->pause_lock, NULL);
+    pthread_cond_init(&tp->pause_cond, NULL);
+
+    if(pipe(tp->wake) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    set_socket_nonblock(tp->wake[0]);
+    set_socket_nonblock(tp->wake[1]);
+
+    // the per thread handler context is large, keep it off the thread stacks
+    tp->members = (struct pool_thread *)calloc((size_t)threads, sizeof(struct pool_thread));
+    if(tp->members == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    for(int i = 0; i < threads; i++)
+    {
+        struct pool_thread *member = &tp->members[i];
+
+        member->tp      = tp;
+        member->index   = i;
+        member->ctx.sem               = semaphore;
+        member->ctx.uring             = uring_create(deadlines->write_ms);
+        member->ctx.header_timeout_ms = deadlines->header_ms;
+        member->ctx.pool              = pool;
+        member->ctx.metrics           = &pool->metrics->workers[slot_index];
+        member->ctx.scoreboard        = &pool->scoreboard->workers[slot_index].thread[i];
+        member->ctx.arena             = &member->arena;
+        member->ctx.peer_sock         = -1;
+        if(arena_init(&member->arena, HANDLER_ARENA_SIZE) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&member->deque.lock, NULL);
+
+        if(pthread_create(&member->thread, NULL, pool_thread_main, member) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return 0;
+}
+
+// returns once no thread is inside the handler, new connections wait until the pool is resumed
+void thread_pool_pause(struct thread_pool *tp)
+{
+    pthread_mutex_lock(&tp->pause_lock);
+    tp->paused = 1;
+    while(tp->active > 0)
+    {
+        pthread_cond_wait(&tp->pause_cond, &tp->pause_lock);
+    }
+    pthread_mutex_unlock(&tp->pause_lock);
+}
+
+void thread_pool_resume(struct thread_pool *tp, int (*handler)(int, struct handler_ctx *))
+{
+    pthread_mutex_lock(&tp->pause_lock);
+    tp->handler = handler;
+    tp->paused  = 0;
+    pthread_cond_broadcast(&tp->pause_cond);
+    pthread_mutex_unlock(&tp->pause_lock);
+}
+
+// every thread serves what is left in its deque before it exits
+void thread_pool_stop(struct thread_pool *tp)
+{
+    atomic_store(&tp->stop, 1);
+
+    for(int i = 0; i < tp->threads; i++)
+    {
+        pthread_join(tp->members[i].thread, NULL);
+        pthread_mutex_destroy(&tp->members[i].deque.lock);
+        uring_destroy(tp->members[i].ctx.uring);
+        arena_destroy(&tp->members[i].arena);
+    }
+
+    free(tp->members);
+    close(tp->wake[0]);
+    close(tp->wake[1]);
+    pthread_cond_destroy(&tp->pause_cond);
+    pthread_mutex_destroy(&tp->pause_lock);
+}
+
+// own deque first, then other threads' deques, then the dispatcher
+static void *pool_thread_main(void *arg)
+{
+    struct pool_thread *self = (struct pool_thread *)arg;
+    struct thread_pool *tp   = self->tp;
+    struct queued_conn  conn;
+
+    while(!atomic_load(&tp->stop))
+    {
+        if(deque_pop(&self->deque, &conn) || steal_work(tp, self->index, &conn) || receive_batch(self, &conn))
+        {
+            serve_conn(self, &conn);
+            continue;
+        }
+
+        wait_for_work(tp);
+    }
+
+    while(deque_pop(&self->deque, &conn))
+    {
+        serve_conn(self, &conn);
+    }
+
+    return NULL;
+}
+
+static int deque_push(struct conn_deque *deque, const struct queued_conn *conn)
+{
+    int pushed = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail - deque->head < THREAD_DEQUE_CAPACITY)
+    {
+        deque->items[deque->tail % THREAD_DEQUE_CAPACITY] = *conn;
+        deque->tail++;
+        pushed = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return pushed;
+}
+
+static int deque_pop(struct conn_deque *deque, struct queued_conn *conn)
+{
+    int popped = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail != deque->head)
+    {
+        deque->tail--;
+        *conn  = deque->items[deque->tail % THREAD_DEQUE_CAPACITY];
+        popped = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return popped;
+}
+
+static int deque_steal(struct conn_deque *deque, struct queued_conn *conn)
+{
+    int stolen = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail != deque->head)
+    {
+        *conn = deque->items[deque->head % THREAD_DEQUE_CAPACITY];
+        deque->head++;
+        stolen = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return stolen;
+}
+
+// victims are tried starting from the next thread so thieves do not all hit the same deque
+static int steal_work(struct thread_pool *tp, int thief, struct queued_conn *conn)
+{
+    for(int i = 1; i < tp->threads; i++)
+    {
+        if(deque_steal(&tp->members[(thief + i) % tp->threads].deque, conn))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// take whatever the dispatcher has queued, up to a batch. the first connection is served right away,
+// the rest go to this thread's deque and idle threads are woken to steal them
+static int receive_batch(struct pool_thread *self, struct queued_conn *conn)
+{
+    struct thread_pool *tp     = self->tp;
+    int                 queued = 0;
+    int                 received;
+
+    for(received = 0; received < RECV_BATCH; received++)
+    {
+        struct queued_conn next;
+
+        next.client_fd = recv_fd(tp->domain_socket, &next.handoff);
+        if(next.client_fd < 0)
+        {
+            break;
+        }
+        next.received_ns = monotonic_ns();
+
+        atomic_fetch_add(&tp->pool->picked_up, 1);
+
+        if(received == 0)
+        {
+            *conn = next;
+        }
+        else if(deque_push(&self->deque, &next))
+        {
+            queued++;
+        }
+        else
+        {
+            // deque full, keep it and stop taking more
+            serve_conn(self, &next);
+            break;
+        }
+    }
+
+    for(int i = 0; i < queued && i < tp->threads - 1; i++)
+    {
+        char byte = 0;
+
+        write(tp->wake[1], &byte, 1);
+    }
+
+    return received > 0;
+}
+
+// sleeps until the dispatcher sends a connection or another thread queued some to steal.
+// the timeout only bounds how long a stop request can go unnoticed
+static void wait_for_work(struct thread_pool *tp)
+{
+    struct pollfd pfds[2];
+
+    pfds[0].fd      = tp->domain_socket;
+    pfds[0].events  = POLLIN;
+    pfds[0].revents = 0;
+    pfds[1].fd      = tp->wake[0];
+    pfds[1].events  = POLLIN;
+    pfds[1].revents = 0;
+
+    if(poll(pfds, 2, IDLE_POLL_MS) > 0 && (pfds[1].revents & POLLIN))
+    {
+        char byte;
+
+        read(tp->wake[0], &byte, 1);
+    }
+}
+
+static void serve_conn(struct pool_thread *self, const struct queued_conn *conn)
+{
+    struct thread_pool *tp = self->tp;
+    int (*handler)(int, struct handler_ctx *);
+    uint64_t start;
+    uint64_t handled;
+    uint64_t end;
+    int      status;
+
+    pthread_mutex_lock(&tp->pause_lock);
+    while(tp->paused)
+    {
+        pthread_cond_wait(&tp->pause_cond, &tp->pause_lock);
+    }
+    tp->active++;
+    handler = tp->handler;
+    pthread_mutex_unlock(&tp->pause_lock);
+
+    // time spent waiting in a deque to be stolen counts as handoff
+    start = monotonic_ns();
+    metrics_record(self->ctx.metrics, STAGE_QUEUE, conn->handoff.sent_ns - conn->handoff.accepted_ns);
+    metrics_record(self->ctx.metrics, STAGE_HANDOFF, start - conn->handoff.sent_ns);
+
+    self->ctx.peer_sock = conn->client_fd;
+    status              = tp->tls ? tls_serve(tp->tls, conn->client_fd, handler, &self->ctx) : handler(conn->client_fd, &self->ctx);
+    handled             = monotonic_ns();
+    if(self->ctx.timeout != TIMEOUT_NONE)
+    {
+        atomic_fetch_add(&tp->pool->timeouts[self->ctx.timeout], 1);
+    }
+    metrics_record_version(tp->pool, tp->slot, handled - start, status != 0 || self->ctx.timeout != TIMEOUT_NONE);
+    scoreboard_done(self->ctx.scoreboard, conn->client_fd);
+
+    if(conn->handoff.traced)
+    {
+        struct trace_times times;
+
+        times.received_ns = conn->received_ns;
+        times.started_ns  = start;
+        times.parsed_ns   = self->ctx.parsed_ns;
+        times.handled_ns  = handled;
+        trace_worker(tp->pool->trace, &conn->handoff, self->index, &times);
+    }
+
+    // every thread of the process pushes to the same ring, it takes several producers
+    pool_complete(tp->pool, tp->slot_index, conn->handoff.original_fd);
+    close(conn->client_fd);
+
+    // the autoscaler reads busy time per process, one busy thread of n counts as 1/n
+    end = monotonic_ns();
+    metrics_record(self->ctx.metrics, STAGE_TOTAL, end - conn->handoff.accepted_ns);
+    atomic_fetch_add(&tp->slot->busy_ns, (end - start) / (uint64_t)tp->threads);
+    atomic_fetch_add(&tp->slot->served, 1);
+
+    pthread_mutex_lock(&tp->pause_lock);
+    tp->active--;
+    if(tp->paused && tp->active == 0)
+    {
+        pthread_cond_broadcast(&tp->pause_cond);
+    }
+    pthread_mutex_unlock(&tp->pause_lock);
+}
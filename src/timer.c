@@ -0,0 +1,230 @@
+#include "../include/timer.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TIMER_TICK_NS 10000000ULL
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_INITIAL_CAPACITY 256
+
+static void timer_link(struct timer_wheel *wheel, int id);
+static void timer_unlink(struct timer_wheel *wheel, int id);
+static void timer_cascade(struct timer_wheel *wheel, int level);
+
+int timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns)
+{
+    wheel->now      = now_ns / TIMER_TICK_NS;
+    wheel->armed    = 0;
+    wheel->capacity = 0;
+    wheel->nodes    = NULL;
+
+    for(int i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++)
+    {
+        wheel->heads[i] = -1;
+    }
+
+    return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    free(wheel->nodes);
+    wheel->nodes    = NULL;
+    wheel->capacity = 0;
+    wheel->armed    = 0;
+}
+
+// re-arming an armed id moves it, deadlines already past fire on the next advance
+int timer_wheel_arm(struct timer_wheel *wheel, int id, uint64_t deadline_ns, int kind)
+{
+    uint64_t expires = deadline_ns / TIMER_TICK_NS;
+
+    if(id >= wheel->capacity)
+    {
+        int                capacity = wheel->capacity ? wheel->capacity : TIMER_INITIAL_CAPACITY;
+        struct timer_node *nodes;
+
+        while(capacity <= id)
+        {
+            capacity *= 2;
+        }
+
+        nodes = (struct timer_node *)realloc(wheel->nodes, (size_t)capacity * sizeof(struct timer_node));
+        if(nodes == NULL)
+        {
+            perror("realloc timers");
+            return -1;
+        }
+
+        for(int i = wheel->capacity; i < capacity; i++)
+        {
+            nodes[i].slot = -1;
+        }
+        wheel->nodes    = nodes;
+        wheel->capacity = capacity;
+    }
+
+    if(wheel->nodes[id].slot != -1)
+    {
+        timer_unlink(wheel, id);
+    }
+
+    wheel->nodes[id].expires = expires > wheel->now ? expires : wheel->now + 1;
+    wheel->nodes[id].kind    = kind;
+    timer_link(wheel, id);
+
+    return 0;
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, int id)
+{
+    if(id >= 0 && id < wheel->capacity && wheel->nodes[id].slot != -1)
+    {
+        timer_unlink(wheel, id);
+    }
+}
+
+// fires every deadline up to now_ns. expired may arm or cancel any id, including the one it got
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns, void (*expired)(void *arg, int id, int kind), void *arg)
+{
+    uint64_t target = now_ns / TIMER_TICK_NS;
+
+    // nothing to find on the way, skip straight there
+    if(wheel->armed == 0 && target > wheel->now)
+    {
+        wheel->now = target;
+        return;
+    }
+
+    while(wheel->now < target)
+    {
+        int bucket;
+
+        wheel->now++;
+
+        // each level rolls over into the one below when its own index wraps to 0
+        for(int level = 1; level < TIMER_LEVELS; level++)
+        {
+            if((wheel->now & (((uint64_t)1 << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            timer_cascade(wheel, level);
+        }
+
+        bucket = (int)(wheel->now & TIMER_SLOT_MASK);
+        while(wheel->heads[bucket] != -1)
+        {
+            int id = wheel->heads[bucket];
+
+            timer_unlink(wheel, id);
+            expired(arg, id, wheel->nodes[id].kind);
+        }
+    }
+}
+
+// how long a poll can sleep before the next deadline is due, capped at max_ms
+int timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ns, int max_ms)
+{
+    uint64_t next;
+    uint64_t wait_ns;
+    uint64_t wait_ms;
+
+    if(wheel->armed == 0)
+    {
+        return max_ms;
+    }
+
+    // the next non empty bucket on level 0, or the next cascade when level 0 is empty
+    next = (wheel->now | TIMER_SLOT_MASK) + 1;
+    for(uint64_t tick = wheel->now + 1; tick < next; tick++)
+    {
+        if(wheel->heads[tick & TIMER_SLOT_MASK] != -1)
+        {
+            next = tick;
+            break;
+        }
+    }
+
+    if(next * TIMER_TICK_NS <= now_ns)
+    {
+        return 0;
+    }
+
+    // rounded up, waking early would only spin until the tick is reached
+    wait_ns = next * TIMER_TICK_NS - now_ns;
+    wait_ms = (wait_ns + NS_PER_MS - 1) / NS_PER_MS;
+
+    return wait_ms < (uint64_t)max_ms ? (int)wait_ms : max_ms;
+}
+
+// a node goes to the lowest level whose range still reaches its deadline, deadlines beyond the top
+// level wait in its last bucket and are placed again when it cascades
+static void timer_link(struct timer_wheel *wheel, int id)
+{
+    struct timer_node *node    = &wheel->nodes[id];
+    uint64_t           expires = node->expires;
+    uint64_t           delta   = expires - wheel->now;
+    int                level   = 0;
+    int                slot;
+
+    while(level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    if(delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+    {
+        expires = wheel->now + ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    slot = level * TIMER_SLOTS + (int)((expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+
+    node->slot = slot;
+    node->prev = -1;
+    node->next = wheel->heads[slot];
+    if(node->next != -1)
+    {
+        wheel->nodes[node->next].prev = id;
+    }
+    wheel->heads[slot] = id;
+    wheel->armed++;
+}
+
+static void timer_unlink(struct timer_wheel *wheel, int id)
+{
+    struct timer_node *node = &wheel->nodes[id];
+
+    if(node->prev != -1)
+    {
+        wheel->nodes[node->prev].next = node->next;
+    }
+    else
+    {
+        wheel->heads[node->slot] = node->next;
+    }
+
+    if(node->next != -1)
+    {
+        wheel->nodes[node->next].prev = node->prev;
+    }
+
+    node->slot = -1;
+    wheel->armed--;
+}
+
+// the bucket of this level that has just come up is placed again, relative to the new time
+static void timer_cascade(struct timer_wheel *wheel, int level)
+{
+    int slot = level * TIMER_SLOTS + (int)((wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK);
+    int id   = wheel->heads[slot];
+
+    wheel->heads[slot] = -1;
+    while(id != -1)
+    {
+        int next = wheel->nodes[id].next;
+
+        wheel->armed--;
+        timer_link(wheel, id);
+        id = next;
+    }
+}
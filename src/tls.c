@@ -0,0 +1,305 @@
+#include "../include/tls.h"
+#include "../include/network.h"
+#include <errno.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+static long  remaining_ms(const struct timespec *deadline);
+static int   start_relay(struct tls_conn *conn, int timeout_ms);
+static void *relay_main(void *arg);
+static int   write_all(int fd, const char *data, size_t len);
+
+static atomic_int relay_reported = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// the context is set up once before the workers fork and shared by all of them, so session tickets
+// issued by one worker are good in every other. for a local test:
+//   openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost -keyout key.pem -out cert.pem
+//   curl -k https://localhost:8000/
+SSL_CTX *tls_create_context(const char *cert_path, const char *key_path)
+{
+    SSL_CTX *context;
+
+    context = SSL_CTX_new(TLS_server_method());
+    if(context == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+#if defined(SSL_OP_ENABLE_KTLS)
+    // openssl hands the session keys to the kernel once the handshake is done, where the kernel can take them
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if(SSL_CTX_use_certificate_chain_file(context, cert_path) != 1 || SSL_CTX_use_PrivateKey_file(context, key_path, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(context) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        return NULL;
+    }
+
+    return context;
+}
+
+// the handshake runs in user space against the header deadline. afterwards either the kernel has the keys
+// for both directions and the handler gets the socket back, with read, write and sendfile working on
+// plaintext as before, or a relay thread takes over. returns the fd for the handler, -1 on failure.
+// conn is set up either way and has to go to tls_finish
+int tls_accept(SSL_CTX *context, int client_fd, int timeout_ms, struct tls_conn *conn)
+{
+    struct timespec deadline;
+    int             ret;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->client_fd  = client_fd;
+    conn->handler_fd = -1;
+    conn->relay_fd   = -1;
+
+    conn->ssl = SSL_new(context);
+    if(conn->ssl == NULL || SSL_set_fd(conn->ssl, client_fd) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / MS_PER_SEC;
+    deadline.tv_nsec += (long)(timeout_ms % MS_PER_SEC) * (long)NS_PER_MS;
+
+    // nonblocking only for the handshake, so a client that stalls in it cannot hold the worker
+    set_socket_nonblock(client_fd);
+    while((ret = SSL_accept(conn->ssl)) != 1)
+    {
+        struct pollfd pfd;
+        int           error = SSL_get_error(conn->ssl, ret);
+        long          wait_ms;
+
+        if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+        {
+            ERR_clear_error();
+            return -1;
+        }
+
+        wait_ms     = remaining_ms(&deadline);
+        pfd.fd      = client_fd;
+        pfd.events  = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        if(wait_ms <= 0 || poll(&pfd, 1, (int)wait_ms) == 0)
+        {
+            conn->timed_out = 1;
+            return -1;
+        }
+    }
+    set_fd_blocking(client_fd);
+
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+    // whatever openssl already decrypted would never reach the handler through the socket
+    if(BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) && !SSL_has_pending(conn->ssl))
+    {
+        conn->handler_fd = client_fd;
+        return conn->handler_fd;
+    }
+#endif
+
+    // pool threads hand shake concurrently, only the first one to get here reports
+    if(atomic_exchange(&relay_reported, 1) == 0)
+    {
+        printf("worker %d: kernel TLS not available, relaying TLS connections in user space\n", getpid());
+    }
+
+    if(start_relay(conn, timeout_ms) == -1)
+    {
+        return -1;
+    }
+
+    return conn->handler_fd;
+}
+
+// called once the handler returned. the relay sends what the handler left in the socketpair before it
+// stops, then the client gets a close_notify
+void tls_finish(struct tls_conn *conn)
+{
+    if(conn->relay_fd != -1)
+    {
+        close(conn->handler_fd);
+        pthread_join(conn->relay, NULL);
+        close(conn->relay_fd);
+    }
+
+    if(conn->ssl != NULL)
+    {
+        if(conn->handler_fd != -1)
+        {
+            SSL_shutdown(conn->ssl);
+        }
+        SSL_free(conn->ssl);
+    }
+
+    ERR_clear_error();
+}
+
+// the handler runs on a TLS connection the same way it runs on a plain one. a failed handshake
+// counts as a failed call, and as a header timeout when it ran out of time. clients on a unix socket
+// are a proxy on the same machine and speak plain http
+int tls_serve(SSL_CTX *context, int client_fd, int (*handler)(int, struct handler_ctx *), struct handler_ctx *ctx)
+{
+    struct tls_conn conn;
+    int             status;
+
+    if(socket_family(client_fd) == AF_UNIX)
+    {
+        return handler(client_fd, ctx);
+    }
+
+    if(tls_accept(context, client_fd, ctx->header_timeout_ms, &conn) == -1)
+    {
+        ctx->timeout   = conn.timed_out ? TIMEOUT_HEADER : TIMEOUT_NONE;
+        ctx->parsed_ns = 0;
+        status         = -1;
+    }
+    else
+    {
+        status = handler(conn.handler_fd, ctx);
+    }
+
+    tls_finish(&conn);
+
+    return status;
+}
+
+static long remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (deadline->tv_sec - now.tv_sec) * MS_PER_SEC + (deadline->tv_nsec - now.tv_nsec) / (long)NS_PER_MS;
+}
+
+// a thread per connection, only where the kernel cannot take the keys. poll only says a record has
+// started to arrive, the receive timeout keeps a client that stops halfway from holding the relay
+static int start_relay(struct tls_conn *conn, int timeout_ms)
+{
+    struct timeval receive_timeout;
+    int            sv[2];
+
+    receive_timeout.tv_sec  = timeout_ms / MS_PER_SEC;
+    receive_timeout.tv_usec = (timeout_ms % MS_PER_SEC) * US_PER_MS;
+    if(setsockopt(conn->client_fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) == -1)
+    {
+        perror("setsockopt SO_RCVTIMEO");
+        return -1;
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    {
+        perror("socketpair relay");
+        return -1;
+    }
+
+    conn->handler_fd = sv[0];
+    conn->relay_fd   = sv[1];
+    if(pthread_create(&conn->relay, NULL, relay_main, conn) != 0)
+    {
+        perror("pthread_create relay");
+        close(sv[0]);
+        close(sv[1]);
+        conn->handler_fd = -1;
+        conn->relay_fd   = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// the only thread that touches the SSL object until it is joined. the client socket is blocking, the
+// write deadline still applies to it through SO_SNDTIMEO, and the relay ends when the handler closes its end
+static void *relay_main(void *arg)
+{
+    struct tls_conn *conn = (struct tls_conn *)arg;
+    char             buffer[TLS_RELAY_BUFFER_SIZE];
+    int              client_open = 1;
+
+    for(;;)
+    {
+        struct pollfd pfds[2];
+
+        pfds[0].fd      = conn->client_fd;
+        pfds[0].events  = client_open ? POLLIN : 0;
+        pfds[0].revents = 0;
+        pfds[1].fd      = conn->relay_fd;
+        pfds[1].events  = POLLIN;
+        pfds[1].revents = 0;
+
+        // records openssl has already read do not show up on the socket
+        if(!(client_open && SSL_pending(conn->ssl) > 0) && poll(pfds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        if(client_open && (SSL_pending(conn->ssl) > 0 || (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))))
+        {
+            int n = SSL_read(conn->ssl, buffer, sizeof(buffer));
+
+            if(n <= 0)
+            {
+                // the handler sees the end of the request the way it would on a plain socket
+                client_open = 0;
+                shutdown(conn->relay_fd, SHUT_WR);
+            }
+            else if(write_all(conn->relay_fd, buffer, (size_t)n) == -1)
+            {
+                break;
+            }
+        }
+
+        if(pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = read(conn->relay_fd, buffer, sizeof(buffer));
+
+            if(n <= 0 || SSL_write(conn->ssl, buffer, (int)n) <= 0)
+            {
+                break;
+            }
+        }
+    }
+
+    // a handler still writing gets EPIPE, as it would from a client that went away
+    shutdown(conn->relay_fd, SHUT_RDWR);
+
+    return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        data += written;
+        len -= (size_t)written;
+    }
+
+    return 0;
+}
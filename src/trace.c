@@ -0,0 +1,108 @@
+#include "../include/trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char *const kind_names[TRACE_KINDS] = {"dispatch", "handoff", "pickup", "handle", "parse"};
+
+// anonymous memory is zero filled, sampling starts out off and nothing is touched until it is turned on
+struct trace_shared *trace_create(void)
+{
+    struct trace_shared *trace;
+
+    trace = (struct trace_shared *)mmap(NULL, sizeof(struct trace_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(trace == MAP_FAILED)
+    {
+        perror("mmap trace");
+        return NULL;
+    }
+
+    return trace;
+}
+
+void trace_destroy(struct trace_shared *trace)
+{
+    if(trace)
+    {
+        munmap(trace, sizeof(struct trace_shared));
+    }
+}
+
+// a new request id, and whether the request is sampled at the current rate
+uint64_t trace_begin(struct trace_shared *trace, int *traced)
+{
+    uint64_t     id    = atomic_fetch_add_explicit(&trace->next_id, 1, memory_order_relaxed) + 1;
+    unsigned int every = atomic_load_explicit(&trace->sample_every, memory_order_relaxed);
+
+    *traced = every != 0 && id % every == 0;
+
+    return id;
+}
+
+void trace_record(struct trace_shared *trace, uint64_t request_id, int kind, int tid, uint64_t start_ns, uint64_t end_ns)
+{
+    uint64_t           position = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+    struct trace_span *span     = &trace->spans[position % TRACE_CAPACITY];
+
+    atomic_store_explicit(&span->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    span->request_id = request_id;
+    span->start_ns   = start_ns;
+    span->end_ns     = end_ns;
+    span->pid        = getpid();
+    span->tid        = tid;
+    span->kind       = kind;
+
+    atomic_store_explicit(&span->sequence, position + 1, memory_order_release);
+}
+
+// the spans a worker owes for a traced request, written once the connection is done so tracing adds
+// nothing while the client waits
+void trace_worker(struct trace_shared *trace, const struct handoff *handoff, int tid, const struct trace_times *times)
+{
+    trace_record(trace, handoff->request_id, TRACE_HANDOFF, tid, handoff->sent_ns, times->received_ns);
+    if(times->started_ns > times->received_ns)
+    {
+        trace_record(trace, handoff->request_id, TRACE_PICKUP, tid, times->received_ns, times->started_ns);
+    }
+    trace_record(trace, handoff->request_id, TRACE_HANDLE, tid, times->started_ns, times->handled_ns);
+    if(times->parsed_ns != 0)
+    {
+        trace_record(trace, handoff->request_id, TRACE_PARSE, tid, times->started_ns, times->parsed_ns);
+    }
+}
+
+// copies the span written at position. returns -1 if it was overwritten since, or is being written right now
+int trace_read(struct trace_shared *trace, uint64_t position, struct trace_span *span)
+{
+    const struct trace_span *slot = &trace->spans[position % TRACE_CAPACITY];
+    uint64_t                 sequence;
+
+    sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if(sequence != position + 1)
+    {
+        return -1;
+    }
+
+    span->request_id = slot->request_id;
+    span->start_ns   = slot->start_ns;
+    span->end_ns     = slot->end_ns;
+    span->pid        = slot->pid;
+    span->tid        = slot->tid;
+    span->kind       = slot->kind;
+
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *trace_kind_name(int kind)
+{
+    return kind >= 0 && kind < TRACE_KINDS ? kind_names[kind] : "unknown";
+}
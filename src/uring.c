@@ -0,0 +1,400 @@
+#include "../include/timer.h"
+#include "../include/uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+// a header send plus a linked read and send per buffer, each send with its timeout
+    #define URING_ENTRIES 16
+    #define URING_BUFFER_ALIGN 4096
+
+    #define URING_HEADER 0
+    #define URING_READ 1
+    #define URING_SEND 2
+    #define URING_TIMEOUT 3
+
+struct uring
+{
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned            *sq_tail;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    void                *sq_ring;
+    void                *cq_ring;
+    char                *buffers;
+    size_t               sq_ring_size;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             sq_mask;
+    unsigned             cq_mask;
+    int                  fd;
+    int                  registered;         // buffers are registered, reads can use READ_FIXED
+    int                  send_timeout_ms;    // 0 lets a send wait for the client forever
+    char                 padding[4];
+};
+
+static struct io_uring_sqe *uring_next_sqe(struct uring *ring, unsigned *tail);
+static struct io_uring_sqe *uring_prep_send(struct uring *ring, unsigned *tail, int sock, const char *data, size_t len);
+static unsigned             uring_prep_timeout(struct uring *ring, unsigned *tail, const struct __kernel_timespec *timeout, unsigned count, char *roles, struct io_uring_sqe **last);
+static int                  uring_submit_and_wait(struct uring *ring, unsigned count);
+
+// returns NULL when the kernel does not offer io_uring or it is blocked, callers keep the sendfile path
+struct uring *uring_create(int send_timeout_ms)
+{
+    struct io_uring_params params;
+    struct uring          *ring;
+    struct iovec           iov[URING_BUFFER_COUNT];
+    void                  *buffers;
+
+    ring = (struct uring *)calloc(1, sizeof(struct uring));
+    if(ring == NULL)
+    {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(ring->fd == -1)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings with one call
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED || posix_memalign(&buffers, URING_BUFFER_ALIGN, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE) != 0)
+    {
+        if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if(ring->sqes != MAP_FAILED)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->buffers         = (char *)buffers;
+    ring->send_timeout_ms = send_timeout_ms;
+    ring->sq_tail         = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_array        = (unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->sq_mask         = *(unsigned *)(void *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->cq_head         = (unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail         = (unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask         = *(unsigned *)(void *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes            = (struct io_uring_cqe *)(void *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    // pinned once here so reads skip the per request page mapping. a low RLIMIT_MEMLOCK only
+    // costs that, the buffers still work with plain reads
+    for(int i = 0; i < URING_BUFFER_COUNT; i++)
+    {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len  = URING_BUFFER_SIZE;
+    }
+    ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFER_COUNT) == 0;
+
+    return ring;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if(ring == NULL)
+    {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring->buffers);
+    free(ring);
+}
+
+// the header and up to URING_BUFFER_COUNT chunks of the file go out as one linked chain per
+// io_uring_enter, read into a registered buffer then sent from it. every send carries a linked timeout
+// when the ring has one, the counterpart of SO_SNDTIMEO which io_uring does not look at. returns how
+// many bytes of the file were sent, which is less than length when a read came up short and the caller
+// has to finish the rest another way, or -1 with errno set when the client could not be written to
+off_t uring_send_file(struct uring *ring, int sock, const char *header, size_t header_len, int filefd, off_t offset, off_t length)
+{
+    struct __kernel_timespec timeout;
+    off_t                    sent = 0;
+
+    timeout.tv_sec  = ring->send_timeout_ms / MS_PER_SEC;
+    timeout.tv_nsec = (long long)(ring->send_timeout_ms % MS_PER_SEC) * (long long)NS_PER_MS;
+
+    while(header_len > 0 || sent < length)
+    {
+        struct io_uring_sqe *sqe   = NULL;
+        unsigned             tail  = *ring->sq_tail;
+        unsigned             count = 0;
+        size_t               expected[URING_ENTRIES];
+        int                  results[URING_ENTRIES];
+        char                 roles[URING_ENTRIES];
+        off_t                batch = 0;
+
+        if(header_len > 0)
+        {
+            sqe               = uring_prep_send(ring, &tail, sock, header, header_len);
+            sqe->user_data    = count;
+            roles[count]      = URING_HEADER;
+            expected[count++] = header_len;
+            count             = uring_prep_timeout(ring, &tail, &timeout, count, roles, &sqe);
+        }
+
+        for(int i = 0; i < URING_BUFFER_COUNT && sent + batch < length; i++)
+        {
+            char  *buffer = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+            size_t chunk  = length - sent - batch < URING_BUFFER_SIZE ? (size_t)(length - sent - batch) : URING_BUFFER_SIZE;
+
+            sqe               = uring_next_sqe(ring, &tail);
+            sqe->opcode       = ring->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd           = filefd;
+            sqe->addr         = (unsigned long)buffer;
+            sqe->len          = (unsigned)chunk;
+            sqe->off          = (unsigned long long)(offset + sent + batch);
+            sqe->buf_index    = (unsigned short)i;
+            sqe->user_data    = count;
+            sqe->flags        = IOSQE_IO_LINK;
+            roles[count]      = URING_READ;
+            expected[count++] = chunk;
+
+            sqe               = uring_prep_send(ring, &tail, sock, buffer, chunk);
+            sqe->user_data    = count;
+            roles[count]      = URING_SEND;
+            expected[count++] = chunk;
+            count             = uring_prep_timeout(ring, &tail, &timeout, count, roles, &sqe);
+
+            batch += (off_t)chunk;
+        }
+
+        // the chain ends with this batch
+        sqe->flags = 0;
+
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        if(uring_submit_and_wait(ring, count) == -1)
+        {
+            return header_len > 0 ? -1 : sent;
+        }
+
+        // completions of a chain can be posted out of order, match them up by index
+        for(unsigned head = *ring->cq_head, cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); head != cq_tail; head++)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+            if(cqe->user_data < count)
+            {
+                results[cqe->user_data] = cqe->res;
+            }
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        for(unsigned i = 0; i < count; i++)
+        {
+            if(roles[i] == URING_TIMEOUT)
+            {
+                continue;
+            }
+
+            // a short read severs the chain, the sends up to here went out
+            if(roles[i] == URING_READ)
+            {
+                if(results[i] < 0 || (size_t)results[i] != expected[i])
+                {
+                    return sent;
+                }
+                continue;
+            }
+
+            // a send cut off by its timeout reports what it got out before, or -ECANCELED if nothing
+            if(i + 1 < count && roles[i + 1] == URING_TIMEOUT && results[i + 1] == -ETIME)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            if(results[i] < 0)
+            {
+                errno = -results[i];
+                return -1;
+            }
+
+            if((size_t)results[i] != expected[i])
+            {
+                errno = EIO;
+                return roles[i] == URING_HEADER ? -1 : sent + results[i];
+            }
+
+            if(roles[i] == URING_SEND)
+            {
+                sent += results[i];
+            }
+        }
+
+        header_len = 0;
+    }
+
+    return sent;
+}
+
+static struct io_uring_sqe *uring_prep_send(struct uring *ring, unsigned *tail, int sock, const char *data, size_t len)
+{
+    struct io_uring_sqe *sqe = uring_next_sqe(ring, tail);
+
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = sock;
+    sqe->addr      = (unsigned long)data;
+    sqe->len       = (unsigned)len;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags     = IOSQE_IO_LINK;
+
+    return sqe;
+}
+
+// bounds the send just queued, the chain carries on past it. returns the new entry count
+static unsigned uring_prep_timeout(struct uring *ring, unsigned *tail, const struct __kernel_timespec *timeout, unsigned count, char *roles, struct io_uring_sqe **last)
+{
+    struct io_uring_sqe *sqe;
+
+    if(ring->send_timeout_ms == 0)
+    {
+        return count;
+    }
+
+    sqe            = uring_next_sqe(ring, tail);
+    sqe->opcode    = IORING_OP_LINK_TIMEOUT;
+    sqe->addr      = (unsigned long)timeout;
+    sqe->len       = 1;
+    sqe->user_data = count;
+    sqe->flags     = IOSQE_IO_LINK;
+    roles[count]   = URING_TIMEOUT;
+    *last          = sqe;
+
+    return count + 1;
+}
+
+static struct io_uring_sqe *uring_next_sqe(struct uring *ring, unsigned *tail)
+{
+    unsigned             index = *tail & ring->sq_mask;
+    struct io_uring_sqe *sqe   = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    (*tail)++;
+
+    return sqe;
+}
+
+// one syscall submits the batch and waits for all of its completions
+static int uring_submit_and_wait(struct uring *ring, unsigned count)
+{
+    unsigned submitted = 0;
+
+    // the kernel only waits once everything asked for was submitted
+    while(submitted < count)
+    {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("io_uring_enter");
+            return -1;
+        }
+        submitted += (unsigned)ret;
+    }
+
+    // a signal can cut the wait short after the submission went through
+    while(__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head < count)
+    {
+        if(syscall(__NR_io_uring_enter, ring->fd, 0, count, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#else
+
+struct uring *uring_create(int send_timeout_ms)
+{
+    (void)send_timeout_ms;
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    (void)ring;
+}
+
+off_t uring_send_file(struct uring *ring, int sock, const char *header, size_t header_len, int filefd, off_t offset, off_t length)
+{
+    (void)ring;
+    (void)sock;
+    (void)header;
+    (void)header_len;
+    (void)filefd;
+    (void)offset;
+    (void)length;
+    return -1;
+}
+
+#endif